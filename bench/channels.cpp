@@ -0,0 +1,130 @@
+#include "harness.h"
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <cstdlib>
+
+// Channel costs, each configuration in its own child process:
+//  * ping-pong: two threads bounce a message over a pair of channels, so
+//    every hop parks one side and wakes the other; reports the round
+//    trip time. With more than one worker the two threads may land on
+//    different workers (stealing decides), which adds the cross-worker
+//    wakeup.
+//  * fan-out / fan-in: one producer feeding FAN consumers, and FAN
+//    producers feeding one consumer, through a single channel; reports
+//    messages per second, unbuffered and with a 1024-slot ring.
+const int ROUND_TRIPS = 200000;
+const long MESSAGES = 2000000;
+const int FAN = 8;
+
+using Clock = std::chrono::steady_clock;
+
+struct Config {
+    const char* name;
+    int cores;
+    size_t capacity;
+    int producers;
+    int consumers;
+};
+
+static double ping_pong(size_t capacity) {
+    uthread::Channel<long> ping(capacity), pong(capacity);
+    auto echo = uthread::spawn([&] {
+        while (auto v = ping.recv()) pong.send(*v);
+    });
+    auto start = Clock::now();
+    for (long i = 0; i < ROUND_TRIPS; ++i) {
+        ping.send(i);
+        pong.recv();
+    }
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    ping.close();
+    echo.join();
+    return ns / ROUND_TRIPS;
+}
+
+static double fan(size_t capacity, int producers, int consumers) {
+    uthread::Channel<long> ch(capacity);
+    std::atomic<long> received{0};
+    long per_producer = MESSAGES / producers;
+
+    auto start = Clock::now();
+    std::vector<uthread::JoinHandle<void>> senders, receivers;
+    for (int c = 0; c < consumers; ++c) {
+        receivers.push_back(uthread::spawn([&] {
+            long n = 0;
+            while (ch.recv()) ++n;
+            received += n;
+        }));
+    }
+    for (int p = 0; p < producers; ++p) {
+        senders.push_back(uthread::spawn([&] {
+            for (long i = 0; i < per_producer; ++i) ch.send(i);
+        }));
+    }
+    for (auto& h : senders) h.join();
+    ch.close();
+    for (auto& h : receivers) h.join();
+    double s = std::chrono::duration<double>(Clock::now() - start).count();
+    if (received.load() != per_producer * producers) {
+        std::cerr << "lost messages\n";
+        std::exit(1);
+    }
+    return received.load() / s;
+}
+
+static double result = 0;
+static Config config;
+
+void run_config() {
+    if (config.producers == 0) {
+        result = ping_pong(config.capacity);
+    } else {
+        result = fan(config.capacity, config.producers, config.consumers);
+    }
+    uthread::shutdown();
+}
+
+static void run_in_child(const Config& c) {
+    double r = 0;
+    bool ok = bench::run_struct_in_child(
+        [&] {
+            config = c;
+            uthread::init(c.cores);
+            uthread::create(run_config);
+            uthread::run_scheduler_loop();
+            return result;
+        },
+        r);
+    if (!ok) {
+        std::cout << "[Result] " << c.name << ": failed\n";
+        return;
+    }
+
+    std::cout << "[Result] " << c.name << " | cap " << c.capacity << " | " << c.cores << " workers | ";
+    if (c.producers == 0) {
+        std::cout << r << " ns/round trip\n";
+    } else {
+        std::cout << (r / 1e6) << "M msgs/s\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int cores = 2;
+    if (argc > 1) cores = std::atoi(argv[1]);
+
+    std::cout << "[Bench] ping-pong " << ROUND_TRIPS << " round trips; fan-out/fan-in " << MESSAGES
+              << " messages, 1:" << FAN << " and " << FAN << ":1\n";
+    const Config configs[] = {
+        {"ping-pong", 1, 0, 0, 0},
+        {"ping-pong", cores, 0, 0, 0},
+        {"ping-pong", cores, 1, 0, 0},
+        {"fan-out  ", cores, 0, 1, FAN},
+        {"fan-out  ", cores, 1024, 1, FAN},
+        {"fan-in   ", cores, 0, FAN, 1},
+        {"fan-in   ", cores, 1024, FAN, 1},
+    };
+    for (const Config& c : configs) run_in_child(c);
+    return 0;
+}
@@ -0,0 +1,270 @@
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include "../include/uthread.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+// Shared harness for the benchmarks. Every run happens in a fresh child
+// process, since the runtime is process-global and a run should not
+// inherit the previous one's heap or stack pools.
+//
+// For bin/bench (bench/suite.cpp), a scenario run returns one sample per
+// operation (a round trip, a spawn, a wakeup...) plus an overall rate.
+// The first `warmup` runs are thrown away; the samples of the rest are
+// pooled into one summary. The standalone benches use
+// run_struct_in_child() and print their own results.
+namespace bench {
+    using Clock = std::chrono::steady_clock;
+
+    static inline double ns_since(Clock::time_point start) {
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    }
+
+    struct Run {
+        std::vector<double> samples;
+        double ops_per_sec = 0;
+    };
+
+    struct Summary {
+        std::string scenario;
+        std::string impl; // "uthread" or "pthread"
+        std::string unit;
+        int runs = 0;
+        size_t samples = 0;
+        double mean = 0, min = 0, p50 = 0, p99 = 0, p999 = 0, max = 0;
+        double ops_per_sec = 0; // Averaged over the runs
+    };
+
+    struct Config {
+        int warmup = 1;
+        int runs = 5;
+        int cores = 0; // Workers for the multi-worker scenarios
+        bool quick = false;
+        const char* json = nullptr;
+        const char* only = nullptr;
+    };
+
+    static inline bool write_all(int fd, const void* buf, size_t len) {
+        const char* p = static_cast<const char*>(buf);
+        while (len > 0) {
+            ssize_t n = write(fd, p, len);
+            if (n <= 0) return false;
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    static inline bool read_all(int fd, void* buf, size_t len) {
+        char* p = static_cast<char*>(buf);
+        while (len > 0) {
+            ssize_t n = read(fd, p, len);
+            if (n <= 0) return false;
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    struct Child {
+        pid_t pid = -1;
+        int fd = -1;
+    };
+
+    // Forks a child that runs body with the write end of a pipe and
+    // exits; the parent reads the other end from Child::fd.
+    static inline Child fork_child(const std::function<bool(int)>& body) {
+        Child c;
+        int pipefd[2];
+        if (pipe(pipefd) != 0) return c;
+        std::cout.flush();
+
+        c.pid = fork();
+        if (c.pid == 0) {
+            close(pipefd[0]);
+            _exit(body(pipefd[1]) ? 0 : 1);
+        }
+        close(pipefd[1]);
+        c.fd = pipefd[0];
+        return c;
+    }
+
+    // Closes the pipe and reaps the child; true if it also exited cleanly.
+    static inline bool reap(Child c, bool ok) {
+        close(c.fd);
+        int status = 0;
+        waitpid(c.pid, &status, 0);
+        return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    // Starts fn in a child process; finish() collects what it returned.
+    // The parent keeps running meanwhile (bin/bench's load generator).
+    static inline Child start_child(const std::function<Run()>& fn) {
+        return fork_child([&](int fd) {
+            Run r = fn();
+            size_t n = r.samples.size();
+            return write_all(fd, &n, sizeof(n)) && write_all(fd, &r.ops_per_sec, sizeof(double)) &&
+                   write_all(fd, r.samples.data(), n * sizeof(double));
+        });
+    }
+
+    // The child reports before it is reaped, so any amount of samples
+    // fits through the pipe.
+    static inline bool finish(Child c, Run& out) {
+        if (c.pid < 0) return false;
+        size_t n = 0;
+        bool ok = read_all(c.fd, &n, sizeof(n)) && read_all(c.fd, &out.ops_per_sec, sizeof(double));
+        if (ok) {
+            out.samples.resize(n);
+            ok = read_all(c.fd, out.samples.data(), n * sizeof(double));
+        }
+        return reap(c, ok);
+    }
+
+    static inline bool run_in_child(const std::function<Run()>& fn, Run& out) {
+        return finish(start_child(fn), out);
+    }
+
+    // Runs fn in a child and copies back the plain struct it returns;
+    // false if the child failed first.
+    template <typename T, typename F>
+    static inline bool run_struct_in_child(F fn, T& out) {
+        static_assert(std::is_trivially_copyable<T>::value, "the result is copied through a pipe");
+        Child c = fork_child([&](int fd) {
+            T r = fn();
+            return write_all(fd, &r, sizeof(r));
+        });
+        if (c.pid < 0) return false;
+        return reap(c, read_all(c.fd, &out, sizeof(out)));
+    }
+
+    // Starts the runtime, runs fn on a user thread and shuts down; for use
+    // inside run_in_child().
+    static inline Run run_uthread(const uthread::Options& options, const std::function<Run()>& fn) {
+        static Run result;
+        static const std::function<Run()>* body;
+        body = &fn;
+        uthread::init(options);
+        uthread::create([] {
+            result = (*body)();
+            uthread::shutdown();
+        });
+        uthread::run_scheduler_loop();
+        return result;
+    }
+
+    // Nearest rank on sorted samples.
+    static inline double percentile(const std::vector<double>& sorted, double q) {
+        if (sorted.empty()) return 0;
+        size_t rank = static_cast<size_t>(q * sorted.size());
+        return sorted[std::min(rank, sorted.size() - 1)];
+    }
+
+    class Report {
+    public:
+        explicit Report(const Config& config) : config_(config) {}
+
+        bool wanted(const char* scenario) const {
+            return !config_.only || std::strstr(scenario, config_.only) != nullptr;
+        }
+
+        // Warmup, then config.runs runs of fn pooled into one summary.
+        void measure(const char* scenario, const char* impl, const char* unit, const std::function<Run()>& fn) {
+            Summary s;
+            s.scenario = scenario;
+            s.impl = impl;
+            s.unit = unit;
+            std::vector<double> all;
+            for (int i = 0; i < config_.warmup + config_.runs; ++i) {
+                Run r;
+                if (!run_in_child(fn, r)) {
+                    std::cout << "[Result] " << scenario << " " << impl << ": failed\n";
+                    return;
+                }
+                if (i < config_.warmup) continue;
+                all.insert(all.end(), r.samples.begin(), r.samples.end());
+                s.ops_per_sec += r.ops_per_sec / config_.runs;
+                ++s.runs;
+            }
+            std::sort(all.begin(), all.end());
+            s.samples = all.size();
+            if (!all.empty()) {
+                double sum = 0;
+                for (double v : all) sum += v;
+                s.mean = sum / all.size();
+                s.min = all.front();
+                s.max = all.back();
+                s.p50 = percentile(all, 0.5);
+                s.p99 = percentile(all, 0.99);
+                s.p999 = percentile(all, 0.999);
+            }
+            print(s);
+            results_.push_back(s);
+        }
+
+        // uthread p50 against pthread p50 for every scenario that has both.
+        void compare() const {
+            for (const Summary& u : results_) {
+                if (u.impl != "uthread") continue;
+                for (const Summary& p : results_) {
+                    if (p.impl != "pthread" || p.scenario != u.scenario || u.p50 <= 0) continue;
+                    std::cout << "[Compare] " << std::left << std::setw(16) << u.scenario << std::right
+                              << " pthread/uthread p50 " << std::fixed << std::setprecision(2) << p.p50 / u.p50
+                              << "x\n";
+                }
+            }
+        }
+
+        bool write_json() const {
+            if (!config_.json) return true;
+            FILE* f = std::fopen(config_.json, "w");
+            if (!f) return false;
+            struct utsname un;
+            uname(&un);
+            std::fprintf(f, "{\n  \"machine\": {\"cpus\": %u, \"kernel\": \"%s %s\"},\n",
+                         std::thread::hardware_concurrency(), un.sysname, un.release);
+            std::fprintf(f, "  \"config\": {\"warmup\": %d, \"runs\": %d, \"cores\": %d, \"quick\": %s},\n",
+                         config_.warmup, config_.runs, config_.cores, config_.quick ? "true" : "false");
+            std::fprintf(f, "  \"results\": [");
+            for (size_t i = 0; i < results_.size(); ++i) {
+                const Summary& s = results_[i];
+                std::fprintf(f,
+                             "%s\n    {\"scenario\": \"%s\", \"impl\": \"%s\", \"unit\": \"%s\", \"runs\": %d, "
+                             "\"samples\": %zu, \"mean\": %.1f, \"min\": %.1f, \"p50\": %.1f, \"p99\": %.1f, "
+                             "\"p999\": %.1f, \"max\": %.1f, \"ops_per_sec\": %.1f}",
+                             i ? "," : "", s.scenario.c_str(), s.impl.c_str(), s.unit.c_str(), s.runs, s.samples,
+                             s.mean, s.min, s.p50, s.p99, s.p999, s.max, s.ops_per_sec);
+            }
+            std::fprintf(f, "\n  ]\n}\n");
+            return std::fclose(f) == 0;
+        }
+
+    private:
+        static void print(const Summary& s) {
+            std::cout << "[Result] " << std::left << std::setw(16) << s.scenario << std::setw(8) << s.impl
+                      << std::right << std::fixed << std::setprecision(1) << " | p50 " << s.p50 << " | p99 "
+                      << s.p99 << " | p999 " << s.p999 << " | mean " << s.mean << " " << s.unit;
+            if (s.ops_per_sec > 0) std::cout << " | " << std::setprecision(0) << s.ops_per_sec << " ops/s";
+            std::cout << " (" << s.samples << " samples, " << s.runs << " runs)\n";
+        }
+
+        Config config_;
+        std::vector<Summary> results_;
+    };
+}
+
+#endif
@@ -0,0 +1,158 @@
+#include "harness.h"
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Loopback TCP echo: CONNECTIONS clients each do MESSAGES request/reply
+// round trips of MSG_SIZE bytes against echo threads in the same process.
+// Every client and server thread spends its time parked in socket I/O, so
+// this measures the cost of the I/O backend: epoll readiness plus
+// syscalls, or io_uring submission and completion.
+const int CONNECTIONS = 64;
+const int MESSAGES = 2000;
+const size_t MSG_SIZE = 64;
+
+using Clock = std::chrono::steady_clock;
+
+int listen_fd = -1;
+sockaddr_in listen_addr;
+int server_fds[CONNECTIONS];
+std::atomic<int> handler_idx{0};
+std::atomic<int> clients_remaining{CONNECTIONS};
+std::atomic<long> total_rtt_ns{0};
+
+static bool read_full(int fd, char* buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        int n = uthread::socket_read(fd, buf + got, len - got);
+        if (n <= 0) return false;
+        got += n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const char* buf, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        int n = uthread::socket_send(fd, buf + sent, len - sent);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+void echo_handler() {
+    int fd = server_fds[handler_idx++];
+    char buf[MSG_SIZE];
+    while (read_full(fd, buf, MSG_SIZE) && write_full(fd, buf, MSG_SIZE)) {
+    }
+    uthread::socket_close(fd);
+}
+
+void acceptor() {
+    for (int i = 0; i < CONNECTIONS; ++i) {
+        int fd = uthread::socket_accept(listen_fd);
+        if (fd < 0) {
+            perror("accept");
+            std::exit(1);
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        server_fds[i] = fd;
+        uthread::create(echo_handler);
+    }
+}
+
+void client() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (uthread::socket_connect(fd, reinterpret_cast<sockaddr*>(&listen_addr), sizeof(listen_addr)) != 0) {
+        perror("connect");
+        std::exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    char buf[MSG_SIZE];
+    memset(buf, 'x', sizeof(buf));
+    auto start = Clock::now();
+    for (int i = 0; i < MESSAGES; ++i) {
+        if (!write_full(fd, buf, MSG_SIZE) || !read_full(fd, buf, MSG_SIZE)) {
+            std::cerr << "client: connection dropped\n";
+            std::exit(1);
+        }
+    }
+    total_rtt_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    uthread::socket_close(fd);
+
+    if (--clients_remaining == 0) uthread::shutdown();
+}
+
+struct Result {
+    bool uring;
+    double seconds;
+    double avg_rtt_us;
+};
+
+static Result run(int cores, uthread::IoBackend backend) {
+    uthread::Options options;
+    options.num_cores = cores;
+    options.io_backend = backend;
+    uthread::init(options);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_addr.sin_port = 0;
+    socklen_t len = sizeof(listen_addr);
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&listen_addr), sizeof(listen_addr)) != 0 ||
+        listen(listen_fd, CONNECTIONS) != 0 ||
+        getsockname(listen_fd, reinterpret_cast<sockaddr*>(&listen_addr), &len) != 0) {
+        perror("listen");
+        std::exit(1);
+    }
+
+    auto start = Clock::now();
+    uthread::create(acceptor);
+    for (int i = 0; i < CONNECTIONS; ++i) uthread::create(client);
+    uthread::run_scheduler_loop();
+
+    Result r;
+    r.uring = uthread::io_uring_active();
+    r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    r.avg_rtt_us = total_rtt_ns.load() / 1e3 / (double(CONNECTIONS) * MESSAGES);
+    return r;
+}
+
+static void run_in_child(int cores, uthread::IoBackend backend, const char* label) {
+    Result r;
+    if (!bench::run_struct_in_child([&] { return run(cores, backend); }, r)) {
+        std::cout << "[Result] " << label << ": failed\n";
+        return;
+    }
+
+    if (backend == uthread::IoBackend::IoUring && !r.uring) {
+        std::cout << "[Note] io_uring unavailable, this run used epoll\n";
+    }
+    double msgs = double(CONNECTIONS) * MESSAGES;
+    std::cout << "[Result] " << label << ": " << (msgs / r.seconds / 1e3) << "k round trips/s"
+              << " | avg RTT " << r.avg_rtt_us << " us | " << r.seconds << "s\n";
+}
+
+int main(int argc, char* argv[]) {
+    int cores = 2;
+    if (argc > 1) cores = std::atoi(argv[1]);
+
+    std::cout << "[Bench] " << CONNECTIONS << " connections x " << MESSAGES << " round trips of "
+              << MSG_SIZE << " bytes, " << cores << " workers\n";
+    run_in_child(cores, uthread::IoBackend::Epoll, "epoll   ");
+    run_in_child(cores, uthread::IoBackend::IoUring, "io_uring");
+    return 0;
+}
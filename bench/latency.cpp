@@ -1,9 +1,47 @@
-#include "../include/uthread.h"
+#include "harness.h"
+#include "../src/context.h"
 #include <iostream>
 #include <chrono>
+#include <vector>
 
 const int SWITCHES = 1000000;
 
+// ---------------------------------------------------------
+// Raw backend switch: main <-> one context, no scheduler involved
+// ---------------------------------------------------------
+template <typename Ctx>
+struct RawPingPong {
+    static Ctx main_ctx;
+    static Ctx fiber_ctx;
+
+    static void body() {
+        while (true) {
+            Ctx::swap(fiber_ctx, main_ctx);
+        }
+    }
+
+    static double run() {
+        std::vector<char> stack(64 * 1024);
+        fiber_ctx.make(stack.data(), stack.size(), body);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < SWITCHES; ++i) {
+            Ctx::swap(main_ctx, fiber_ctx);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::nano> elapsed = end - start;
+
+        // Each iteration is two switches (there and back)
+        return elapsed.count() / (SWITCHES * 2);
+    }
+};
+
+template <typename Ctx> Ctx RawPingPong<Ctx>::main_ctx;
+template <typename Ctx> Ctx RawPingPong<Ctx>::fiber_ctx;
+
+// ---------------------------------------------------------
+// Runtime yield ping-pong through the scheduler
+// ---------------------------------------------------------
 void ping() {
     for (int i = 0; i < SWITCHES; ++i) {
         uthread::yield();
@@ -15,27 +53,53 @@ void pong() {
         uthread::yield();
     }
     // NEW: When the last thread is done, stop the scheduler!
-    uthread::shutdown(); 
+    uthread::shutdown();
 }
 
-int main() {
-    // 1 Core to measure pure software overhead
-    uthread::init(1); 
+// ns per switch, 0 if the run failed.
+static double yield_ping_pong(bool stats_timing) {
+    double r = 0;
+    bool ok = bench::run_struct_in_child(
+        [&] {
+            // 1 Core to measure pure software overhead
+            uthread::Options options;
+            options.num_cores = 1;
+            options.stats_timing = stats_timing;
+            uthread::init(options);
+
+            auto start = std::chrono::high_resolution_clock::now();
 
-    auto start = std::chrono::high_resolution_clock::now();
+            uthread::create(ping);
+            uthread::create(pong);
 
-    uthread::create(ping);
-    uthread::create(pong);
-    
-    // This will now return when pong calls shutdown()
-    uthread::run_scheduler_loop();
+            // This will now return when pong calls shutdown()
+            uthread::run_scheduler_loop();
 
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::nano> elapsed = end - start;
+            auto end = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double, std::nano> elapsed = end - start;
 
-    // Total switches = SWITCHES * 2
-    double time_per_switch = elapsed.count() / (SWITCHES * 2);
+            // Total switches = SWITCHES * 2
+            return elapsed.count() / (SWITCHES * 2);
+        },
+        r);
+    return ok ? r : 0;
+}
+
+int main() {
+#ifdef UTHREAD_HAVE_ASM_CONTEXT
+    std::cout << "[Result] Raw Switch (" << AsmContext::name << "): "
+              << RawPingPong<AsmContext>::run() << " ns\n";
+#endif
+    std::cout << "[Result] Raw Switch (" << UContext::name << "): "
+              << RawPingPong<UContext>::run() << " ns\n";
 
-    std::cout << "[Result] Context Switch Latency: " << time_per_switch << " ns\n";
+    // Counters only, then with the timestamps and histograms as well
+    // (the default), to show what leaving stats on costs.
+    double counters_only = yield_ping_pong(false);
+    double timed = yield_ping_pong(true);
+    std::cout << "[Result] Context Switch Latency (" << Context::name << " backend, stats timing off): "
+              << counters_only << " ns\n";
+    std::cout << "[Result] Context Switch Latency (" << Context::name << " backend): " << timed << " ns ("
+              << (timed - counters_only) << " ns for stats timing)\n";
     return 0;
 }
@@ -0,0 +1,66 @@
+#include "harness.h"
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <thread>
+
+// 2..64 threads hammer one counter behind a uthread::Mutex on every core,
+// each round in its own child. The critical section is tiny, so this measures lock handoff and the
+// fast path rather than the work it protects.
+const long TOTAL_OPS = 2000000; // Lock/unlock pairs per round, split across threads
+
+uthread::Mutex counter_lock;
+long counter = 0;
+long ops_per_thread = 0;
+std::atomic<int> running{0};
+
+void hammer() {
+    for (long i = 0; i < ops_per_thread; ++i) {
+        counter_lock.lock();
+        counter++;
+        counter_lock.unlock();
+    }
+    if (--running == 0) uthread::shutdown();
+}
+
+struct Result {
+    double seconds;
+    long counter;
+};
+
+static Result run(int cores, int threads) {
+    uthread::init(cores);
+    ops_per_thread = TOTAL_OPS / threads;
+    running = threads;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < threads; ++i) uthread::create(hammer);
+    uthread::run_scheduler_loop();
+
+    Result r;
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    r.counter = counter;
+    return r;
+}
+
+int main(int argc, char* argv[]) {
+    int cores = (int)std::thread::hardware_concurrency();
+    if (argc > 1) cores = std::atoi(argv[1]);
+    if (cores <= 0) cores = 4;
+
+    std::cout << "[Bench] " << TOTAL_OPS << " lock/unlock pairs per round, " << cores << " workers\n";
+    for (int threads = 2; threads <= 64; threads *= 2) {
+        Result r;
+        if (!bench::run_struct_in_child([&] { return run(cores, threads); }, r)) {
+            std::cout << "[Result] Threads: " << threads << " | failed\n";
+            continue;
+        }
+
+        long expected = (TOTAL_OPS / threads) * threads;
+        std::cout << "[Result] Threads: " << threads << " | " << (expected / r.seconds / 1e6)
+                  << "M ops/s | " << (r.seconds * 1e9 / expected) << " ns/op"
+                  << (r.counter == expected ? "" : " | COUNTER MISMATCH") << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include "harness.h"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <cstdlib>
+#include <omp.h>
+
+// parallel_for / parallel_reduce against the usual alternatives, on two
+// kernels:
+//  * primes: counts primes below PRIMES_LIMIT by trial division. Work
+//    per index grows with the index, so an even static split leaves the
+//    first threads idle while the last one finishes.
+//  * triad: a[i] = b[i] + s * c[i] over TRIAD_LEN doubles, STREAM style;
+//    memory-bound, so it shows scheduling overhead against bandwidth.
+// Each runs serially, on std::threads with one equal slice each, with
+// OpenMP (dynamic schedule for primes, static for triad) and on the
+// uthread runtime, which runs in a child.
+const int PRIMES_LIMIT = 3000000;
+const int PRIMES_GRAIN = 2000;
+const size_t TRIAD_LEN = 16 * 1024 * 1024;
+const size_t TRIAD_GRAIN = 64 * 1024;
+const int TRIAD_REPS = 10;
+
+using Clock = std::chrono::steady_clock;
+
+static bool is_prime(int n) {
+    if (n < 2) return false;
+    for (int j = 2; j * j <= n; ++j) {
+        if (n % j == 0) return false;
+    }
+    return true;
+}
+
+static long count_primes(int from, int to) {
+    long count = 0;
+    for (int i = from; i < to; ++i) count += is_prime(i);
+    return count;
+}
+
+static std::vector<double> a, b, c;
+
+static void triad(size_t from, size_t to) {
+    const double s = 3.0;
+    for (size_t i = from; i < to; ++i) a[i] = b[i] + s * c[i];
+}
+
+struct Timing {
+    double primes_s = 0;
+    double triad_s = 0; // Per pass
+    long primes = 0;
+};
+
+// Runs f once to warm up, then times `reps` runs.
+static double timed(int reps, const std::function<void()>& f) {
+    f();
+    auto start = Clock::now();
+    for (int r = 0; r < reps; ++r) f();
+    return std::chrono::duration<double>(Clock::now() - start).count() / reps;
+}
+
+static Timing measure(const std::function<long()>& primes, const std::function<void()>& pass) {
+    a.assign(TRIAD_LEN, 0.0);
+    b.assign(TRIAD_LEN, 1.0);
+    c.assign(TRIAD_LEN, 2.0);
+    Timing t;
+    t.primes_s = timed(1, [&] { t.primes = primes(); });
+    t.triad_s = timed(TRIAD_REPS, pass);
+    return t;
+}
+
+static Timing run_serial() {
+    return measure([] { return count_primes(0, PRIMES_LIMIT); }, [] { triad(0, TRIAD_LEN); });
+}
+
+template <typename Index, typename F>
+static void split_threads(int cores, Index n, F&& f) {
+    std::vector<std::thread> threads;
+    for (int k = 0; k < cores; ++k) {
+        Index from = n * k / cores, to = n * (k + 1) / cores;
+        threads.emplace_back([&f, k, from, to] { f(k, from, to); });
+    }
+    for (auto& t : threads) t.join();
+}
+
+static Timing run_threads(int cores) {
+    return measure(
+        [cores] {
+            std::vector<long> counts(cores);
+            split_threads(cores, PRIMES_LIMIT, [&](int k, int from, int to) { counts[k] = count_primes(from, to); });
+            long total = 0;
+            for (long n : counts) total += n;
+            return total;
+        },
+        [cores] { split_threads(cores, TRIAD_LEN, [](int, size_t from, size_t to) { triad(from, to); }); });
+}
+
+static Timing run_openmp(int cores) {
+    omp_set_num_threads(cores);
+    return measure(
+        [] {
+            long total = 0;
+#pragma omp parallel for schedule(dynamic, PRIMES_GRAIN) reduction(+ : total)
+            for (int i = 0; i < PRIMES_LIMIT; ++i) total += is_prime(i);
+            return total;
+        },
+        [] {
+            const double s = 3.0;
+#pragma omp parallel for schedule(static)
+            for (size_t i = 0; i < TRIAD_LEN; ++i) a[i] = b[i] + s * c[i];
+        });
+}
+
+static Timing uthread_result;
+
+void run_uthread() {
+    uthread_result = measure(
+        [] {
+            return uthread::parallel_reduce(0, PRIMES_LIMIT, PRIMES_GRAIN, 0L, count_primes, std::plus<long>());
+        },
+        [] { uthread::parallel_for(size_t(0), TRIAD_LEN, TRIAD_GRAIN, triad); });
+    uthread::shutdown();
+}
+
+static bool run_uthread_child(int cores, Timing& out) {
+    return bench::run_struct_in_child(
+        [&] {
+            uthread::init(cores);
+            uthread::create(run_uthread);
+            uthread::run_scheduler_loop();
+            return uthread_result;
+        },
+        out);
+}
+
+static void report(const char* name, const Timing& t, const Timing& serial) {
+    double gbs = 3.0 * sizeof(double) * TRIAD_LEN / t.triad_s / 1e9;
+    std::cout << "[Result] " << std::left << std::setw(12) << name << std::right << std::fixed
+              << std::setprecision(3) << " | primes " << t.primes_s << "s (x" << std::setprecision(2)
+              << serial.primes_s / t.primes_s << ")"
+              << " | triad " << std::setprecision(2) << t.triad_s * 1e3 << " ms/pass, " << gbs << " GB/s (x"
+              << serial.triad_s / t.triad_s << ")";
+    if (t.primes != serial.primes) std::cout << " | WRONG COUNT " << t.primes;
+    std::cout << "\n";
+}
+
+int main(int argc, char* argv[]) {
+    int cores = 4;
+    if (argc > 1) cores = std::atoi(argv[1]);
+
+    std::cout << "[Bench] primes below " << PRIMES_LIMIT << " (grain " << PRIMES_GRAIN << "), triad over "
+              << TRIAD_LEN << " doubles (grain " << TRIAD_GRAIN << "), " << cores << " threads/workers\n";
+
+    // Fork before anything starts OpenMP's pool.
+    Timing ut;
+    bool ut_ok = run_uthread_child(cores, ut);
+
+    Timing serial = run_serial();
+    report("serial", serial, serial);
+    report("std::thread", run_threads(cores), serial);
+    report("openmp", run_openmp(cores), serial);
+    if (ut_ok) {
+        report("uthread", ut, serial);
+    } else {
+        std::cout << "[Result] uthread: failed\n";
+    }
+    return 0;
+}
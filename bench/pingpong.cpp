@@ -0,0 +1,121 @@
+#include "harness.h"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+// A producer sends a request over a channel and waits for the reply on a
+// second one; the consumer answers each. Each round trip is two
+// wakeups that the runnext slot should turn into direct switches. Run
+// idle, and with BUSY threads that compute and yield in a loop on the
+// same workers, which a woken consumer otherwise waits behind. Also
+// reports how often the pair was stolen by another worker and how many
+// yields the busy threads got through, which the starvation guard keeps
+// from dropping to nothing. bin/pingpong_fifo is the same program with
+// the runtime built with -DUTHREAD_NO_RUNNEXT.
+const int ROUNDS = 200000;
+const int BUSY = 8;
+const int BUSY_WORK_US = 2;
+
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+    double p50_ns = 0, p99_ns = 0;
+    double round_trips_per_sec = 0;
+    double busy_yields_per_sec = 0;
+    unsigned long long steals = 0;
+};
+
+static Result result;
+static std::atomic<bool> stop_busy{false};
+static std::atomic<long> busy_yields{0};
+
+static void busy_loop() {
+    while (!stop_busy.load(std::memory_order_relaxed)) {
+        auto until = Clock::now() + std::chrono::microseconds(BUSY_WORK_US);
+        while (Clock::now() < until) {
+        }
+        busy_yields.fetch_add(1, std::memory_order_relaxed);
+        uthread::yield();
+    }
+}
+
+static unsigned long long total_steals() {
+    unsigned long long n = 0;
+    for (const auto& w : uthread::stats().workers) n += w.steals;
+    return n;
+}
+
+static void driver(int busy) {
+    uthread::Channel<int> requests(1), replies(1);
+    std::vector<uthread::JoinHandle<void>> load;
+    for (int i = 0; i < busy; ++i) load.push_back(uthread::spawn(busy_loop));
+
+    auto consumer = uthread::spawn([&] {
+        while (auto v = requests.recv()) replies.send(*v + 1);
+    });
+
+    std::vector<double> samples;
+    samples.reserve(ROUNDS);
+    unsigned long long steals_before = total_steals();
+    long yields_before = busy_yields.load();
+    auto start = Clock::now();
+    for (int i = 0; i < ROUNDS; ++i) {
+        auto t0 = Clock::now();
+        requests.send(i);
+        if (replies.recv().value_or(-1) != i + 1) std::exit(1);
+        samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - t0).count());
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.busy_yields_per_sec = (busy_yields.load() - yields_before) / seconds;
+    result.steals = total_steals() - steals_before;
+
+    requests.close();
+    consumer.join();
+    stop_busy = true;
+    for (auto& t : load) t.join();
+
+    std::sort(samples.begin(), samples.end());
+    result.p50_ns = bench::percentile(samples, 0.5);
+    result.p99_ns = bench::percentile(samples, 0.99);
+    result.round_trips_per_sec = ROUNDS / seconds;
+    uthread::shutdown();
+}
+
+// All zero if the run failed.
+static Result run_in_child(int cores, int busy) {
+    Result r;
+    bool ok = bench::run_struct_in_child(
+        [&] {
+            uthread::init(cores);
+            uthread::spawn(driver, busy);
+            uthread::run_scheduler_loop();
+            return result;
+        },
+        r);
+    return ok ? r : Result();
+}
+
+int main(int argc, char* argv[]) {
+    int cores = 2;
+    if (argc > 1) cores = std::atoi(argv[1]);
+#ifdef UTHREAD_NO_RUNNEXT
+    const char* variant = "FIFO wakeups";
+#else
+    const char* variant = "runnext";
+#endif
+
+    std::cout << std::fixed << std::setprecision(0);
+    for (int busy : {0, BUSY}) {
+        Result r = run_in_child(cores, busy);
+        std::cout << "[Result] ping-pong (" << variant << "), " << busy << " busy threads: p50 " << r.p50_ns
+                  << " ns | p99 " << r.p99_ns << " ns | " << r.round_trips_per_sec << " round trips/s | "
+                  << r.steals << " steals";
+        if (busy) std::cout << " | " << r.busy_yields_per_sec << " busy yields/s";
+        std::cout << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,214 @@
+#include "harness.h"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// Spawn placement, two parts:
+//  * accept loop: a listener thread accepts CONNS connections and spawns
+//    a handler for each (as net_demo's server_task does), which reads a
+//    byte, computes for WORK_US and writes it back. CLIENTS OS threads
+//    connect, send, wait for the reply and close, one connection at a
+//    time. Run once per Placement; the busy time per worker (from
+//    uthread::stats()) shows how the handlers were spread.
+//  * external submitters: SUBMITTERS OS threads outside the runtime
+//    spawn SUBMITS threads each through the injection queue; reports the
+//    rate and the time from spawn() until the thread started.
+const int CONNS = 4000;
+const int CLIENTS = 8;
+const int WORK_US = 20;
+const int SUBMITTERS = 4;
+const int SUBMITS = 50000;
+const int MAX_OUTSTANDING = 1024;
+
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+    double seconds = 0;
+    double p50_us = 0, p99_us = 0;
+    int workers = 0;
+    double busy_share[64] = {}; // Per worker, of the total busy time
+};
+
+static Result result;
+static int listen_port = 0;
+static std::atomic<int> handled{0};
+
+static void busy_for(int us) {
+    auto until = Clock::now() + std::chrono::microseconds(us);
+    while (Clock::now() < until) {
+    }
+}
+
+static void handle(int fd) {
+    char c;
+    if (uthread::socket_read(fd, &c, 1) == 1) {
+        busy_for(WORK_US);
+        uthread::socket_write(fd, &c, 1);
+    }
+    uthread::socket_close(fd);
+    ++handled;
+}
+
+// One connection at a time; latency is connect to reply.
+static void client(int conns, std::vector<double>* latencies) {
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(listen_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; i < conns; ++i) {
+        auto start = Clock::now();
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        char c = 'x';
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || write(fd, &c, 1) != 1 ||
+            read(fd, &c, 1) != 1) {
+            std::perror("client");
+            std::exit(1);
+        }
+        close(fd);
+        latencies->push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+}
+
+static void listener() {
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(server_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(server_fd, 1024) != 0 ||
+        getsockname(server_fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+        std::perror("listen");
+        std::exit(1);
+    }
+    listen_port = ntohs(addr.sin_port);
+
+    uthread::RuntimeStats before = uthread::stats();
+    auto start = Clock::now();
+    std::vector<std::vector<double>> latencies(CLIENTS);
+    std::vector<std::thread> clients;
+    for (int i = 0; i < CLIENTS; ++i) clients.emplace_back(client, CONNS / CLIENTS, &latencies[i]);
+
+    for (int i = 0; i < CONNS; ++i) {
+        int fd = uthread::socket_accept(server_fd);
+        if (fd < 0) {
+            std::perror("accept");
+            std::exit(1);
+        }
+        uthread::spawn(handle, fd);
+    }
+    while (handled.load() < CONNS) uthread::sleep_for(std::chrono::milliseconds(1));
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    uthread::RuntimeStats after = uthread::stats();
+    for (auto& t : clients) t.join(); // Done already: every reply was written
+    uthread::socket_close(server_fd);
+
+    std::vector<double> all;
+    for (auto& l : latencies) all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    result.p50_us = bench::percentile(all, 0.5);
+    result.p99_us = bench::percentile(all, 0.99);
+
+    double total = 0;
+    result.workers = std::min<int>(after.workers.size(), 64);
+    for (int i = 0; i < result.workers; ++i) total += after.workers[i].busy_ns - before.workers[i].busy_ns;
+    for (int i = 0; i < result.workers && total > 0; ++i) {
+        result.busy_share[i] = (after.workers[i].busy_ns - before.workers[i].busy_ns) / total;
+    }
+    uthread::shutdown();
+}
+
+static std::atomic<int> started{0};
+static std::vector<double> start_latency_us(SUBMITTERS * SUBMITS);
+
+static void submitter() {
+    for (int i = 0; i < SUBMITS; ++i) {
+        while (i * SUBMITTERS - started.load(std::memory_order_relaxed) > MAX_OUTSTANDING) std::this_thread::yield();
+        auto created = Clock::now();
+        uthread::spawn([created] {
+            double us = std::chrono::duration<double, std::micro>(Clock::now() - created).count();
+            start_latency_us[started.fetch_add(1)] = us;
+        });
+    }
+}
+
+static void external() {
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < SUBMITTERS; ++i) threads.emplace_back(submitter);
+    uthread::create([] {
+        while (started.load() < SUBMITTERS * SUBMITS) uthread::sleep_for(std::chrono::milliseconds(1));
+        uthread::shutdown();
+    });
+    uthread::run_scheduler_loop();
+    for (auto& t : threads) t.join();
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    std::sort(start_latency_us.begin(), start_latency_us.end());
+    result.p50_us = bench::percentile(start_latency_us, 0.5);
+    result.p99_us = bench::percentile(start_latency_us, 0.99);
+}
+
+// All zero if the run failed.
+static Result run_in_child(int cores, uthread::Placement placement, bool accept_loop) {
+    Result r;
+    bool ok = bench::run_struct_in_child(
+        [&] {
+            uthread::Options options;
+            options.num_cores = cores;
+            options.spawn_placement = placement;
+            uthread::init(options);
+            if (accept_loop) {
+                uthread::create(listener);
+                uthread::run_scheduler_loop();
+            } else {
+                external();
+            }
+            return result;
+        },
+        r);
+    return ok ? r : Result();
+}
+
+int main(int argc, char* argv[]) {
+    int cores = 4;
+    if (argc > 1) cores = std::atoi(argv[1]);
+    if (cores < 2) cores = 2;
+
+    struct {
+        uthread::Placement placement;
+        const char* name;
+    } policies[] = {{uthread::Placement::Local, "local"},
+                    {uthread::Placement::RoundRobin, "round-robin"},
+                    {uthread::Placement::LeastLoaded, "least-loaded"}};
+
+    std::cout << std::fixed << std::setprecision(1);
+    for (const auto& p : policies) {
+        Result r = run_in_child(cores, p.placement, true);
+        double max_share = 0;
+        for (int i = 0; i < r.workers; ++i) max_share = std::max(max_share, r.busy_share[i]);
+        std::cout << "[Result] accept loop, " << std::left << std::setw(12) << p.name << std::right << ": "
+                  << CONNS / r.seconds << " conn/s | p50 " << r.p50_us << " us | p99 " << r.p99_us
+                  << " us | busy share";
+        for (int i = 0; i < r.workers; ++i) std::cout << " " << 100 * r.busy_share[i] << "%";
+        std::cout << " (max/mean " << std::setprecision(2) << max_share * r.workers << std::setprecision(1)
+                  << ")\n";
+    }
+
+    Result r = run_in_child(cores, uthread::Placement::Local, false);
+    std::cout << "[Result] external submitters (" << SUBMITTERS << " OS threads): "
+              << SUBMITTERS * SUBMITS / r.seconds << " spawns/s | spawn to start p50 " << r.p50_us << " us | p99 "
+              << r.p99_us << " us\n";
+    return 0;
+}
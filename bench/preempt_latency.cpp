@@ -0,0 +1,145 @@
+#include "harness.h"
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <thread>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// Mixed CPU and I/O load: HOGS_PER_CORE threads per worker crunch numbers
+// without ever yielding, while an OS thread writes a timestamp to a
+// socket every millisecond and a user thread reads them. The gap between
+// write and read is how long a thread whose I/O is ready waits for a
+// worker. Without preemption it waits for a hog to finish its whole run
+// (HOG_RUN); with a time slice, for a few slices at most. Also reports
+// how much work the hogs got done, i.e. what the switching costs them.
+const int HOGS_PER_CORE = 2;
+const int SAMPLES = 1000;
+const auto SAMPLE_INTERVAL = std::chrono::milliseconds(1);
+const auto HOG_RUN = std::chrono::milliseconds(1000); // Wall time per hog, at most
+
+using Clock = std::chrono::steady_clock;
+
+int sock[2];
+std::atomic<bool> stop_hogs{false};
+std::atomic<long> hog_chunks{0};
+uthread::WaitGroup all_done;
+volatile double sink = 0;
+
+void hog() {
+    auto end = Clock::now() + HOG_RUN;
+    while (!stop_hogs.load(std::memory_order_relaxed) && Clock::now() < end) {
+        double x = 0;
+        for (int i = 1; i < 10000; ++i) x += 1.0 / i;
+        sink = sink + x;
+        hog_chunks.fetch_add(1, std::memory_order_relaxed);
+    }
+    all_done.done();
+}
+
+struct Result {
+    double p50_us;
+    double p99_us;
+    double max_us;
+    long chunks;
+};
+
+Result result;
+
+void reader() {
+    std::vector<double> delays;
+    delays.reserve(SAMPLES);
+    for (int i = 0; i < SAMPLES; ++i) {
+        Clock::time_point sent;
+        char* p = reinterpret_cast<char*>(&sent);
+        size_t got = 0;
+        while (got < sizeof(sent)) {
+            ssize_t n = uthread::socket_read(sock[1], p + got, sizeof(sent) - got);
+            if (n <= 0) {
+                std::cerr << "reader: socket failed\n";
+                std::exit(1);
+            }
+            got += n;
+        }
+        delays.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+    }
+    stop_hogs = true;
+    result.chunks = hog_chunks.load();
+
+    std::sort(delays.begin(), delays.end());
+    result.p50_us = delays[delays.size() / 2];
+    result.p99_us = delays[delays.size() * 99 / 100];
+    result.max_us = delays.back();
+    all_done.done();
+}
+
+int num_hogs = 0;
+
+void spawner() {
+    all_done.add(num_hogs + 1);
+    uthread::create(reader);
+    for (int i = 0; i < num_hogs; ++i) uthread::create(hog);
+    all_done.wait();
+    uthread::shutdown();
+}
+
+// Plain OS thread, so it keeps time however busy the workers are.
+static void writer() {
+    for (int i = 0; i < SAMPLES; ++i) {
+        std::this_thread::sleep_for(SAMPLE_INTERVAL);
+        Clock::time_point now = Clock::now();
+        if (write(sock[0], &now, sizeof(now)) != sizeof(now)) {
+            perror("write");
+            std::exit(1);
+        }
+    }
+}
+
+static void run_in_child(int cores, std::chrono::microseconds slice) {
+    Result r;
+    bool ok = bench::run_struct_in_child(
+        [&] {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) != 0) {
+                perror("socketpair");
+                _exit(1);
+            }
+            num_hogs = cores * HOGS_PER_CORE;
+
+            uthread::Options options;
+            options.num_cores = cores;
+            options.time_slice = slice;
+            uthread::init(options);
+            std::thread clock_thread(writer);
+            uthread::create(spawner);
+            uthread::run_scheduler_loop();
+            clock_thread.join();
+            return result;
+        },
+        r);
+
+    std::cout << "[Result] time slice ";
+    if (slice.count() == 0) std::cout << "off  ";
+    else std::cout << slice.count() / 1000 << " ms ";
+    if (!ok) {
+        std::cout << "| failed\n";
+        return;
+    }
+    std::cout << "| I/O wait p50 " << r.p50_us << " us | p99 " << r.p99_us << " us | max " << r.max_us
+              << " us | hog chunks " << r.chunks << "\n";
+}
+
+int main(int argc, char* argv[]) {
+    int cores = (int)std::thread::hardware_concurrency();
+    if (argc > 1) cores = std::atoi(argv[1]);
+    if (cores <= 0) cores = 4;
+
+    std::cout << "[Bench] " << SAMPLES << " socket reads against " << cores * HOGS_PER_CORE
+              << " CPU-bound threads, " << cores << " workers\n";
+    run_in_child(cores, std::chrono::microseconds(0));
+    run_in_child(cores, std::chrono::microseconds(10000));
+    run_in_child(cores, std::chrono::microseconds(2000));
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include "harness.h"
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <thread>
+
+// Queueing delay per priority: a driver repeatedly creates a probe thread
+// at one priority and measures how long it sits in the ready queues
+// before it starts. Background threads at normal priority keep every
+// worker busy with short compute slices, so a high-priority probe should
+// start within about one slice regardless of how much background work is
+// queued, while normal and low probes wait behind it.
+const int PROBES = 300;         // Per priority level
+const int SLICE_ITERS = 20000;  // Background work between yields (~tens of us)
+
+using Clock = std::chrono::steady_clock;
+
+std::atomic<bool> stop_background{false};
+uthread::WaitGroup background_done;
+uthread::Semaphore probe_started;
+Clock::time_point probe_created;
+double probe_delay_us = 0;
+volatile int background_sink = 0;
+
+void background() {
+    while (!stop_background.load(std::memory_order_relaxed)) {
+        int x = 0;
+        for (int i = 0; i < SLICE_ITERS; ++i) x += i * i;
+        background_sink += x;
+        uthread::yield();
+    }
+    background_done.done();
+}
+
+void probe() {
+    probe_delay_us = std::chrono::duration<double, std::micro>(Clock::now() - probe_created).count();
+    probe_started.release();
+}
+
+const int LEVELS[] = {uthread::PRIORITY_HIGH, uthread::PRIORITY_NORMAL, uthread::PRIORITY_LOW};
+const char* LEVEL_NAMES[] = {"high  ", "normal", "low   "};
+
+struct Result {
+    double p50[3];
+    double p99[3];
+};
+
+int background_threads = 0;
+Result result;
+
+void driver() {
+    background_done.add(background_threads);
+    for (int i = 0; i < background_threads; ++i) uthread::create(background);
+
+    for (int l = 0; l < 3; ++l) {
+        std::vector<double> delays;
+        for (int i = 0; i < PROBES; ++i) {
+            probe_created = Clock::now();
+            uthread::create(probe, LEVELS[l]);
+            probe_started.acquire();
+            delays.push_back(probe_delay_us);
+        }
+        std::sort(delays.begin(), delays.end());
+        result.p50[l] = delays[delays.size() / 2];
+        result.p99[l] = delays[delays.size() * 99 / 100];
+    }
+
+    stop_background = true;
+    background_done.wait();
+    uthread::shutdown();
+}
+
+static bool run_in_child(int cores, int per_core, Result& r) {
+    return bench::run_struct_in_child(
+        [&] {
+            background_threads = cores * per_core;
+            uthread::init(cores);
+            // The driver itself must not queue behind the load it creates.
+            uthread::create(driver, uthread::PRIORITY_HIGH);
+            uthread::run_scheduler_loop();
+            return result;
+        },
+        r);
+}
+
+int main(int argc, char* argv[]) {
+    int cores = (int)std::thread::hardware_concurrency();
+    if (argc > 1) cores = std::atoi(argv[1]);
+    if (cores <= 0) cores = 4;
+
+    std::cout << "[Bench] " << PROBES << " probes per priority, " << cores << " workers\n";
+    for (int per_core : {0, 4, 32}) {
+        Result r;
+        if (!run_in_child(cores, per_core, r)) {
+            std::cout << "[Result] Background " << per_core << "/core: failed\n";
+            continue;
+        }
+        for (int l = 0; l < 3; ++l) {
+            std::cout << "[Result] Background " << per_core << "/core | " << LEVEL_NAMES[l]
+                      << " | p50 " << r.p50[l] << " us | p99 " << r.p99[l] << " us\n";
+        }
+    }
+    return 0;
+}
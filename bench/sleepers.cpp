@@ -0,0 +1,95 @@
+#include "../include/uthread.h"
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <cstdlib>
+
+// Timer wheel under load: SLEEPERS threads each sleep_for a random
+// 1..MAX_SLEEP_MS and record how late they woke. Every sleeper is parked
+// on a timer at once, so this measures arm cost (spawn rate), how well
+// the wheel holds up with a very large number of pending timers, and
+// wake-up lateness, which should stay around one tick (1 ms) plus
+// scheduling delay.
+const int DEFAULT_SLEEPERS = 1000000;
+const int MAX_SLEEP_MS = 1000;
+const size_t SLEEPER_STACK = 16 * 1024;
+
+using Clock = std::chrono::steady_clock;
+
+int sleepers = DEFAULT_SLEEPERS;
+std::vector<int> sleep_ms;       // Per sleeper
+std::vector<int64_t> late_us;    // Per sleeper
+std::atomic<int> next_sleeper{0};
+uthread::WaitGroup all_woken;
+double spawn_seconds = 0;
+
+void sleeper() {
+    int i = next_sleeper.fetch_add(1, std::memory_order_relaxed);
+    auto deadline = Clock::now() + std::chrono::milliseconds(sleep_ms[i]);
+    uthread::sleep_until(deadline);
+    late_us[i] = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - deadline).count();
+    all_woken.done();
+}
+
+void spawner() {
+    all_woken.add(sleepers);
+    auto start = Clock::now();
+    for (int i = 0; i < sleepers; ++i) {
+        uthread::create(sleeper, uthread::PRIORITY_NORMAL, SLEEPER_STACK);
+    }
+    spawn_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    all_woken.wait();
+    uthread::shutdown();
+}
+
+// Every stack is a mapping plus its guard page, so the kernel's mapping
+// limit caps how many threads can exist at once.
+static int max_sleepers() {
+    std::ifstream f("/proc/sys/vm/max_map_count");
+    long maps = 0;
+    if (!(f >> maps)) return DEFAULT_SLEEPERS;
+    return static_cast<int>(std::max(1000L, (maps - 4096) / 2));
+}
+
+int main(int argc, char* argv[]) {
+    int cores = 2;
+    if (argc > 1) sleepers = std::atoi(argv[1]);
+    if (argc > 2) cores = std::atoi(argv[2]);
+
+    int limit = max_sleepers();
+    if (sleepers > limit) {
+        std::cout << "[Note] vm.max_map_count allows ~" << limit << " stacks, running " << limit
+                  << " sleepers instead of " << sleepers << "\n";
+        sleepers = limit;
+    }
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist(1, MAX_SLEEP_MS);
+    sleep_ms.resize(sleepers);
+    late_us.resize(sleepers);
+    for (int& ms : sleep_ms) ms = dist(rng);
+
+    std::cout << "[Bench] " << sleepers << " threads sleeping 1.." << MAX_SLEEP_MS << " ms, " << cores
+              << " workers\n";
+
+    uthread::Options options;
+    options.num_cores = cores;
+    uthread::init(options);
+    auto start = Clock::now();
+    uthread::create(spawner);
+    uthread::run_scheduler_loop();
+    double total = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::sort(late_us.begin(), late_us.end());
+    auto pct = [](double p) { return late_us[static_cast<size_t>(p * (late_us.size() - 1))]; };
+    std::cout << "[Result] spawn: " << spawn_seconds << "s (" << (sleepers / spawn_seconds / 1e3)
+              << "k threads/s)\n";
+    std::cout << "[Result] lateness: p50 " << pct(0.5) << " us | p99 " << pct(0.99) << " us | max "
+              << late_us.back() << " us\n";
+    std::cout << "[Result] total: " << total << "s (" << (sleepers / total / 1e3) << "k wake-ups/s)\n";
+    return 0;
+}
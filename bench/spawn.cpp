@@ -0,0 +1,85 @@
+#include "harness.h"
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <sys/resource.h>
+
+// Spawns SPAWNS short-lived threads from a single spawner, which yields
+// whenever more than BATCH of them are outstanding so finished threads
+// hand their stacks back to the pool before the next batch needs them.
+// Runs once with create(void (*)()) and once with spawn() and a lambda
+// capturing 32 bytes, which should cost about the same: the closure goes
+// on the new thread's stack, not the heap.
+const int SPAWNS = 1000000;
+const int BATCH = 1000;
+
+std::atomic<int> finished{0};
+std::atomic<long> checksum{0};
+
+void task_done() {
+    if (++finished == SPAWNS) {
+        uthread::shutdown();
+    }
+}
+
+void short_task() {
+    task_done();
+}
+
+void create_spawner() {
+    for (int i = 0; i < SPAWNS; ++i) {
+        uthread::create(short_task);
+        while (i + 1 - finished.load() > BATCH) uthread::yield();
+    }
+}
+
+void closure_spawner() {
+    for (int i = 0; i < SPAWNS; ++i) {
+        long a = i, b = i * 2, c = i * 3, d = i * 4;
+        uthread::spawn([a, b, c, d] {
+            checksum.fetch_add(a + b + c + d, std::memory_order_relaxed);
+            task_done();
+        });
+        while (i + 1 - finished.load() > BATCH) uthread::yield();
+    }
+}
+
+struct Result {
+    double seconds;
+    double peak_rss_mib;
+};
+
+static void run_in_child(int cores, void (*spawner)(), const char* label) {
+    Result r;
+    bool ok = bench::run_struct_in_child(
+        [&] {
+            uthread::init(cores);
+            auto start = std::chrono::high_resolution_clock::now();
+            uthread::create(spawner);
+            uthread::run_scheduler_loop();
+            std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            return Result{elapsed.count(), usage.ru_maxrss / 1024.0};
+        },
+        r);
+    if (!ok) {
+        std::cout << "[Result] " << label << ": failed\n";
+        return;
+    }
+
+    std::cout << "[Result] " << label << ": Spawns: " << SPAWNS << " | Time: " << r.seconds << "s"
+              << " | Rate: " << (SPAWNS / r.seconds) << " spawns/s"
+              << " | Peak RSS: " << r.peak_rss_mib << " MiB\n";
+}
+
+int main(int argc, char* argv[]) {
+    int cores = 1;
+    if (argc > 1) cores = std::atoi(argv[1]);
+
+    run_in_child(cores, create_spawner, "create(fn)     ");
+    run_in_child(cores, closure_spawner, "spawn(lambda)  ");
+    return 0;
+}
@@ -0,0 +1,571 @@
+#include "harness.h"
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+// bin/bench: each scenario on the runtime and as the closest plain
+// pthread equivalent, through the shared harness (harness.h). All
+// results are in lower-is-better units.
+//  * yield:        two threads take turns through a shared flag, yielding
+//                  until it is theirs; ns per round trip. One worker, and
+//                  both pthreads pinned to one CPU, so every turn is a
+//                  switch on the same core.
+//  * spawn_join:   create a thread that does nothing and join it; ns each.
+//  * wakeup:       a thread parked on a semaphore is released from another
+//                  worker (kernel thread), which stays busy; ns from the
+//                  release until it runs.
+//  * mutex:        MUTEX_THREADS threads increment one counter under a
+//                  uthread::Mutex / std::mutex; ns per lock-unlock pair,
+//                  per batch of MUTEX_BATCH.
+//  * echo:         loopback TCP echo server (echo threads on the runtime,
+//                  or a pthread per connection) driven by the bundled
+//                  load generator, a separate single-threaded epoll
+//                  process keeping one request in flight per connection;
+//                  ns per round trip, and requests per second.
+//  * idle_memory:  threads parked on a semaphore; resident bytes per
+//                  thread. Both use 64 KiB stacks.
+//
+// Usage: bench [--runs N] [--warmup N] [--cores N] [--json FILE]
+//              [--only SCENARIO] [--quick]
+const int PINGPONG_ROUNDS = 100000;
+const int SPAWNS = 10000;
+const int WAKEUPS = 2000;
+const int WAKEUP_GAP_US = 100; // Lets the woken side park again
+const int MUTEX_THREADS = 8;
+const long MUTEX_OPS = 1000000; // Split across the threads
+const long MUTEX_BATCH = 1000;
+const int ECHO_CONNECTIONS = 16;
+const int ECHO_REQUESTS = 2000; // Per connection
+const size_t ECHO_SIZE = 64;
+const int IDLE_FIBERS = 1000000;  // Capped by vm.max_map_count
+const int IDLE_PTHREADS = 10000;
+const size_t IDLE_STACK = 64 * 1024;
+
+using bench::Clock;
+using bench::Run;
+using bench::ns_since;
+
+static int scale = 1; // --quick divides the sizes by 10
+
+static uthread::Options workers(int n) {
+    uthread::Options options;
+    options.num_cores = n;
+    return options;
+}
+
+static double per_sec(long ops, Clock::time_point start) {
+    return ops / (ns_since(start) / 1e9);
+}
+
+// ---------------------------------------------------------
+// yield
+// ---------------------------------------------------------
+
+// Turn 1 belongs to the partner; it hands back turn 0.
+template <typename Yield>
+static Run take_turns(std::atomic<int>& turn, int rounds, Yield yield) {
+    Run r;
+    r.samples.reserve(rounds);
+    auto start = Clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        auto t0 = Clock::now();
+        turn.store(1, std::memory_order_release);
+        while (turn.load(std::memory_order_acquire) != 0) yield();
+        r.samples.push_back(ns_since(t0));
+    }
+    r.ops_per_sec = per_sec(rounds, start);
+    return r;
+}
+
+template <typename Yield>
+static void partner(std::atomic<int>& turn, int rounds, Yield yield) {
+    for (int i = 0; i < rounds; ++i) {
+        while (turn.load(std::memory_order_acquire) != 1) yield();
+        turn.store(0, std::memory_order_release);
+    }
+}
+
+static Run yield_uthread() {
+    return bench::run_uthread(workers(1), [] {
+        int rounds = PINGPONG_ROUNDS / scale;
+        std::atomic<int> turn{0};
+        auto other = uthread::spawn([&] { partner(turn, rounds, uthread::yield); });
+        Run r = take_turns(turn, rounds, uthread::yield);
+        other.join();
+        return r;
+    });
+}
+
+static void pin_to_first_cpu() {
+    cpu_set_t allowed, one;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    CPU_ZERO(&one);
+    for (int c = 0; c < CPU_SETSIZE; ++c) {
+        if (!CPU_ISSET(c, &allowed)) continue;
+        CPU_SET(c, &one);
+        break;
+    }
+    sched_setaffinity(0, sizeof(one), &one);
+}
+
+static Run yield_pthread() {
+    int rounds = PINGPONG_ROUNDS / scale;
+    std::atomic<int> turn{0};
+    pin_to_first_cpu(); // The partner inherits it
+    std::thread other([&] { partner(turn, rounds, sched_yield); });
+    Run r = take_turns(turn, rounds, sched_yield);
+    other.join();
+    return r;
+}
+
+// ---------------------------------------------------------
+// spawn_join
+// ---------------------------------------------------------
+
+static Run spawn_uthread(int cores) {
+    return bench::run_uthread(workers(cores), [] {
+        int n = SPAWNS / scale;
+        Run r;
+        r.samples.reserve(n);
+        auto start = Clock::now();
+        for (int i = 0; i < n; ++i) {
+            auto t0 = Clock::now();
+            uthread::spawn([] {}).join();
+            r.samples.push_back(ns_since(t0));
+        }
+        r.ops_per_sec = per_sec(n, start);
+        return r;
+    });
+}
+
+static Run spawn_pthread() {
+    int n = SPAWNS / scale;
+    Run r;
+    r.samples.reserve(n);
+    auto start = Clock::now();
+    for (int i = 0; i < n; ++i) {
+        auto t0 = Clock::now();
+        std::thread([] {}).join();
+        r.samples.push_back(ns_since(t0));
+    }
+    r.ops_per_sec = per_sec(n, start);
+    return r;
+}
+
+// ---------------------------------------------------------
+// wakeup
+// ---------------------------------------------------------
+
+// The releasing side sleeps in the kernel between rounds, so the other
+// side has parked (its worker too, on the runtime) by the next release,
+// and spins afterwards so that somebody else has to run the woken thread.
+template <typename Release>
+static void release_rounds(int n, std::atomic<bool>& seen, Clock::time_point& posted, Release release) {
+    for (int i = 0; i < n; ++i) {
+        usleep(WAKEUP_GAP_US);
+        seen.store(false, std::memory_order_relaxed);
+        posted = Clock::now();
+        release();
+        while (!seen.load(std::memory_order_acquire)) sched_yield();
+    }
+}
+
+static Run wakeup_uthread(int cores) {
+    return bench::run_uthread(workers(std::max(cores, 2)), [] {
+        int n = WAKEUPS / scale;
+        Run r;
+        r.samples.reserve(n);
+        uthread::Semaphore go;
+        std::atomic<bool> seen{false};
+        Clock::time_point posted;
+        auto waiter = uthread::spawn([&] {
+            for (int i = 0; i < n; ++i) {
+                go.acquire();
+                r.samples.push_back(ns_since(posted));
+                seen.store(true, std::memory_order_release);
+            }
+        });
+        auto start = Clock::now();
+        release_rounds(n, seen, posted, [&] { go.release(); });
+        r.ops_per_sec = per_sec(n, start);
+        waiter.join();
+        return r;
+    });
+}
+
+static Run wakeup_pthread() {
+    int n = WAKEUPS / scale;
+    Run r;
+    r.samples.reserve(n);
+    sem_t go;
+    sem_init(&go, 0, 0);
+    std::atomic<bool> seen{false};
+    Clock::time_point posted;
+    std::thread waiter([&] {
+        for (int i = 0; i < n; ++i) {
+            sem_wait(&go);
+            r.samples.push_back(ns_since(posted));
+            seen.store(true, std::memory_order_release);
+        }
+    });
+    auto start = Clock::now();
+    release_rounds(n, seen, posted, [&] { sem_post(&go); });
+    r.ops_per_sec = per_sec(n, start);
+    waiter.join();
+    sem_destroy(&go);
+    return r;
+}
+
+// ---------------------------------------------------------
+// mutex
+// ---------------------------------------------------------
+
+template <typename Lock>
+static void hammer(Lock& lock, long& counter, long ops, std::vector<double>& samples) {
+    for (long done = 0; done < ops; done += MUTEX_BATCH) {
+        auto t0 = Clock::now();
+        for (long i = 0; i < MUTEX_BATCH; ++i) {
+            lock.lock();
+            counter++;
+            lock.unlock();
+        }
+        samples.push_back(ns_since(t0) / MUTEX_BATCH);
+    }
+}
+
+static Run merge(std::vector<std::vector<double>>& parts, long ops, Clock::time_point start) {
+    Run r;
+    r.ops_per_sec = per_sec(ops, start);
+    for (auto& p : parts) r.samples.insert(r.samples.end(), p.begin(), p.end());
+    return r;
+}
+
+static Run mutex_uthread(int cores) {
+    return bench::run_uthread(workers(cores), [] {
+        long per_thread = MUTEX_OPS / scale / MUTEX_THREADS;
+        uthread::Mutex lock;
+        long counter = 0;
+        std::vector<std::vector<double>> parts(MUTEX_THREADS);
+        std::vector<uthread::JoinHandle<void>> threads;
+        auto start = Clock::now();
+        for (int t = 0; t < MUTEX_THREADS; ++t) {
+            threads.push_back(uthread::spawn([&, t] { hammer(lock, counter, per_thread, parts[t]); }));
+        }
+        for (auto& h : threads) h.join();
+        return merge(parts, per_thread * MUTEX_THREADS, start);
+    });
+}
+
+static Run mutex_pthread() {
+    long per_thread = MUTEX_OPS / scale / MUTEX_THREADS;
+    std::mutex lock;
+    long counter = 0;
+    std::vector<std::vector<double>> parts(MUTEX_THREADS);
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (int t = 0; t < MUTEX_THREADS; ++t) {
+        threads.emplace_back([&, t] { hammer(lock, counter, per_thread, parts[t]); });
+    }
+    for (auto& t : threads) t.join();
+    return merge(parts, per_thread * MUTEX_THREADS, start);
+}
+
+// ---------------------------------------------------------
+// echo
+// ---------------------------------------------------------
+
+static int listen_loopback(sockaddr_in& addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, ECHO_CONNECTIONS) != 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+        perror("listen");
+        std::exit(1);
+    }
+    return fd;
+}
+
+// The load generator: one process, one epoll loop, ECHO_CONNECTIONS
+// connections each with one request in flight. Connects before the
+// server accepts; the listen backlog holds them.
+static Run load_generator(const sockaddr_in& addr) {
+    int n = ECHO_REQUESTS / scale;
+    struct Conn {
+        int fd;
+        size_t got = 0;
+        int sent = 0;
+        Clock::time_point t0;
+    };
+    std::vector<Conn> conns(ECHO_CONNECTIONS);
+    int ep = epoll_create1(0);
+    char msg[ECHO_SIZE];
+    std::memset(msg, 'x', sizeof(msg));
+
+    auto send_one = [&](Conn& c) {
+        c.t0 = Clock::now();
+        c.got = 0;
+        ++c.sent;
+        if (!bench::write_all(c.fd, msg, ECHO_SIZE)) std::exit(1);
+    };
+
+    Run r;
+    r.samples.reserve(size_t(n) * ECHO_CONNECTIONS);
+    for (size_t i = 0; i < conns.size(); ++i) {
+        Conn& c = conns[i];
+        c.fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(c.fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+            perror("loadgen connect");
+            std::exit(1);
+        }
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+
+    auto start = Clock::now();
+    for (Conn& c : conns) send_one(c);
+    int open = ECHO_CONNECTIONS;
+    while (open > 0) {
+        epoll_event events[ECHO_CONNECTIONS];
+        int ready = epoll_wait(ep, events, ECHO_CONNECTIONS, -1);
+        for (int k = 0; k < ready; ++k) {
+            Conn& c = conns[events[k].data.u64];
+            char buf[ECHO_SIZE];
+            ssize_t got = read(c.fd, buf, ECHO_SIZE - c.got);
+            if (got <= 0) std::exit(1);
+            c.got += got;
+            if (c.got < ECHO_SIZE) continue;
+            r.samples.push_back(ns_since(c.t0));
+            if (c.sent < n) {
+                send_one(c);
+            } else {
+                close(c.fd); // The server side sees EOF and finishes
+                --open;
+            }
+        }
+    }
+    r.ops_per_sec = per_sec(long(n) * ECHO_CONNECTIONS, start);
+    close(ep);
+    return r;
+}
+
+static void echo_uthread_conn(int fd) {
+    char buf[ECHO_SIZE];
+    int n;
+    while ((n = uthread::socket_read(fd, buf, sizeof(buf))) > 0) {
+        if (uthread::socket_write(fd, buf, n) != n) break;
+    }
+    uthread::socket_close(fd);
+}
+
+static Run echo_uthread(int cores) {
+    sockaddr_in addr;
+    int listen_fd = listen_loopback(addr);
+    // Forked before the runtime starts any kernel threads.
+    bench::Child loadgen = bench::start_child([&] { return load_generator(addr); });
+    Run r;
+    bench::run_uthread(workers(cores), [&] {
+        std::vector<uthread::JoinHandle<void>> conns;
+        for (int i = 0; i < ECHO_CONNECTIONS; ++i) {
+            int fd = uthread::socket_accept(listen_fd);
+            if (fd < 0) std::exit(1);
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            conns.push_back(uthread::spawn(echo_uthread_conn, fd));
+        }
+        for (auto& h : conns) h.join();
+        return Run();
+    });
+    if (!bench::finish(loadgen, r)) std::exit(1);
+    return r;
+}
+
+static Run echo_pthread() {
+    sockaddr_in addr;
+    int listen_fd = listen_loopback(addr);
+    bench::Child loadgen = bench::start_child([&] { return load_generator(addr); });
+    std::vector<std::thread> conns;
+    for (int i = 0; i < ECHO_CONNECTIONS; ++i) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) std::exit(1);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        conns.emplace_back([fd] {
+            char buf[ECHO_SIZE];
+            ssize_t n;
+            while ((n = read(fd, buf, sizeof(buf))) > 0) {
+                if (!bench::write_all(fd, buf, n)) break;
+            }
+            close(fd);
+        });
+    }
+    for (auto& t : conns) t.join();
+    Run r;
+    if (!bench::finish(loadgen, r)) std::exit(1);
+    return r;
+}
+
+// ---------------------------------------------------------
+// idle_memory
+// ---------------------------------------------------------
+
+static long resident_bytes() {
+    std::ifstream f("/proc/self/statm");
+    long size = 0, resident = 0;
+    f >> size >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Every stack is a mapping plus its guard page, for pthreads as well.
+static int mapping_limit(int wanted) {
+    std::ifstream f("/proc/sys/vm/max_map_count");
+    long maps = 0;
+    if (!(f >> maps)) return wanted;
+    return static_cast<int>(std::min<long>(wanted, std::max(1000L, (maps - 4096) / 2)));
+}
+
+static Run idle_uthread(int cores) {
+    return bench::run_uthread(workers(cores), [] {
+        int n = mapping_limit(IDLE_FIBERS / scale);
+        static uthread::Semaphore gate;
+        static uthread::WaitGroup finished;
+        static std::atomic<int> parked{0};
+        finished.add(n);
+
+        long before = resident_bytes();
+        auto start = Clock::now();
+        // create() rather than spawn(), which would add a JoinHandle's
+        // shared state per thread.
+        for (int i = 0; i < n; ++i) {
+            uthread::create(
+                [] {
+                    parked.fetch_add(1, std::memory_order_relaxed);
+                    gate.acquire();
+                    finished.done();
+                },
+                uthread::PRIORITY_NORMAL, IDLE_STACK);
+        }
+        while (parked.load(std::memory_order_relaxed) < n) uthread::sleep_for(std::chrono::milliseconds(1));
+        uthread::sleep_for(std::chrono::milliseconds(10)); // The last ones reach acquire()
+        Run r;
+        r.ops_per_sec = per_sec(n, start);
+        r.samples.push_back(double(resident_bytes() - before) / n);
+
+        gate.release(n);
+        finished.wait();
+        return r;
+    });
+}
+
+static Run idle_pthread() {
+    int n = mapping_limit(IDLE_PTHREADS / scale);
+    static sem_t gate;
+    static std::atomic<int> parked{0};
+    sem_init(&gate, 0, 0);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, IDLE_STACK);
+
+    long before = resident_bytes();
+    auto start = Clock::now();
+    std::vector<pthread_t> threads;
+    for (int i = 0; i < n; ++i) {
+        pthread_t t;
+        auto body = [](void*) -> void* {
+            parked.fetch_add(1, std::memory_order_relaxed);
+            sem_wait(&gate);
+            return nullptr;
+        };
+        if (pthread_create(&t, &attr, body, nullptr) != 0) break; // Out of threads
+        threads.push_back(t);
+    }
+    while (parked.load(std::memory_order_relaxed) < int(threads.size())) usleep(1000);
+    usleep(10000);
+    Run r;
+    r.ops_per_sec = per_sec(threads.size(), start);
+    if (!threads.empty()) r.samples.push_back(double(resident_bytes() - before) / threads.size());
+
+    for (size_t i = 0; i < threads.size(); ++i) sem_post(&gate);
+    for (pthread_t t : threads) pthread_join(t, nullptr);
+    pthread_attr_destroy(&attr);
+    return r;
+}
+
+int main(int argc, char* argv[]) {
+    bench::Config config;
+    config.cores = std::max<int>(2, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--runs" && has_value) {
+            config.runs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--warmup" && has_value) {
+            config.warmup = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--cores" && has_value) {
+            config.cores = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--json" && has_value) {
+            config.json = argv[++i];
+        } else if (arg == "--only" && has_value) {
+            config.only = argv[++i];
+        } else if (arg == "--quick") {
+            config.quick = true;
+            scale = 10;
+        } else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--runs N] [--warmup N] [--cores N] [--json FILE] [--only SCENARIO] [--quick]\n";
+            return 2;
+        }
+    }
+    int cores = config.cores;
+
+    std::cout << "[Bench] " << config.warmup << " warmup + " << config.runs << " runs per scenario, " << cores
+              << " workers, " << std::thread::hardware_concurrency() << " CPUs" << (config.quick ? ", quick" : "")
+              << "\n";
+    bench::Report report(config);
+    if (report.wanted("yield")) {
+        report.measure("yield", "uthread", "ns/round trip", yield_uthread);
+        report.measure("yield", "pthread", "ns/round trip", yield_pthread);
+    }
+    if (report.wanted("spawn_join")) {
+        report.measure("spawn_join", "uthread", "ns/thread", [cores] { return spawn_uthread(cores); });
+        report.measure("spawn_join", "pthread", "ns/thread", spawn_pthread);
+    }
+    if (report.wanted("wakeup")) {
+        report.measure("wakeup", "uthread", "ns", [cores] { return wakeup_uthread(cores); });
+        report.measure("wakeup", "pthread", "ns", wakeup_pthread);
+    }
+    if (report.wanted("mutex")) {
+        report.measure("mutex", "uthread", "ns/op", [cores] { return mutex_uthread(cores); });
+        report.measure("mutex", "pthread", "ns/op", mutex_pthread);
+    }
+    if (report.wanted("echo")) {
+        report.measure("echo", "uthread", "ns/round trip", [cores] { return echo_uthread(cores); });
+        report.measure("echo", "pthread", "ns/round trip", echo_pthread);
+    }
+    if (report.wanted("idle_memory")) {
+        report.measure("idle_memory", "uthread", "bytes/thread", [cores] { return idle_uthread(cores); });
+        report.measure("idle_memory", "pthread", "bytes/thread", idle_pthread);
+    }
+    report.compare();
+    if (!report.write_json()) {
+        std::cerr << "could not write " << config.json << "\n";
+        return 1;
+    }
+    return 0;
+}
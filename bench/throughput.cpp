@@ -1,19 +1,21 @@
-#include "../include/uthread.h"
+#include "harness.h"
 #include <iostream>
 #include <vector>
 #include <chrono>
 #include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <algorithm>
 
-std::atomic<int> tasks_remaining;
+uthread::WaitGroup tasks_done;
 // "volatile" tells the compiler: "Do not delete this variable, even if it looks useless."
-volatile int global_sink = 0; 
+volatile int global_sink = 0;
 
-void crunch_numbers() {
+static int count_primes(int from, int to) {
     int count = 0;
-    // INCREASED LOAD: 2 -> 500,000
-    // This forces the CPU to check primality for half a million numbers.
-    for (int i = 2; i < 500000; ++i) { 
-        bool prime = true;
+    for (int i = from; i < to; ++i) {
+        bool prime = i >= 2;
         for (int j = 2; j * j <= i; ++j) {
             if (i % j == 0) {
                 prime = false;
@@ -22,38 +24,138 @@ void crunch_numbers() {
         }
         if (prime) count++;
     }
-    
+    return count;
+}
+
+// 32 Tasks.
+// On 1 core, they run one by one.
+// On 4 cores, 4 run at once.
+const int COARSE_TASKS = 32;
+
+void run_coarse() {
+    std::vector<uthread::JoinHandle<int>> handles;
+    for (int i = 0; i < COARSE_TASKS; ++i) {
+        // INCREASED LOAD: 2 -> 500,000
+        // This forces the CPU to check primality for half a million numbers.
+        handles.push_back(uthread::spawn(count_primes, 2, 500000));
+    }
     // Write to volatile variable so the loop isn't deleted
-    global_sink += count; 
+    for (auto& h : handles) global_sink += h.join();
+    uthread::shutdown();
+}
 
-    if (--tasks_remaining == 0) {
-        uthread::shutdown();
+// Creates `num_tasks` copies of `task`, waits for all of them and stops
+// the runtime.
+static int num_tasks = 0;
+static void (*task)() = nullptr;
+static size_t task_stack = 0;
+
+void run_all() {
+    tasks_done.add(num_tasks);
+    for (int i = 0; i < num_tasks; ++i) {
+        uthread::create(task, 0, task_stack);
     }
+    tasks_done.wait();
+    uthread::shutdown();
 }
 
-int main(int argc, char* argv[]) {
-    int cores = 4; 
-    if (argc > 1) cores = std::atoi(argv[1]);
+// ---------------------------------------------------------
+// Fine-grained sweep: the same sieve cut into many small tasks, so the
+// ready queues (not the arithmetic) dominate.
+// ---------------------------------------------------------
+const int SWEEP_LIMIT = 2000000;
+const int SWEEP_GRAIN = 200; // Numbers per task (a few microseconds each)
+std::atomic<int> next_chunk{0};
 
-    uthread::init(cores);
+void crunch_chunk() {
+    int from = next_chunk.fetch_add(SWEEP_GRAIN);
+    global_sink += count_primes(from, std::min(from + SWEEP_GRAIN, SWEEP_LIMIT));
+    tasks_done.done();
+}
+
+static double run_fine_grained(int cores, bool pin = false) {
+    uthread::Options options;
+    options.num_cores = cores;
+    options.pin_workers = pin;
+    uthread::init(options);
 
     auto start = std::chrono::high_resolution_clock::now();
 
-    // 32 Tasks. 
-    // On 1 core, they run one by one. 
-    // On 4 cores, 4 run at once.
-    int num_tasks = 32;
-    tasks_remaining = num_tasks;
+    num_tasks = (SWEEP_LIMIT + SWEEP_GRAIN - 1) / SWEEP_GRAIN;
+    task = crunch_chunk;
+    task_stack = 16 * 1024;
+    uthread::create(run_all);
+    uthread::run_scheduler_loop();
 
-    for (int i = 0; i < num_tasks; ++i) {
-        uthread::create(crunch_numbers);
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = end - start;
+    return elapsed.count();
+}
+
+// Each core count runs in its own child.
+static void sweep(int max_cores) {
+    double base = 0;
+    std::cout << "[Sweep] " << (SWEEP_LIMIT / SWEEP_GRAIN) << " tasks of " << SWEEP_GRAIN
+              << " numbers each\n";
+    for (int cores = 1; cores <= max_cores; ++cores) {
+        double t = 0;
+        if (!bench::run_struct_in_child([&] { return run_fine_grained(cores); }, t)) continue;
+
+        if (cores == 1) base = t;
+        double speedup = base / t;
+        std::cout << "[Result] Cores: " << cores << " | Time: " << t << "s | Speedup: "
+                  << speedup << "x | Efficiency: " << (100.0 * speedup / cores) << "%\n";
     }
+}
+
+static void print_steals() {
+    uint64_t successes = 0, cross_node = 0;
+    for (const auto& st : uthread::steal_stats()) {
+        std::cout << "[Steals] Worker " << st.worker_id;
+        if (st.cpu >= 0) std::cout << " (CPU " << st.cpu << ", node " << st.node << ")";
+        std::cout << " | Attempts: " << st.attempts << " | Successes: " << st.successes
+                  << " | Tasks Moved: " << st.tasks_moved << " | Cross-node: " << st.cross_node << "\n";
+        successes += st.successes;
+        cross_node += st.cross_node;
+    }
+    std::cout << "[Steals] Cross-node: " << cross_node << " of " << successes << " successful steals\n";
+}
+
+// Pinned workers on the fine-grained sweep: shows where steals come from.
+// Thieves try SMT siblings, then their L3, then their node, so on a
+// multi-socket box cross-node steals should be a small share.
+static void topology_run(int cores) {
+    double t = run_fine_grained(cores, true);
+    std::cout << "[Result] Pinned, " << cores << " workers | Time: " << t << "s\n";
+    print_steals();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::strcmp(argv[1], "--sweep") == 0) {
+        int max_cores = argc > 2 ? std::atoi(argv[2]) : (int)std::thread::hardware_concurrency();
+        sweep(max_cores > 0 ? max_cores : 4);
+        return 0;
+    }
+    if (argc > 1 && std::strcmp(argv[1], "--topology") == 0) {
+        int cores = argc > 2 ? std::atoi(argv[2]) : 0;
+        topology_run(cores > 0 ? cores : (int)std::thread::hardware_concurrency());
+        return 0;
+    }
+
+    int cores = 4;
+    if (argc > 1) cores = std::atoi(argv[1]);
+
+    uthread::init(cores);
+
+    auto start = std::chrono::high_resolution_clock::now();
 
+    uthread::create(run_coarse);
     uthread::run_scheduler_loop();
 
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = end - start;
 
     std::cout << "[Result] Cores: " << cores << " | Time: " << elapsed.count() << "s\n";
+    print_steals();
     return 0;
 }
@@ -0,0 +1,114 @@
+#include "harness.h"
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <cstdlib>
+#include <sys/socket.h>
+
+// Built with -DUTHREAD_TRACE. Two parts:
+//  * cost: the yield ping-pong from bin/latency on one worker, tracer
+//    stopped and recording. Each switch records two events (run, then
+//    yield), so half the difference is the cost of one event. bin/latency
+//    is the same loop with the tracer compiled out.
+//  * a sample trace: echo threads blocked on socketpairs, a fork-join
+//    sum and a few yielders on `cores` workers, written as Chrome trace
+//    JSON to the path given (default trace.json).
+const int SWITCHES = 1000000;
+const int ECHO_PAIRS = 4;
+const int ECHO_ROUNDS = 200;
+
+using Clock = std::chrono::steady_clock;
+
+static double result = 0;
+
+static void ping_pong(bool traced) {
+    if (traced) uthread::trace_start();
+    auto body = [] {
+        for (int i = 0; i < SWITCHES; ++i) uthread::yield();
+    };
+    auto start = Clock::now();
+    auto a = uthread::spawn(body);
+    auto b = uthread::spawn(body);
+    a.join();
+    b.join();
+    result = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / (SWITCHES * 2);
+    uthread::shutdown();
+}
+
+// ns per switch, 0 if the run failed.
+static double switch_cost(bool traced) {
+    double r = 0;
+    bool ok = bench::run_struct_in_child(
+        [&] {
+            uthread::init(1);
+            uthread::spawn(ping_pong, traced);
+            uthread::run_scheduler_loop();
+            return result;
+        },
+        r);
+    return ok ? r : 0;
+}
+
+static void echo(int fd) {
+    char c;
+    while (uthread::socket_read(fd, &c, 1) == 1) uthread::socket_write(fd, &c, 1);
+}
+
+static void sample(const char* path) {
+    uthread::trace_start();
+
+    std::vector<uthread::JoinHandle<void>> threads;
+    std::vector<int> clients;
+    for (int i = 0; i < ECHO_PAIRS; ++i) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) std::exit(1);
+        threads.push_back(uthread::spawn(echo, sv[1]));
+        clients.push_back(sv[0]);
+    }
+    for (int fd : clients) {
+        threads.push_back(uthread::spawn([fd] {
+            char c = 'x';
+            for (int r = 0; r < ECHO_ROUNDS; ++r) {
+                uthread::socket_write(fd, &c, 1);
+                uthread::socket_read(fd, &c, 1);
+            }
+            uthread::socket_close(fd);
+        }));
+    }
+    for (int i = 0; i < 4; ++i) {
+        threads.push_back(uthread::spawn([] {
+            for (int r = 0; r < 100; ++r) uthread::yield();
+        }));
+    }
+    long sum = uthread::parallel_reduce(0L, 1L << 20, 1L << 14, 0L,
+                                        [](long lo, long hi) {
+                                            long s = 0;
+                                            for (long i = lo; i < hi; ++i) s += i;
+                                            return s;
+                                        },
+                                        std::plus<long>());
+    for (auto& t : threads) t.join();
+
+    uthread::trace_stop();
+    bool ok = uthread::trace_write(path);
+    std::cout << "[Result] sample trace (sum " << sum << ") " << (ok ? "written to " : "could not be written to ")
+              << path << "\n";
+    uthread::shutdown();
+}
+
+int main(int argc, char* argv[]) {
+    const char* path = argc > 1 ? argv[1] : "trace.json";
+    int cores = 2;
+    if (argc > 2) cores = std::atoi(argv[2]);
+
+    double off = switch_cost(false);
+    double on = switch_cost(true);
+    std::cout << "[Result] yield switch, tracer stopped: " << off << " ns\n";
+    std::cout << "[Result] yield switch, tracer recording: " << on << " ns (" << (on - off) / 2
+              << " ns per event)\n";
+
+    uthread::init(cores);
+    uthread::spawn(sample, path);
+    uthread::run_scheduler_loop();
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include "harness.h"
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+// Measures the idle protocol:
+//  * Idle CPU: every worker but one has nothing to do for IDLE_MS while
+//    the remaining one is blocked in the kernel. Ideally ~0% CPU.
+//  * Wake latency: a thread is created while every other worker is
+//    parked, and its creator keeps its own worker busy, so the time until
+//    it starts is the cost of waking a parked worker and stealing.
+const int IDLE_MS = 1000;
+const int WAKEUPS = 2000;
+
+using Clock = std::chrono::steady_clock;
+
+std::atomic<bool> consumer_done{false};
+Clock::time_point created_at;
+std::vector<double> latencies_us;
+
+static double cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+void consumer() {
+    auto now = Clock::now();
+    latencies_us.push_back(std::chrono::duration<double, std::micro>(now - created_at).count());
+    consumer_done = true;
+}
+
+void driver() {
+    // Phase 1: idle CPU. usleep() blocks this worker in the kernel, which
+    // leaves the others with nothing to run.
+    double cpu_before = cpu_seconds();
+    auto wall_before = Clock::now();
+    usleep(IDLE_MS * 1000);
+    double cpu = cpu_seconds() - cpu_before;
+    double wall = std::chrono::duration<double>(Clock::now() - wall_before).count();
+    std::cout << "[Result] Idle CPU: " << (100.0 * cpu / wall) << "% of one core over "
+              << wall << "s\n";
+
+    // Phase 2: wake latency.
+    latencies_us.reserve(WAKEUPS);
+    for (int i = 0; i < WAKEUPS; ++i) {
+        usleep(200); // Let the other workers go back to sleep
+        consumer_done = false;
+        created_at = Clock::now();
+        uthread::create(consumer);
+        // Keep this worker occupied so somebody else has to run it.
+        while (!consumer_done) sched_yield();
+    }
+
+    std::sort(latencies_us.begin(), latencies_us.end());
+    double sum = 0;
+    for (double l : latencies_us) sum += l;
+    std::cout << "[Result] Wake Latency: avg " << (sum / latencies_us.size()) << " us"
+              << " | p50 " << bench::percentile(latencies_us, 0.5) << " us"
+              << " | p99 " << bench::percentile(latencies_us, 0.99) << " us\n";
+
+    uthread::shutdown();
+}
+
+int main(int argc, char* argv[]) {
+    int cores = 4;
+    if (argc > 1) cores = std::atoi(argv[1]);
+    if (cores < 2) cores = 2;
+
+    uthread::init(cores);
+    uthread::create(driver);
+    uthread::run_scheduler_loop();
+    return 0;
+}
@@ -5,7 +5,8 @@
 #include <string>
 #include <mutex>
 
-std::mutex print_lock; // To prevent garbled console output
+uthread::Mutex print_lock; // To prevent garbled console output
+uthread::WaitGroup tasks_done;
 
 void heavy_task() {
     // Calculate primes to burn CPU
@@ -23,9 +24,21 @@ void heavy_task() {
     }
 
     {
-        std::lock_guard<std::mutex> lock(print_lock);
+        std::lock_guard<uthread::Mutex> lock(print_lock);
         std::cout << "Heavy Task Finished! Found " << primes << " primes.\n";
     }
+    tasks_done.done();
+}
+
+// Spawns the tasks and stops the runtime once all of them are done.
+void spawner() {
+    tasks_done.add(16);
+    for (int i = 0; i < 16; ++i) {
+        uthread::create(heavy_task);
+    }
+    tasks_done.wait();
+    std::cout << "[Main] All tasks finished.\n";
+    uthread::shutdown();
 }
 
 int main() {
@@ -37,9 +50,7 @@ int main() {
     // If we only had 1 core, these would run one by one.
     // With 4 cores, 4 should run at once!
     std::cout << "[Main] Spawning 16 heavy tasks...\n";
-    for (int i = 0; i < 16; ++i) {
-        uthread::create(heavy_task);
-    }
+    uthread::create(spawner);
 
     // 3. Main thread joins the party to help process tasks
     std::cout << "[Main] Helping run tasks...\n";
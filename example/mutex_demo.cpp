@@ -1,40 +1,42 @@
 #include "../include/uthread.h"
 #include <iostream>
+#include <vector>
+
+const int THREADS = 8;
+const int ITERATIONS = 100000;
 
 int shared_counter = 0;
 uthread::Mutex mutex;
 
 void worker_safe() {
-    for (int i = 0; i < 100000; ++i) {
+    for (int i = 0; i < ITERATIONS; ++i) {
         mutex.lock();
         shared_counter++; // Critical Section
         mutex.unlock();
     }
 }
 
-// A version that causes bugs (Race Condition)
-void worker_unsafe() {
-    for (int i = 0; i < 100000; ++i) {
-        shared_counter++; 
-        // Interrupt here causes data loss!
+void run_workers() {
+    std::vector<uthread::JoinHandle<void>> handles;
+    for (int i = 0; i < THREADS; ++i) {
+        handles.push_back(uthread::spawn(worker_safe));
     }
+    // Parks until each worker has returned
+    for (auto& h : handles) h.join();
+    uthread::shutdown();
 }
 
 int main() {
-    uthread::init();
+    uthread::init(4);
 
-    std::cout << "[Main] Testing SAFE increment (with Mutex)...\n";
+    std::cout << "[Main] Testing SAFE increment (with Mutex) on 4 workers...\n";
     shared_counter = 0;
-    
-    // Create 2 threads using the mutex
-    uthread::create(worker_safe);
-    uthread::create(worker_safe);
 
-    // Let them run
-    for(int i=0; i<50; i++) uthread::yield(); 
-    // (In a real app we'd need a 'join' primitive, but yield loop works for demo)
+    uthread::create(run_workers);
+    uthread::run_scheduler_loop();
+
+    std::cout << "Safe Counter Result: " << shared_counter << " (Expected: "
+              << THREADS * ITERATIONS << ")\n";
 
-    std::cout << "Safe Counter Result: " << shared_counter << " (Expected: 200000)\n";
-    
     return 0;
 }
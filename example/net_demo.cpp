@@ -1,7 +1,6 @@
 #include "../include/uthread.h"
 #include <iostream>
 #include <cstring>
-#include <unistd.h>
 #include <arpa/inet.h>
 
 void handle_client(int client_fd) {
@@ -12,13 +11,15 @@ void handle_client(int client_fd) {
         
         if (n <= 0) {
             // Connection closed or error
-            close(client_fd);
+            uthread::socket_close(client_fd);
             break;
         }
 
-        // Echo back (blocking write is fine for small demo, 
-        // ideally we'd implement socket_write too)
-        write(client_fd, buf, n);
+        // Echo back; parks this thread if the client is slow to read
+        if (uthread::socket_write(client_fd, buf, n) != n) {
+            uthread::socket_close(client_fd);
+            break;
+        }
     }
 }
 
@@ -43,46 +44,23 @@ void server_task() {
     std::cout << "[Server] Listening on port 9000...\n";
 
     while (true) {
-        // Note: accept() blocks the worker! 
-        // In a full implementation, we would wrap accept() in uthread::socket_accept
-        // using the same epoll logic. For this demo, we accept blocking, 
-        // but handle clients non-blocking.
-        int client_fd = accept(server_fd, nullptr, nullptr);
+        // Parks only this thread until a client connects
+        int client_fd = uthread::socket_accept(server_fd);
         if (client_fd >= 0) {
             std::cout << "[Server] New connection: " << client_fd << "\n";
             // Spawn a green thread for this client
-            // Note: We need to pass client_fd to the function.
-            // Our current create() only takes void(*)(), so we use a global/static hack
-            // or a capture-less lambda for this simple demo. 
-            // Better API: create(func, void* arg).
-            
-            // Quick hack for demo: Store in a hacky way or just use C++ lambda with static?
-            // Let's use a static queue of pending FDs to keep it simple.
-            
-            // Actually, let's just make 'create' smarter in the future.
-            // For now, we'll assume the client thread knows how to get its FD 
-            // (simulated by just spawning a fixed task or using a global for the demo).
-            
-            // To make this robust without changing 'create' API yet:
-            // We will just spin up a thread that calls a function which uses a global 'last_fd'.
-            // (Not thread safe but works for 1 listener thread).
-            
-            static int passing_fd = -1;
-            passing_fd = client_fd;
-            
-            uthread::create([]() {
-                int my_fd = passing_fd; // Capture roughly
-                handle_client(my_fd);
-            });
-            
-            // Small sleep to ensure the thread grabs the FD (racy but okay for demo)
-            usleep(1000); 
+            uthread::spawn(handle_client, client_fd);
         }
     }
 }
 
 int main() {
-    uthread::init(4); // 4 Workers
+    // 4 workers. Handlers go to the least loaded worker instead of
+    // piling up on the listener's.
+    uthread::Options options;
+    options.num_cores = 4;
+    options.spawn_placement = uthread::Placement::LeastLoaded;
+    uthread::init(options);
     uthread::create(server_task);
     uthread::run_scheduler_loop();
     return 0;
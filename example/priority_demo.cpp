@@ -1,33 +1,53 @@
 #include "../include/uthread.h"
 #include <iostream>
-#include <unistd.h>
+#include <mutex>
+
+uthread::Mutex print_lock;
+uthread::WaitGroup tasks_done;
 
 void low_priority_task() {
-    while(true) {
-        std::cout << "Low Priority Task\n";
-        // Slow it down slightly so we don't flood the console too fast
-        for (volatile int i = 0; i < 100000; ++i); 
+    for (int i = 0; i < 5; ++i) {
+        {
+            std::lock_guard<uthread::Mutex> lock(print_lock);
+            std::cout << "Low Priority Task\n";
+        }
+        // Slow it down slightly, then let the scheduler pick again
+        for (volatile int j = 0; j < 100000; ++j);
+        uthread::yield();
     }
+    tasks_done.done();
 }
 
 void high_priority_task() {
-    while(true) {
-        std::cout << "!!! HIGH PRIORITY TASK !!!\n";
-        for (volatile int i = 0; i < 100000; ++i);
+    for (int i = 0; i < 5; ++i) {
+        {
+            std::lock_guard<uthread::Mutex> lock(print_lock);
+            std::cout << "!!! HIGH PRIORITY TASK !!!\n";
+        }
+        for (volatile int j = 0; j < 100000; ++j);
+        uthread::yield();
     }
+    tasks_done.done();
 }
 
-int main() {
-    uthread::init();
+void spawner() {
+    // Created first, but the high priority thread should print first.
+    tasks_done.add(2);
+    std::cout << "[Main] Creating Low Priority...\n";
+    uthread::create(low_priority_task, uthread::PRIORITY_LOW);
 
-    std::cout << "[Main] Creating Low Priority (0)...\n";
-    uthread::create(low_priority_task, 0);
+    std::cout << "[Main] Creating High Priority...\n";
+    uthread::create(high_priority_task, uthread::PRIORITY_HIGH);
 
-    std::cout << "[Main] Creating High Priority (10)...\n";
-    uthread::create(high_priority_task, 10);
+    tasks_done.wait();
+    uthread::shutdown();
+}
 
-    // Let them fight!
-    while(true) {} 
+int main() {
+    // One worker, so both threads fight over the same queues
+    uthread::init(1);
+    uthread::create(spawner);
+    uthread::run_scheduler_loop();
 
     return 0;
 }
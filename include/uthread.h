@@ -1,30 +1,1159 @@
 #ifndef UTHREAD_H
 #define UTHREAD_H
 
-#include <deque>
-#include <memory>
-
-struct TCB; // Forward declaration
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 namespace uthread {
+    enum class IoBackend {
+        Epoll,   // Readiness via one epoll instance per worker
+        IoUring, // One io_uring per worker; falls back to Epoll if unavailable
+    };
+
+    // Where create() and spawn() queue a new thread. Local keeps it on
+    // the creating worker, where it starts on a warm cache but only
+    // spreads if other workers steal it. RoundRobin deals new threads to
+    // the workers in turn. LeastLoaded picks the worker with the fewest
+    // threads queued or running. Default means Options::spawn_placement.
+    enum class Placement { Default, Local, RoundRobin, LeastLoaded };
+
+    struct Options {
+        int num_cores = 0; // 0: one worker per CPU the process may run on
+        IoBackend io_backend = IoBackend::Epoll;
+        // Non-zero turns on preemption: a thread that keeps its worker's
+        // CPU for a whole slice without yielding or blocking is switched
+        // out at the next safe point, so it runs one to two slices at a
+        // time. Code running on a preempted thread must
+        // not hold OS locks (std::mutex) across the switch or keep
+        // thread_local addresses, since it may resume on another worker.
+        std::chrono::microseconds time_slice{0};
+        // Cap on the kernel threads block_on_os() may start; 0 picks the
+        // default (64).
+        int max_blocking_threads = 0;
+        // Pin each worker to its own CPU (init() pins the calling thread
+        // as worker 0). CPUs are handed out one per physical core before
+        // SMT siblings, filling a NUMA node before the next; thieves then
+        // try the nearest workers first, and stacks are bound to the
+        // worker's node. See src/topology.cpp.
+        bool pin_workers = false;
+        // Time run slices, run-queue waits and idle time for stats(), on
+        // one switch in 16. The plain counters are always on.
+        bool stats_timing = true;
+        // Write dump_stats() to stderr whenever the process gets SIGUSR1.
+        bool stats_on_sigusr1 = false;
+        Placement spawn_placement = Placement::Local;
+    };
+
     void init(int num_cores = 0); // New arg
-    void create(void (*func)(), int priority = 0);
+    void init(const Options& options);
+    // True if init() asked for IoUring and the kernel supports it.
+    bool io_uring_active();
+
+    // Each worker keeps one ready queue per priority level; higher levels
+    // run (and are stolen) first, and a waiting lower level is let through
+    // every 16 picks so it cannot starve. Positive priorities are high,
+    // zero is normal and negative ones are low.
+    const int PRIORITY_HIGH = 1;
+    const int PRIORITY_NORMAL = 0;
+    const int PRIORITY_LOW = -1;
+
+    // stack_size of 0 picks the default (64 KiB). Stacks are rounded up to
+    // a power of two and recycled through the worker's stack pool.
+    // create() and spawn() may also be called from any OS thread outside
+    // the runtime once init() has run; such threads go through the global
+    // injection queue, which every worker drains. Joining still has to
+    // happen on a user thread.
+    void create(void (*func)(), int priority = PRIORITY_NORMAL, size_t stack_size = 0);
+
+    struct SpawnOptions {
+        int priority = PRIORITY_NORMAL;
+        size_t stack_size = 0; // As for create()
+        Placement placement = Placement::Default;
+    };
+    // spawn(f, args...) is declared with the futures below.
+
+    // Changes the calling thread's priority from its next scheduling on.
+    void set_priority(int priority);
+    int get_priority();
     void yield();
-    int socket_read(int fd, char* buf, size_t len);
+
+    // Absolute point on the steady clock; max() means no deadline.
+    using Deadline = std::chrono::steady_clock::time_point;
+
+    // Park the calling thread, not its worker. Timers have 1 ms
+    // resolution and never fire early.
+    void sleep_until(Deadline deadline);
+    template <typename Rep, typename Period>
+    void sleep_for(const std::chrono::duration<Rep, Period>& d) {
+        sleep_until(std::chrono::steady_clock::now() +
+                    std::chrono::ceil<std::chrono::steady_clock::duration>(d));
+    }
+
+    // Blocking-style I/O that parks only the calling thread. Each returns
+    // what the matching syscall would (-1 with errno set on failure), and
+    // fails with ETIMEDOUT once `deadline` passes. The thread may resume
+    // on another worker, so check errno right after the call that set it.
+    ssize_t socket_read(int fd, char* buf, size_t len, Deadline deadline = Deadline::max());
+    // Writes all of buf. A short count means it failed part way.
+    ssize_t socket_write(int fd, const char* buf, size_t len, Deadline deadline = Deadline::max());
+    ssize_t socket_recv(int fd, char* buf, size_t len, int flags = 0, Deadline deadline = Deadline::max());
+    // send/sendmsg never raise SIGPIPE.
+    ssize_t socket_send(int fd, const char* buf, size_t len, int flags = 0, Deadline deadline = Deadline::max());
+    ssize_t socket_readv(int fd, const iovec* iov, int iovcnt, Deadline deadline = Deadline::max());
+    // Writes every iovec, like socket_write.
+    ssize_t socket_writev(int fd, const iovec* iov, int iovcnt, Deadline deadline = Deadline::max());
+    ssize_t socket_recvmsg(int fd, msghdr* msg, int flags = 0, Deadline deadline = Deadline::max());
+    ssize_t socket_sendmsg(int fd, const msghdr* msg, int flags = 0, Deadline deadline = Deadline::max());
+    // The accepted socket is close-on-exec.
+    int socket_accept(int fd, sockaddr* addr = nullptr, socklen_t* addrlen = nullptr,
+                      Deadline deadline = Deadline::max());
+    int socket_connect(int fd, const sockaddr* addr, socklen_t addrlen, Deadline deadline = Deadline::max());
+    // fds used with the socket_* calls must be closed through here, so
+    // the runtime can forget them before the number is reused.
+    int socket_close(int fd);
+
+    // Regular files. Asynchronous with io_uring; on the epoll backend they
+    // go through block_on_os(). file_read/file_write use and advance the
+    // file position.
+    int file_open(const char* path, int flags, mode_t mode = 0);
+    ssize_t file_read(int fd, void* buf, size_t len);
+    ssize_t file_write(int fd, const void* buf, size_t len);
+    ssize_t file_pread(int fd, void* buf, size_t len, off_t offset);
+    ssize_t file_pwrite(int fd, const void* buf, size_t len, off_t offset);
+    int file_fsync(int fd);
+
+    // io_uring only (-1 with ENOSYS otherwise). Registered buffers and
+    // files apply to every worker's ring; the *_fixed calls take an index
+    // into register_files() and, if buf_index >= 0, a registered buffer
+    // that contains buf.
+    int register_buffers(const iovec* iovs, unsigned count);
+    int register_files(const int* fds, unsigned count);
+    ssize_t file_pread_fixed(int file_index, void* buf, size_t len, off_t offset, int buf_index = -1);
+    ssize_t file_pwrite_fixed(int file_index, const void* buf, size_t len, off_t offset, int buf_index = -1);
+
+    // ---------------------------------------------------------
+    // Blocking calls
+    // ---------------------------------------------------------
+    // For anything that blocks its kernel thread and has no async form
+    // (getaddrinfo, stat, library calls): block_on_os(fn) runs fn() on a
+    // pool of kernel threads (see src/blocking.cpp), parks the calling
+    // thread until it returns and hands back its result, with errno as
+    // fn left it. fn runs on a plain kernel thread, so it must not call
+    // back into the runtime's blocking API. Off a user thread it just
+    // calls fn.
+
+    namespace detail {
+        struct BlockingCall {
+            void (*run)(BlockingCall* self) = nullptr;
+            BlockingCall* next = nullptr;
+            std::atomic<uint32_t> done{0};
+            int error = 0;
+        };
+
+        void block_on_pool(BlockingCall* c);
+
+        template <typename F, typename R>
+        struct OffloadCall : BlockingCall {
+            F* fn;
+            std::optional<R> result;
+
+            explicit OffloadCall(F& f) : fn(&f) {
+                run = [](BlockingCall* c) {
+                    auto* s = static_cast<OffloadCall*>(c);
+                    s->result.emplace(std::invoke(*s->fn));
+                };
+            }
+        };
+
+        template <typename F>
+        struct OffloadCall<F, void> : BlockingCall {
+            F* fn;
+
+            explicit OffloadCall(F& f) : fn(&f) {
+                run = [](BlockingCall* c) { std::invoke(*static_cast<OffloadCall*>(c)->fn); };
+            }
+        };
+    }
+
+    template <typename F>
+    std::invoke_result_t<F&> block_on_os(F&& fn) {
+        using R = std::invoke_result_t<F&>;
+        detail::OffloadCall<std::remove_reference_t<F>, R> call(fn);
+        detail::block_on_pool(&call);
+        if constexpr (!std::is_void_v<R>) return std::move(*call.result);
+    }
+
+    struct BlockingStats {
+        int threads;       // Pool threads alive, running a call or idle
+        int idle_threads;
+        int max_threads;
+        size_t queued;     // Calls waiting for a thread right now
+        size_t max_queued; // Most ever waiting at once
+        uint64_t calls;    // Submitted so far
+    };
+    BlockingStats blocking_stats();
+
     void exit();
     void run_scheduler_loop(); // New: Main thread becomes a worker too
     void shutdown();
 
+    // Work-stealing counters, one entry per worker. An attempt is one
+    // victim probed; a success moves up to half of that victim's queue.
+    struct StealStats {
+        int worker_id;
+        uint64_t attempts;
+        uint64_t successes;
+        uint64_t tasks_moved;
+        uint64_t cross_node; // Successes against a worker on another NUMA node
+        int cpu;             // -1 unless pinned
+        int node;
+    };
+    std::vector<StealStats> steal_stats();
+
+    // Log2 histogram: counts[i] holds the samples in [2^i, 2^(i+1)) ns,
+    // counts[0] also those under 1 ns.
+    struct Histogram {
+        static const int BUCKETS = 48;
+        uint64_t counts[BUCKETS] = {};
+
+        uint64_t total() const;
+        // Upper bound of the bucket holding the q-th quantile (0..1), in
+        // ns; 0 when empty.
+        uint64_t percentile(double q) const;
+    };
+
+    // Per-worker counters. Busy is time spent running threads, idle time
+    // parked waiting for work; the rest went to searching and I/O polls.
+    // The histograms hold a sample of the switches and busy_ns is scaled
+    // up from it; they and the times stay empty with stats_timing off.
+    struct WorkerStats {
+        int worker_id;
+        uint64_t switches;       // Threads switched in
+        uint64_t spawns;         // Threads created on this worker
+        uint64_t steal_attempts;
+        uint64_t steals;
+        uint64_t parks;
+        uint64_t io_wakeups;     // Threads readied by epoll or io_uring
+        uint64_t timer_wakeups;  // Threads readied by expired timers
+        uint64_t busy_ns;
+        uint64_t idle_ns;
+        size_t queued;           // Ready queue depth right now
+        Histogram run_queue_wait; // Made ready until switched in
+        Histogram run_slice;      // Switched in until switched out
+    };
+
+    struct RuntimeStats {
+        uint64_t uptime_ns;      // Since init()
+        size_t injection_queued; // Global injection queue depth
+        BlockingStats blocking;
+        std::vector<WorkerStats> workers;
+    };
+    // Counters are read without stopping the workers, so a snapshot is
+    // only consistent per counter.
+    RuntimeStats stats();
+    // Human-readable stats() to fd.
+    void dump_stats(int fd = 2);
+
+    // Fiber tracing, compiled in with -DUTHREAD_TRACE (see src/trace.cpp);
+    // without it these do nothing and the hooks cost nothing. Each worker
+    // keeps its last 64K events (create, run, yield, block, wake, steal,
+    // finish) in a ring of its own.
+    bool trace_start(); // False if tracing was compiled out
+    void trace_stop();
+    // Chrome trace JSON, for chrome://tracing or ui.perfetto.dev: a track
+    // per worker, a flow arrow per thread. Best stopped first; a running
+    // tracer may overwrite events while they are being read.
+    bool trace_write(const char* path);
+
+    // Blocks the calling user thread, not its worker. Uncontended lock and
+    // unlock are a single atomic each; contended lockers spin briefly,
+    // then queue. A waiter starved for over 1 ms switches the mutex to
+    // direct handoff in FIFO order (see src/sync.cpp).
     class Mutex {
     private:
-        bool locked;
-        std::shared_ptr<TCB> owner;
-        std::deque<std::shared_ptr<TCB>> waiting_queue;
+        std::atomic<int32_t> state_;
+        std::atomic<uint32_t> sema_; // Wakeup count, see sema_acquire
+
+        void lock_slow();
+        void unlock_slow(int32_t next);
 
     public:
         Mutex();
+        Mutex(const Mutex&) = delete;
+        Mutex& operator=(const Mutex&) = delete;
+
         void lock();
+        bool try_lock();
+        // False if the deadline passed first. Timed lockers do not queue
+        // with lock(); they are woken to retry whenever it is unlocked.
+        bool try_lock_until(Deadline deadline);
+        template <typename Rep, typename Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& d) {
+            return try_lock_until(std::chrono::steady_clock::now() +
+                                  std::chrono::ceil<std::chrono::steady_clock::duration>(d));
+        }
         void unlock();
     };
+
+    // Wait queues live in the runtime (src/sync.cpp), so none of these
+    // hold anything but a few counters, and all of them park the user
+    // thread rather than block its worker. Call them from user threads.
+    class CondVar {
+    public:
+        CondVar() = default;
+        CondVar(const CondVar&) = delete;
+        CondVar& operator=(const CondVar&) = delete;
+
+        // `m` must be locked; it is released while waiting and re-locked
+        // before returning. Wakeups may be spurious.
+        void wait(Mutex& m);
+        // False if the deadline passed before a notify.
+        bool wait_until(Mutex& m, Deadline deadline);
+        template <typename Rep, typename Period>
+        bool wait_for(Mutex& m, const std::chrono::duration<Rep, Period>& d) {
+            return wait_until(m, std::chrono::steady_clock::now() +
+                                 std::chrono::ceil<std::chrono::steady_clock::duration>(d));
+        }
+        template <typename Pred>
+        void wait(Mutex& m, Pred pred) {
+            while (!pred()) wait(m);
+        }
+        // Returns pred() as of the deadline if it passed first.
+        template <typename Pred>
+        bool wait_until(Mutex& m, Deadline deadline, Pred pred) {
+            while (!pred()) {
+                if (!wait_until(m, deadline)) return pred();
+            }
+            return true;
+        }
+        void notify_one();
+        void notify_all();
+    };
+
+    class Semaphore {
+    private:
+        std::atomic<uint32_t> count_;
+
+    public:
+        explicit Semaphore(uint32_t initial = 0);
+        Semaphore(const Semaphore&) = delete;
+        Semaphore& operator=(const Semaphore&) = delete;
+
+        void acquire();
+        bool try_acquire();
+        // False if the deadline passed first.
+        bool try_acquire_until(Deadline deadline);
+        template <typename Rep, typename Period>
+        bool try_acquire_for(const std::chrono::duration<Rep, Period>& d) {
+            return try_acquire_until(std::chrono::steady_clock::now() +
+                                     std::chrono::ceil<std::chrono::steady_clock::duration>(d));
+        }
+        void release(uint32_t n = 1);
+    };
+
+    // Writer-preferring: once a writer is waiting, new readers queue
+    // behind it, so a steady stream of readers cannot starve writers.
+    class RWLock {
+    private:
+        Mutex writer_;
+        std::atomic<uint32_t> writer_sem_;
+        std::atomic<uint32_t> reader_sem_;
+        std::atomic<int32_t> reader_count_;
+        std::atomic<int32_t> reader_wait_;
+
+    public:
+        RWLock();
+        RWLock(const RWLock&) = delete;
+        RWLock& operator=(const RWLock&) = delete;
+
+        void lock();
+        void unlock();
+        void lock_shared();
+        void unlock_shared();
+    };
+
+    // add() before starting the work, done() when each piece finishes,
+    // wait() until the count drops to zero. Reusable once wait() returns.
+    class WaitGroup {
+    private:
+        std::atomic<uint64_t> state_; // Counter (high 32 bits), waiters (low)
+        std::atomic<uint32_t> sema_;
+
+    public:
+        WaitGroup();
+        WaitGroup(const WaitGroup&) = delete;
+        WaitGroup& operator=(const WaitGroup&) = delete;
+
+        void add(int delta);
+        void done();
+        void wait();
+    };
+
+    // Reusable: opens each time `count` threads have arrived.
+    class Barrier {
+    private:
+        Mutex lock_;
+        CondVar cond_;
+        int count_;
+        int arrived_;
+        uint64_t generation_;
+
+    public:
+        explicit Barrier(int count);
+        Barrier(const Barrier&) = delete;
+        Barrier& operator=(const Barrier&) = delete;
+
+        // Returns true in exactly one of the threads of each round.
+        bool arrive_and_wait();
+    };
+
+    // ---------------------------------------------------------
+    // Futures
+    // ---------------------------------------------------------
+    // Promise<T> sets a value once; every Future<T> copied from it sees
+    // it. Both are handles on one reference-counted shared state, which is
+    // the only allocation: waiters park on the wait queues, and
+    // continuations live in the state of the future `then` returns. Call
+    // the blocking members from user threads.
+
+    template <typename T> class Future;
+    template <typename T> class Promise;
+
+    namespace detail {
+        // Queued on a future and run by whoever completes it.
+        struct Continuation {
+            void (*run)(Continuation* self) = nullptr;
+            Continuation* next = nullptr;
+        };
+
+        // The part of the shared state that does not depend on T
+        // (see src/sync.cpp).
+        class FutureCore {
+        private:
+            std::atomic<int32_t> ready_{0};
+            std::atomic<uintptr_t> continuations_{0}; // List, or 1 once complete
+            std::atomic<uint32_t> refs_{1};
+            void (*destroy_)(FutureCore*);
+
+        public:
+            explicit FutureCore(void (*destroy)(FutureCore*)) : destroy_(destroy) {}
+            FutureCore(const FutureCore&) = delete;
+            FutureCore& operator=(const FutureCore&) = delete;
+
+            bool ready() const { return ready_.load(std::memory_order_acquire) != 0; }
+            void wait();
+            bool wait_until(Deadline deadline);
+            // Marks it ready, wakes the waiters and runs the continuations
+            // on the calling thread.
+            void complete();
+            // False if it is already complete; c is then not queued.
+            bool add_continuation(Continuation* c);
+
+            void add_ref() { refs_.fetch_add(1, std::memory_order_relaxed); }
+            void release() {
+                if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) destroy_(this);
+            }
+        };
+
+        [[noreturn]] void future_misuse(const char* what);
+
+        template <typename T>
+        class FutureState : public FutureCore {
+        private:
+            alignas(T) unsigned char storage_[sizeof(T)];
+
+            static void destroy(FutureCore* c) { delete static_cast<FutureState*>(c); }
+
+        public:
+            explicit FutureState(void (*destroy_fn)(FutureCore*) = &destroy) : FutureCore(destroy_fn) {}
+            ~FutureState() {
+                if (ready()) value().~T();
+            }
+
+            template <typename... Args>
+            void emplace(Args&&... args) {
+                new (storage_) T(std::forward<Args>(args)...);
+            }
+            T& value() { return *std::launder(reinterpret_cast<T*>(storage_)); }
+        };
+
+        template <>
+        class FutureState<void> : public FutureCore {
+        private:
+            static void destroy(FutureCore* c) { delete static_cast<FutureState*>(c); }
+
+        public:
+            explicit FutureState(void (*destroy_fn)(FutureCore*) = &destroy) : FutureCore(destroy_fn) {}
+            void emplace() {}
+        };
+
+        struct FutureAccess {
+            template <typename T>
+            static FutureCore* core(const Future<T>& f) { return f.state_; }
+        };
+
+        // Both take references on the futures they are given.
+        FutureState<void>* when_all(FutureCore* const* futures, size_t n);
+        FutureState<size_t>* when_any(FutureCore* const* futures, size_t n);
+
+        template <typename T, typename R, typename F>
+        class ThenState final : public FutureState<R>, public Continuation {
+        private:
+            Future<T> parent_;
+            F f_;
+
+            static void destroy(FutureCore* c) { delete static_cast<ThenState*>(c); }
+
+            static void fire(Continuation* c) {
+                auto* s = static_cast<ThenState*>(c);
+                if constexpr (std::is_void_v<R>) {
+                    s->call();
+                    s->emplace();
+                } else {
+                    s->emplace(s->call());
+                }
+                s->parent_ = Future<T>();
+                s->complete();
+                s->release();
+            }
+
+            R call() {
+                if constexpr (std::is_void_v<T>) {
+                    return std::invoke(std::move(f_));
+                } else {
+                    return std::invoke(std::move(f_), parent_.get());
+                }
+            }
+
+        public:
+            ThenState(Future<T> parent, F f)
+                : FutureState<R>(&destroy), parent_(std::move(parent)), f_(std::move(f)) {
+                run = &fire;
+            }
+
+            // Queues on the parent, or runs now if it is already ready.
+            // Holds a reference on itself until it has run.
+            void start(FutureCore* parent) {
+                this->add_ref();
+                if (!parent->add_continuation(this)) fire(this);
+            }
+        };
+    }
+
+    template <typename T>
+    class Future {
+    private:
+        detail::FutureState<T>* state_ = nullptr;
+
+        friend struct detail::FutureAccess;
+
+    public:
+        Future() = default;
+        // Adopts a reference on `state`.
+        explicit Future(detail::FutureState<T>* state) : state_(state) {}
+        Future(const Future& other) : state_(other.state_) {
+            if (state_) state_->add_ref();
+        }
+        Future(Future&& other) noexcept : state_(other.state_) { other.state_ = nullptr; }
+        Future& operator=(Future other) noexcept {
+            std::swap(state_, other.state_);
+            return *this;
+        }
+        ~Future() {
+            if (state_) state_->release();
+        }
+
+        // False for a default-constructed or moved-from future.
+        bool valid() const { return state_ != nullptr; }
+        bool ready() const { return state_->ready(); }
+        void wait() const { state_->wait(); }
+        // False if the deadline passed first.
+        bool wait_until(Deadline deadline) const { return state_->wait_until(deadline); }
+        template <typename Rep, typename Period>
+        bool wait_for(const std::chrono::duration<Rep, Period>& d) const {
+            return wait_until(std::chrono::steady_clock::now() +
+                              std::chrono::ceil<std::chrono::steady_clock::duration>(d));
+        }
+        // Waits for the value. It lives as long as any handle on it.
+        std::add_lvalue_reference_t<T> get() const {
+            wait();
+            if constexpr (!std::is_void_v<T>) return state_->value();
+        }
+
+        // Future of f(value) (f() for Future<void>). f runs on the thread
+        // that completes this future, or right away on the caller if it
+        // is already ready, so keep it short and non-blocking.
+        template <typename F>
+        auto then(F&& f) const {
+            using Fn = std::decay_t<F>;
+            using R = std::conditional_t<std::is_void_v<T>, std::invoke_result<Fn>,
+                                         std::invoke_result<Fn, std::add_lvalue_reference_t<T>>>;
+            using Result = typename R::type;
+            auto* s = new detail::ThenState<T, Result, Fn>(*this, std::forward<F>(f));
+            s->start(state_);
+            return Future<Result>(s);
+        }
+    };
+
+    template <typename T>
+    class Promise {
+    private:
+        detail::FutureState<T>* state_;
+
+    public:
+        Promise() : state_(new detail::FutureState<T>()) {}
+        Promise(Promise&& other) noexcept : state_(other.state_) { other.state_ = nullptr; }
+        Promise& operator=(Promise&& other) noexcept {
+            std::swap(state_, other.state_);
+            return *this;
+        }
+        Promise(const Promise&) = delete;
+        Promise& operator=(const Promise&) = delete;
+        // Dropping a promise that was never set aborts: its futures could
+        // never complete.
+        ~Promise() {
+            if (!state_) return;
+            if (!state_->ready()) detail::future_misuse("Promise destroyed without a value");
+            state_->release();
+        }
+
+        Future<T> get_future() {
+            state_->add_ref();
+            return Future<T>(state_);
+        }
+
+        // Stores the value (no arguments for Promise<void>), wakes every
+        // waiter and runs the continuations on this thread. Once only.
+        template <typename... Args>
+        void set_value(Args&&... args) {
+            if (state_->ready()) detail::future_misuse("Promise set twice");
+            state_->emplace(std::forward<Args>(args)...);
+            state_->complete();
+        }
+    };
+
+    // Ready once every input is. Inputs must be valid.
+    template <typename T>
+    Future<void> when_all(const std::vector<Future<T>>& futures) {
+        std::vector<detail::FutureCore*> cores;
+        cores.reserve(futures.size());
+        for (const auto& f : futures) cores.push_back(detail::FutureAccess::core(f));
+        return Future<void>(detail::when_all(cores.data(), cores.size()));
+    }
+
+    template <typename... T>
+    Future<void> when_all(const Future<T>&... futures) {
+        detail::FutureCore* cores[] = {nullptr, detail::FutureAccess::core(futures)...};
+        return Future<void>(detail::when_all(cores + 1, sizeof...(T)));
+    }
+
+    // Index of the first input to complete. Needs at least one.
+    template <typename T>
+    Future<size_t> when_any(const std::vector<Future<T>>& futures) {
+        std::vector<detail::FutureCore*> cores;
+        cores.reserve(futures.size());
+        for (const auto& f : futures) cores.push_back(detail::FutureAccess::core(f));
+        return Future<size_t>(detail::when_any(cores.data(), cores.size()));
+    }
+
+    template <typename... T>
+    Future<size_t> when_any(const Future<T>&... futures) {
+        detail::FutureCore* cores[] = {nullptr, detail::FutureAccess::core(futures)...};
+        return Future<size_t>(detail::when_any(cores + 1, sizeof...(T)));
+    }
+
+    // ---------------------------------------------------------
+    // Spawning closures
+    // ---------------------------------------------------------
+
+    // Completes with the thread's return value. join() parks the caller
+    // until then; dropping the handle detaches the thread. A thread that
+    // leaves through uthread::exit() never completes its handle.
+    template <typename T>
+    class JoinHandle {
+    private:
+        Future<T> future_;
+
+    public:
+        JoinHandle() = default;
+        explicit JoinHandle(Future<T> future) : future_(std::move(future)) {}
+
+        bool joinable() const { return future_.valid(); }
+        // Once only; the handle is empty afterwards.
+        T join() {
+            Future<T> f = std::move(future_);
+            if constexpr (std::is_void_v<T>) {
+                f.wait();
+            } else {
+                return std::move(f.get());
+            }
+        }
+        // For then(), when_all() and friends.
+        const Future<T>& future() const { return future_; }
+    };
+
+    namespace detail {
+        // A type-erased closure: `move` move-constructs it into storage the
+        // runtime provides, `run` invokes it there and destroys it.
+        using ClosureRun = void (*)(void* closure);
+        using ClosureMove = void (*)(void* dst, void* src);
+        void spawn_closure(const SpawnOptions& options, ClosureRun run, ClosureMove move, void* src,
+                           size_t size, size_t align);
+
+        // The thread's callable and arguments, and the promise behind its
+        // JoinHandle.
+        template <typename R, typename Call>
+        struct SpawnClosure {
+            Promise<R> promise;
+            Call call;
+
+            void run() {
+                auto invoke = [](auto&& f, auto&&... args) -> R {
+                    return std::invoke(std::move(f), std::move(args)...);
+                };
+                if constexpr (std::is_void_v<R>) {
+                    std::apply(invoke, std::move(call));
+                    promise.set_value();
+                } else {
+                    promise.set_value(std::apply(invoke, std::move(call)));
+                }
+            }
+        };
+
+        template <typename C>
+        void spawn_erased(const SpawnOptions& options, C&& closure) {
+            ClosureRun run = [](void* p) {
+                C& c = *static_cast<C*>(p);
+                c.run();
+                c.~C();
+            };
+            ClosureMove move = [](void* dst, void* src) { new (dst) C(std::move(*static_cast<C*>(src))); };
+            spawn_closure(options, run, move, &closure, sizeof(C), alignof(C));
+        }
+    }
+
+    // Starts a thread running f(args...) on decayed copies of f and args,
+    // like std::thread. Closures of up to 1 KiB are stored at the top of
+    // the new thread's stack; the handle's shared state is the only
+    // allocation beyond what create() does.
+    template <typename F, typename... Args>
+    auto spawn(const SpawnOptions& options, F&& f, Args&&... args) {
+        using R = std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>;
+        using Call = std::tuple<std::decay_t<F>, std::decay_t<Args>...>;
+        detail::SpawnClosure<R, Call> closure{Promise<R>(), Call(std::forward<F>(f), std::forward<Args>(args)...)};
+        JoinHandle<R> handle(closure.promise.get_future());
+        detail::spawn_erased(options, std::move(closure));
+        return handle;
+    }
+
+    template <typename F, typename... Args,
+              typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, SpawnOptions>>>
+    auto spawn(F&& f, Args&&... args) {
+        return spawn(SpawnOptions{}, std::forward<F>(f), std::forward<Args>(args)...);
+    }
+
+    // ---------------------------------------------------------
+    // Channels
+    // ---------------------------------------------------------
+    // Go-style: Channel<T>(0) is unbuffered, so every send waits for a
+    // receiver; Channel<T>(n) buffers up to n values in a lock-free ring.
+    // A sender or receiver that finds the other side parked hands the
+    // value over directly (see src/channel.cpp). Channels are
+    // shared by reference and must outlive the threads using them.
+
+    template <typename T> class Channel;
+
+    namespace detail {
+        struct ChanCore;
+        struct SelectGroup;
+
+        using ElemMove = void (*)(void* dst, void* src); // Move-constructs dst from src
+        using ElemDestroy = void (*)(void* elem);
+
+        enum ChanResult : int { CHAN_OK, CHAN_CLOSED, CHAN_NOT_READY };
+
+        ChanCore* chan_create(size_t capacity, size_t elem_size, size_t elem_align, ElemMove move,
+                              ElemDestroy destroy);
+        void chan_destroy(ChanCore* c);
+        void chan_close(ChanCore* c);
+        bool chan_closed(const ChanCore* c);
+        size_t chan_size(const ChanCore* c);
+        // elem points to the value to send, which is moved from only on
+        // CHAN_OK, or to raw storage the received value is constructed in.
+        // CHAN_NOT_READY means it timed out, or would block with !block.
+        ChanResult chan_send(ChanCore* c, void* elem, Deadline deadline, bool block);
+        ChanResult chan_recv(ChanCore* c, void* elem, Deadline deadline, bool block);
+
+        // One case of a select. While the select is parked it is also the
+        // case's entry in its channel's wait queue.
+        struct ChanOp {
+            ChanCore* core = nullptr;
+            void* elem = nullptr;
+            bool send = false;
+            bool closed = false; // Set if this case completed because of close()
+            // Owned by the runtime during the select.
+            ChanOp* prev = nullptr;
+            ChanOp* next = nullptr;
+            SelectGroup* group = nullptr;
+            int index = 0;
+            bool queued = false;
+        };
+        // Index of the case that completed, or -1 on timeout (or if none
+        // was ready, with !block).
+        int chan_select(ChanOp* ops, size_t n, Deadline deadline, bool block);
+
+        struct ChanAccess {
+            template <typename T>
+            static ChanCore* core(Channel<T>& ch) { return ch.core_; }
+        };
+
+        template <typename T>
+        struct SendCase {
+            Channel<T>& ch;
+            T value;
+        };
+
+        template <typename T>
+        struct RecvCase {
+            Channel<T>& ch;
+            std::optional<T>& out;
+            alignas(T) unsigned char buf[sizeof(T)];
+        };
+
+        template <typename T>
+        ChanOp select_op(SendCase<T>& c) {
+            ChanOp op;
+            op.core = ChanAccess::core(c.ch);
+            op.elem = &c.value;
+            op.send = true;
+            return op;
+        }
+
+        template <typename T>
+        ChanOp select_op(RecvCase<T>& c) {
+            ChanOp op;
+            op.core = ChanAccess::core(c.ch);
+            op.elem = c.buf;
+            return op;
+        }
+
+        template <typename T>
+        void select_finish(SendCase<T>&, const ChanOp&, bool) {}
+
+        template <typename T>
+        void select_finish(RecvCase<T>& c, const ChanOp& op, bool won) {
+            if (!won) return;
+            if (op.closed) {
+                c.out.reset();
+                return;
+            }
+            T* v = std::launder(reinterpret_cast<T*>(c.buf));
+            c.out.emplace(std::move(*v));
+            v->~T();
+        }
+    }
+
+    template <typename T>
+    class Channel {
+    private:
+        detail::ChanCore* core_;
+
+        friend struct detail::ChanAccess;
+
+        static void move_elem(void* dst, void* src) { new (dst) T(std::move(*static_cast<T*>(src))); }
+        static void destroy_elem(void* elem) { static_cast<T*>(elem)->~T(); }
+
+        std::optional<T> recv_impl(Deadline deadline, bool block) {
+            alignas(T) unsigned char buf[sizeof(T)];
+            if (detail::chan_recv(core_, buf, deadline, block) != detail::CHAN_OK) return std::nullopt;
+            T* v = std::launder(reinterpret_cast<T*>(buf));
+            std::optional<T> out(std::move(*v));
+            v->~T();
+            return out;
+        }
+
+    public:
+        explicit Channel(size_t capacity = 0)
+            : core_(detail::chan_create(capacity, sizeof(T), alignof(T), &move_elem, &destroy_elem)) {}
+        ~Channel() { detail::chan_destroy(core_); }
+        Channel(const Channel&) = delete;
+        Channel& operator=(const Channel&) = delete;
+
+        // False if the channel is closed; the value is dropped.
+        bool send(T value) { return detail::chan_send(core_, &value, Deadline::max(), true) == detail::CHAN_OK; }
+        // False if closed or the deadline passed first.
+        bool send_until(T value, Deadline deadline) {
+            return detail::chan_send(core_, &value, deadline, true) == detail::CHAN_OK;
+        }
+        template <typename Rep, typename Period>
+        bool send_for(T value, const std::chrono::duration<Rep, Period>& d) {
+            return send_until(std::move(value), std::chrono::steady_clock::now() +
+                                                    std::chrono::ceil<std::chrono::steady_clock::duration>(d));
+        }
+        // False if it would have to wait.
+        bool try_send(T value) { return detail::chan_send(core_, &value, Deadline::max(), false) == detail::CHAN_OK; }
+
+        // Empty once the channel is closed and drained. Buffered values
+        // are still delivered after close().
+        std::optional<T> recv() { return recv_impl(Deadline::max(), true); }
+        // Also empty if the deadline passed first.
+        std::optional<T> recv_until(Deadline deadline) { return recv_impl(deadline, true); }
+        template <typename Rep, typename Period>
+        std::optional<T> recv_for(const std::chrono::duration<Rep, Period>& d) {
+            return recv_until(std::chrono::steady_clock::now() +
+                              std::chrono::ceil<std::chrono::steady_clock::duration>(d));
+        }
+        std::optional<T> try_recv() { return recv_impl(Deadline::max(), false); }
+
+        // Wakes every parked sender (which fail) and receiver (which get
+        // nothing). Closing twice aborts.
+        void close() { detail::chan_close(core_); }
+        bool closed() const { return detail::chan_closed(core_); }
+        // Values buffered right now; only a hint while others use it.
+        size_t size() const { return detail::chan_size(core_); }
+    };
+
+    // Cases for select(): send `value` on ch, or receive from ch into
+    // `out` (left empty if the case completes because ch was closed). A
+    // send case on a closed channel completes without sending.
+    template <typename T>
+    detail::SendCase<T> on_send(Channel<T>& ch, T value) {
+        return detail::SendCase<T>{ch, std::move(value)};
+    }
+
+    template <typename T>
+    detail::RecvCase<T> on_recv(Channel<T>& ch, std::optional<T>& out) {
+        return detail::RecvCase<T>{ch, out, {}};
+    }
+
+    // Waits until one of the cases can complete, completes only that one
+    // and returns its index. When several are ready one is picked at
+    // random, so no case starves.
+    template <typename... Cases>
+    int select_until(Deadline deadline, Cases&&... cases) {
+        detail::ChanOp ops[] = {detail::select_op(cases)...};
+        int won = detail::chan_select(ops, sizeof...(Cases), deadline, true);
+        size_t i = 0;
+        ((detail::select_finish(cases, ops[i], static_cast<int>(i) == won), ++i), ...);
+        return won;
+    }
+
+    template <typename... Cases>
+    int select(Cases&&... cases) {
+        return select_until(Deadline::max(), std::forward<Cases>(cases)...);
+    }
+
+    // -1 if the timeout passed first.
+    template <typename Rep, typename Period, typename... Cases>
+    int select_for(const std::chrono::duration<Rep, Period>& d, Cases&&... cases) {
+        return select_until(std::chrono::steady_clock::now() +
+                                std::chrono::ceil<std::chrono::steady_clock::duration>(d),
+                            std::forward<Cases>(cases)...);
+    }
+
+    // -1 if no case is ready right now.
+    template <typename... Cases>
+    int try_select(Cases&&... cases) {
+        detail::ChanOp ops[] = {detail::select_op(cases)...};
+        int won = detail::chan_select(ops, sizeof...(Cases), Deadline::max(), false);
+        size_t i = 0;
+        ((detail::select_finish(cases, ops[i], static_cast<int>(i) == won), ++i), ...);
+        return won;
+    }
+
+    // ---------------------------------------------------------
+    // Parallel algorithms
+    // ---------------------------------------------------------
+    // Fork-join on the work-stealing scheduler. A range is split in half
+    // only while the calling worker has no earlier half still waiting to
+    // be stolen (lazy binary splitting), so the number of pieces follows
+    // how many workers are hungry rather than the size of the range. A
+    // half nobody steals is run by the thread that split it, at the cost
+    // of a deque push and pop; a thread whose half was stolen runs other
+    // pending halves until it is done (see src/uthread.cpp). Call them
+    // from user threads; anywhere else, or with a single worker, they run
+    // serially.
+
+    namespace detail {
+        // Half of a split. Lives in the forking frame until join() returns.
+        struct ForkTask {
+            void (*run)(ForkTask* self) = nullptr;
+            std::atomic<uint32_t> done{0};
+            // Copied from the forking thread for the thread a thief starts.
+            int priority = 1; // Ready-queue level
+            size_t stack_size = 0;
+        };
+
+        // Offers t to other workers, or runs it right away if none could take it.
+        void fork(ForkTask* t);
+        // Runs t here if nobody took it, otherwise waits for it to finish.
+        void join(ForkTask* t);
+        // True if a split now could feed an idle worker.
+        bool fork_wanted();
+
+        template <typename T>
+        struct NoDeduce {
+            using type = T;
+        };
+
+        template <typename Index, typename F>
+        void for_range(Index lo, Index hi, Index grain, F& fn);
+
+        template <typename Index, typename F>
+        struct ForTask : ForkTask {
+            Index lo, hi, grain;
+            F* fn;
+
+            ForTask(Index l, Index h, Index g, F& f) : lo(l), hi(h), grain(g), fn(&f) {
+                run = [](ForkTask* t) {
+                    auto* s = static_cast<ForTask*>(t);
+                    for_range(s->lo, s->hi, s->grain, *s->fn);
+                };
+            }
+        };
+
+        template <typename Index, typename F>
+        void for_chunk(Index lo, Index hi, F& fn) {
+            if constexpr (std::is_invocable_v<F&, Index, Index>) {
+                fn(lo, hi);
+            } else {
+                for (Index i = lo; i < hi; ++i) fn(i);
+            }
+        }
+
+        template <typename Index, typename F>
+        void for_range(Index lo, Index hi, Index grain, F& fn) {
+            while (hi - lo > grain) {
+                if ((hi - lo) / 2 >= grain && fork_wanted()) {
+                    ForTask<Index, F> right(lo + (hi - lo) / 2, hi, grain, fn);
+                    fork(&right);
+                    for_range(lo, right.lo, grain, fn);
+                    join(&right);
+                    return;
+                }
+                for_chunk(lo, static_cast<Index>(lo + grain), fn);
+                lo += grain;
+            }
+            for_chunk(lo, hi, fn);
+        }
+
+        template <typename T, typename Index, typename F, typename R>
+        T reduce_range(Index lo, Index hi, Index grain, const T& identity, F& fn, R& reduce);
+
+        template <typename T, typename Index, typename F, typename R>
+        struct ReduceTask : ForkTask {
+            Index lo, hi, grain;
+            const T* identity;
+            F* fn;
+            R* reduce;
+            std::optional<T> result;
+
+            ReduceTask(Index l, Index h, Index g, const T& id, F& f, R& r)
+                : lo(l), hi(h), grain(g), identity(&id), fn(&f), reduce(&r) {
+                run = [](ForkTask* t) {
+                    auto* s = static_cast<ReduceTask*>(t);
+                    s->result.emplace(reduce_range(s->lo, s->hi, s->grain, *s->identity, *s->fn, *s->reduce));
+                };
+            }
+        };
+
+        template <typename T, typename Index, typename F, typename R>
+        T reduce_chunk(Index lo, Index hi, const T& identity, F& fn, R& reduce) {
+            if constexpr (std::is_invocable_v<F&, Index, Index>) {
+                return fn(lo, hi);
+            } else {
+                T acc = identity;
+                for (Index i = lo; i < hi; ++i) acc = reduce(std::move(acc), fn(i));
+                return acc;
+            }
+        }
+
+        // Combines strictly left to right, so reduce need only be associative.
+        template <typename T, typename Index, typename F, typename R>
+        T reduce_range(Index lo, Index hi, Index grain, const T& identity, F& fn, R& reduce) {
+            T acc = identity;
+            while (hi - lo > grain) {
+                if ((hi - lo) / 2 >= grain && fork_wanted()) {
+                    ReduceTask<T, Index, F, R> right(lo + (hi - lo) / 2, hi, grain, identity, fn, reduce);
+                    fork(&right);
+                    acc = reduce(std::move(acc), reduce_range(lo, right.lo, grain, identity, fn, reduce));
+                    join(&right);
+                    return reduce(std::move(acc), std::move(*right.result));
+                }
+                acc = reduce(std::move(acc), reduce_chunk(lo, static_cast<Index>(lo + grain), identity, fn, reduce));
+                lo += grain;
+            }
+            return reduce(std::move(acc), reduce_chunk(lo, hi, identity, fn, reduce));
+        }
+
+        template <typename F>
+        struct InvokeTask : ForkTask {
+            F* fn;
+
+            explicit InvokeTask(F& f) : fn(&f) {
+                run = [](ForkTask* t) { std::invoke(*static_cast<InvokeTask*>(t)->fn); };
+            }
+        };
+
+        template <typename F, typename... Rest>
+        void invoke_all(F& f, Rest&... rest) {
+            if constexpr (sizeof...(Rest) == 0) {
+                std::invoke(f);
+            } else {
+                InvokeTask<F> task(f);
+                fork(&task);
+                invoke_all(rest...);
+                join(&task);
+            }
+        }
+    }
+
+    // Calls fn(i) for every i in [begin, end), or fn(lo, hi) for
+    // consecutive chunks if it takes two indices, spread over the
+    // workers. Chunks hold at most `grain` indices, and a range is only
+    // split where both halves get at least that many. Returns once every
+    // call has.
+    template <typename Index, typename F>
+    void parallel_for(Index begin, typename detail::NoDeduce<Index>::type end,
+                      typename detail::NoDeduce<Index>::type grain, F&& fn) {
+        static_assert(std::is_integral_v<Index>, "parallel_for takes integer indices");
+        if (!(begin < end)) return;
+        if (grain < 1) grain = 1;
+        detail::for_range(begin, end, grain, fn);
+    }
+
+    // Folds fn(i) over [begin, end) with reduce(acc, value), starting each
+    // chunk from `identity`; or, if fn takes two indices, combines its
+    // results for whole chunks. Chunks are split as for parallel_for and
+    // combined in index order, so reduce must be associative but need not
+    // be commutative.
+    template <typename Index, typename T, typename F, typename R>
+    T parallel_reduce(Index begin, typename detail::NoDeduce<Index>::type end,
+                      typename detail::NoDeduce<Index>::type grain, T identity, F&& fn, R&& reduce) {
+        static_assert(std::is_integral_v<Index>, "parallel_reduce takes integer indices");
+        if (!(begin < end)) return identity;
+        if (grain < 1) grain = 1;
+        return detail::reduce_range(begin, end, grain, identity, fn, reduce);
+    }
+
+    // Runs every function, in parallel where workers are free, and returns
+    // once all have.
+    template <typename... F>
+    void parallel_invoke(F&&... fns) {
+        static_assert(sizeof...(F) > 0, "parallel_invoke needs a function");
+        detail::invoke_all(fns...);
+    }
 }
 #endif
@@ -0,0 +1,118 @@
+#include "../include/uthread.h"
+#include "runtime.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using namespace uthread::detail;
+
+// ---------------------------------------------------------
+// Blocking Pool
+// ---------------------------------------------------------
+// block_on_os() hands calls that would stall a worker (file I/O, DNS,
+// libraries without an async interface) to a separate pool of kernel
+// threads and parks the caller, so its worker keeps running everybody
+// else. The pool is elastic: a call that finds no idle thread starts a
+// new one, up to max_threads, beyond which calls queue in FIFO order.
+// Threads idle for BLOCKING_KEEP_ALIVE exit. A finished call wakes its
+// caller through the ordinary wait queues; with no worker of its own,
+// the pool thread readies it on the injection queue.
+
+const std::chrono::seconds BLOCKING_KEEP_ALIVE{10};
+const int BLOCKING_THREADS_DEFAULT = 64;
+
+static std::mutex pool_lock;
+static std::condition_variable pool_work;
+static BlockingCall* queue_head = nullptr;
+static BlockingCall* queue_tail = nullptr;
+static int max_threads = BLOCKING_THREADS_DEFAULT;
+static int nr_threads = 0;
+static int nr_idle = 0;
+static size_t nr_queued = 0;
+static size_t max_queued = 0;
+static uint64_t nr_calls = 0;
+
+// errno lives at a per-kernel-thread address the compiler may cache, and
+// the caller may resume on another worker (see io.cpp).
+__attribute__((noinline)) static void set_errno(int err) {
+    errno = err;
+}
+
+static void pool_thread() {
+    // Started from a worker, whose CPU pinning it would inherit.
+    unpin_thread();
+    std::unique_lock<std::mutex> lock(pool_lock);
+    while (true) {
+        if (!queue_head) {
+            ++nr_idle;
+            bool woken = pool_work.wait_for(lock, BLOCKING_KEEP_ALIVE, [] { return queue_head != nullptr; });
+            --nr_idle;
+            if (!woken) {
+                --nr_threads;
+                return;
+            }
+        }
+
+        BlockingCall* c = queue_head;
+        queue_head = c->next;
+        if (!queue_head) queue_tail = nullptr;
+        --nr_queued;
+        lock.unlock();
+
+        errno = 0;
+        c->run(c);
+        c->error = errno;
+        sema_release(&c->done); // The caller may return right after
+
+        lock.lock();
+    }
+}
+
+void uthread::detail::blocking_init(int threads) {
+    if (threads > 0) max_threads = threads;
+}
+
+void uthread::detail::block_on_pool(BlockingCall* c) {
+    // Off a user thread there is nobody to park.
+    if (!current_tcb()) {
+        c->run(c);
+        return;
+    }
+
+    {
+        PreemptGuard guard;
+        std::lock_guard<std::mutex> lock(pool_lock);
+        c->next = nullptr;
+        if (queue_tail) queue_tail->next = c; else queue_head = c;
+        queue_tail = c;
+        max_queued = std::max(max_queued, ++nr_queued);
+        ++nr_calls;
+        // Threads already woken but not yet running still count as idle,
+        // hence the comparison with the queue rather than with zero.
+        if (nr_queued > static_cast<size_t>(nr_idle) && nr_threads < max_threads) {
+            ++nr_threads;
+            std::thread(pool_thread).detach();
+        } else {
+            pool_work.notify_one();
+        }
+    }
+
+    sema_acquire(&c->done);
+    set_errno(c->error);
+}
+
+namespace uthread {
+    BlockingStats blocking_stats() {
+        std::lock_guard<std::mutex> lock(pool_lock);
+        BlockingStats st;
+        st.threads = nr_threads;
+        st.idle_threads = nr_idle;
+        st.max_threads = max_threads;
+        st.queued = nr_queued;
+        st.max_queued = max_queued;
+        st.calls = nr_calls;
+        return st;
+    }
+}
@@ -0,0 +1,475 @@
+#include "../include/uthread.h"
+#include "runtime.h"
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+using namespace uthread::detail;
+
+// ---------------------------------------------------------
+// Channels
+// ---------------------------------------------------------
+// A channel is Go's hchan with its buffer made lock-free: a bounded MPMC
+// ring (Vyukov's) that senders and receivers use without the channel lock
+// as long as nobody on the other side is parked. Everything else happens
+// under the lock: parking, handing a value straight to a parked thread,
+// close() and select.
+//
+// Parked threads wait in the channel's sendq/recvq as ChanOps, one per
+// select case (a plain send or receive is a select of one). All the cases
+// of one select share a SelectGroup on the selecting thread's stack; the
+// first party to claim the group (a counterpart, close() or the
+// deadline timer) CASes in its case index, so it completes exactly once.
+// The others are unlinked by whoever runs into them next.
+//
+// Lock-free operations race with parking the same way sema_release races
+// sema_acquire: a receiver queues itself (bumping recvq's count) before
+// its last look at the ring, and a sender checks the count after
+// pushing, so one of them always sees the other. The ring may also claim
+// to be empty while a push is half done; that sender then finds the
+// parked receiver when it checks.
+
+enum : int { SELECT_WAITING = -1, SELECT_TIMEOUT = -2 };
+// Results a waker leaves in the group. CHAN_RETRY: the thread was claimed
+// but the ring raced away from the waker, so it starts over.
+enum : int { CHAN_WOKEN_OK = 0, CHAN_WOKEN_CLOSED = 1, CHAN_RETRY = 2 };
+static constexpr uintptr_t SELECT_WOKEN = 1;
+
+struct uthread::detail::SelectGroup {
+    std::atomic<int> state{SELECT_WAITING}; // Index of the winning case once claimed
+    int result = CHAN_WOKEN_OK;
+    // 0 while the thread is switching out, SELECT_WOKEN if woken before
+    // it committed, or its TCB* once blocked (as in sync.cpp).
+    std::atomic<uintptr_t> park{0};
+    TimerNode timer;
+    std::atomic<bool> timer_done{false}; // The timer callback no longer touches us
+};
+
+struct WaitQueue {
+    ChanOp* head = nullptr;
+    ChanOp* tail = nullptr;
+    std::atomic<uint32_t> count{0}; // Read without the lock by the lock-free paths
+
+    void push(ChanOp* op) {
+        op->prev = tail;
+        op->next = nullptr;
+        if (tail) tail->next = op; else head = op;
+        tail = op;
+        op->queued = true;
+        // seq_cst pairs with the fence on the lock-free side.
+        count.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    void remove(ChanOp* op) {
+        if (op->prev) op->prev->next = op->next; else head = op->next;
+        if (op->next) op->next->prev = op->prev; else tail = op->prev;
+        op->queued = false;
+        count.fetch_sub(1, std::memory_order_relaxed);
+    }
+};
+
+struct uthread::detail::ChanCore {
+    std::mutex lock;
+    WaitQueue sendq;
+    WaitQueue recvq;
+    std::atomic<bool> closed{false};
+
+    size_t capacity;
+    ElemMove move;
+    ElemDestroy destroy;
+    size_t stride;      // Bytes per ring cell
+    size_t elem_offset; // Of the element within a cell
+    size_t cell_align;
+    unsigned char* cells = nullptr;
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+
+    std::atomic<size_t>& seq(size_t i) { return *reinterpret_cast<std::atomic<size_t>*>(cells + i * stride); }
+    void* elem(size_t i) { return cells + i * stride + elem_offset; }
+};
+
+// Waiters claimed under the lock, woken once it is dropped.
+struct WakeList {
+    ChanOp* head = nullptr;
+
+    void add(ChanOp* op, int result) {
+        op->group->result = result;
+        op->next = head;
+        head = op;
+    }
+
+    void wake() {
+        while (head) {
+            ChanOp* op = head;
+            head = op->next;
+            // Once park is swapped the thread may run and return.
+            SelectGroup* g = op->group;
+            uintptr_t old = g->park.exchange(SELECT_WOKEN, std::memory_order_acq_rel);
+            if (old > SELECT_WOKEN) make_runnable(reinterpret_cast<TCB*>(old));
+        }
+    }
+};
+
+// ---------------------------------------------------------
+// Ring
+// ---------------------------------------------------------
+// Vyukov's bounded queue, with each cell's sequence number saying whose
+// turn it is: 2 * pos while free for the push at pos, 2 * pos + 1 once
+// that push is done, 2 * (pos + capacity) once popped again. (Doubling
+// keeps "pushed" and "free" apart when the capacity is 1.)
+
+static bool ring_push(ChanCore* c, void* src) {
+    if (c->capacity == 0) return false;
+    size_t pos = c->enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+        size_t i = pos % c->capacity;
+        size_t seq = c->seq(i).load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(2 * pos);
+        if (diff == 0) {
+            if (c->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                c->move(c->elem(i), src);
+                c->seq(i).store(2 * pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // Full
+        } else {
+            pos = c->enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+static bool ring_pop(ChanCore* c, void* dst) {
+    if (c->capacity == 0) return false;
+    size_t pos = c->dequeue_pos.load(std::memory_order_relaxed);
+    while (true) {
+        size_t i = pos % c->capacity;
+        size_t seq = c->seq(i).load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(2 * pos + 1);
+        if (diff == 0) {
+            if (c->dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                c->move(dst, c->elem(i));
+                c->destroy(c->elem(i));
+                c->seq(i).store(2 * (pos + c->capacity), std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // Empty
+        } else {
+            pos = c->dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// ---------------------------------------------------------
+// Locked operations
+// ---------------------------------------------------------
+
+// Unlinks waiters until one whose select is still open, and claims it.
+static ChanOp* claim(WaitQueue& q) {
+    while (ChanOp* op = q.head) {
+        q.remove(op);
+        int expected = SELECT_WAITING;
+        if (op->group->state.compare_exchange_strong(expected, op->index, std::memory_order_acq_rel)) {
+            return op;
+        }
+    }
+    return nullptr;
+}
+
+// A sender left space in the ring, or a receiver an element: move parked
+// threads' values through it.
+static void serve_senders(ChanCore* c, WakeList& wake) {
+    while (ChanOp* s = claim(c->sendq)) {
+        if (!ring_push(c, s->elem)) {
+            wake.add(s, CHAN_RETRY);
+            return;
+        }
+        wake.add(s, CHAN_WOKEN_OK);
+    }
+}
+
+static void serve_receivers(ChanCore* c, WakeList& wake) {
+    while (ChanOp* r = claim(c->recvq)) {
+        if (!ring_pop(c, r->elem)) {
+            wake.add(r, CHAN_RETRY);
+            return;
+        }
+        wake.add(r, CHAN_WOKEN_OK);
+    }
+}
+
+// One attempt at a case with its channel locked. False if it would have
+// to wait; otherwise sets op->closed accordingly.
+static bool try_locked(ChanOp* op, WakeList& wake) {
+    ChanCore* c = op->core;
+    if (op->send) {
+        if (c->closed.load(std::memory_order_relaxed)) {
+            op->closed = true;
+            return true;
+        }
+        // A parked receiver means the ring is empty: hand it over.
+        if (ChanOp* r = claim(c->recvq)) {
+            c->move(r->elem, op->elem);
+            wake.add(r, CHAN_WOKEN_OK);
+            return true;
+        }
+        return ring_push(c, op->elem);
+    }
+
+    if (ring_pop(c, op->elem)) {
+        serve_senders(c, wake);
+        return true;
+    }
+    if (ChanOp* s = claim(c->sendq)) {
+        c->move(op->elem, s->elem);
+        wake.add(s, CHAN_WOKEN_OK);
+        return true;
+    }
+    if (c->closed.load(std::memory_order_relaxed)) {
+        op->closed = true;
+        return true;
+    }
+    return false;
+}
+
+// ---------------------------------------------------------
+// Select
+// ---------------------------------------------------------
+// Channels are locked in address order, each once however many cases
+// use it. Without scratch space for sorting, each step picks the lowest
+// address above the last one locked; selects are short.
+
+static void lock_all(ChanOp* ops, size_t n) {
+    ChanCore* last = nullptr;
+    while (true) {
+        ChanCore* next = nullptr;
+        for (size_t i = 0; i < n; ++i) {
+            ChanCore* c = ops[i].core;
+            if ((!last || c > last) && (!next || c < next)) next = c;
+        }
+        if (!next) return;
+        next->lock.lock();
+        last = next;
+    }
+}
+
+static void unlock_all(ChanOp* ops, size_t n) {
+    ChanCore* last = nullptr;
+    while (true) {
+        ChanCore* next = nullptr;
+        for (size_t i = 0; i < n; ++i) {
+            ChanCore* c = ops[i].core;
+            if ((!last || c > last) && (!next || c < next)) next = c;
+        }
+        if (!next) return;
+        next->lock.unlock();
+        last = next;
+    }
+}
+
+static void dequeue_all(ChanOp* ops, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (!ops[i].queued) continue;
+        ChanCore* c = ops[i].core;
+        (ops[i].send ? c->sendq : c->recvq).remove(&ops[i]);
+    }
+}
+
+static bool select_commit(TCB* tcb, void* arg) {
+    auto* g = static_cast<SelectGroup*>(arg);
+    uintptr_t expected = 0;
+    return g->park.compare_exchange_strong(expected, reinterpret_cast<uintptr_t>(tcb),
+                                           std::memory_order_acq_rel);
+}
+
+// The group lives on the selecting thread's stack, which must not return
+// while this still uses it: timer_done is the last thing it touches.
+static bool select_timeout(uintptr_t arg, uint32_t) {
+    auto* g = reinterpret_cast<SelectGroup*>(arg);
+    TCB* tcb = nullptr;
+    int expected = SELECT_WAITING;
+    if (g->state.compare_exchange_strong(expected, SELECT_TIMEOUT, std::memory_order_acq_rel)) {
+        uintptr_t old = g->park.exchange(SELECT_WOKEN, std::memory_order_acq_rel);
+        if (old > SELECT_WOKEN) tcb = reinterpret_cast<TCB*>(old);
+    }
+    g->timer_done.store(true, std::memory_order_release);
+    if (tcb) make_runnable(tcb);
+    return tcb != nullptr;
+}
+
+int uthread::detail::chan_select(ChanOp* ops, size_t n, Deadline deadline, bool block) {
+    uint64_t deadline_ns = deadline_to_ns(deadline);
+    // Channel locks are OS mutexes, see sema_acquire.
+    PreemptGuard guard;
+
+    while (true) {
+        SelectGroup g;
+        // Off the runtime there is no worker rng; fairness then rests on
+        // the caller.
+        size_t start = my_worker ? my_worker->rng.next() % n : 0;
+        WakeList wake;
+
+        lock_all(ops, n);
+        for (size_t k = 0; k < n; ++k) {
+            size_t i = (start + k) % n;
+            ops[i].closed = false;
+            if (try_locked(&ops[i], wake)) {
+                unlock_all(ops, n);
+                wake.wake();
+                return static_cast<int>(i);
+            }
+        }
+        if (!block || (deadline_ns != NO_DEADLINE_NS && now_ns() >= deadline_ns)) {
+            unlock_all(ops, n);
+            return -1;
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            ops[i].group = &g;
+            ops[i].index = static_cast<int>(i);
+            (ops[i].send ? ops[i].core->sendq : ops[i].core->recvq).push(&ops[i]);
+        }
+        // A lock-free push or pop that missed our queueing.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (size_t i = 0; i < n; ++i) {
+            bool done = ops[i].send ? ring_push(ops[i].core, ops[i].elem) : ring_pop(ops[i].core, ops[i].elem);
+            if (!done) continue;
+            // Nobody else can claim us while we hold every lock.
+            g.state.store(static_cast<int>(i), std::memory_order_relaxed);
+            dequeue_all(ops, n);
+            if (ops[i].send) serve_receivers(ops[i].core, wake); else serve_senders(ops[i].core, wake);
+            unlock_all(ops, n);
+            wake.wake();
+            return static_cast<int>(i);
+        }
+
+        bool timed = deadline_ns != NO_DEADLINE_NS;
+        if (timed) timer_arm(&g.timer, deadline_ns, select_timeout, reinterpret_cast<uintptr_t>(&g), 0);
+        unlock_all(ops, n);
+
+        if (g.park.load(std::memory_order_acquire) == 0) block_current(select_commit, &g);
+        if (timed && !timer_cancel(&g.timer)) {
+            // Fired: wait for its callback to let go of g.
+            while (!g.timer_done.load(std::memory_order_acquire)) cpu_relax();
+        }
+
+        lock_all(ops, n);
+        dequeue_all(ops, n);
+        unlock_all(ops, n);
+
+        int won = g.state.load(std::memory_order_acquire);
+        if (won == SELECT_TIMEOUT) return -1;
+        if (g.result == CHAN_RETRY) continue;
+        ops[won].closed = g.result == CHAN_WOKEN_CLOSED;
+        return won;
+    }
+}
+
+// ---------------------------------------------------------
+// Channel API
+// ---------------------------------------------------------
+
+ChanCore* uthread::detail::chan_create(size_t capacity, size_t elem_size, size_t elem_align, ElemMove move,
+                                       ElemDestroy destroy) {
+    auto* c = new ChanCore();
+    c->capacity = capacity;
+    c->move = move;
+    c->destroy = destroy;
+    size_t align = elem_align > alignof(std::atomic<size_t>) ? elem_align : alignof(std::atomic<size_t>);
+    c->cell_align = align;
+    c->elem_offset = (sizeof(std::atomic<size_t>) + align - 1) & ~(align - 1);
+    c->stride = (c->elem_offset + elem_size + align - 1) & ~(align - 1);
+    if (capacity > 0) {
+        c->cells = static_cast<unsigned char*>(::operator new(capacity * c->stride, std::align_val_t(align)));
+        for (size_t i = 0; i < capacity; ++i) new (&c->seq(i)) std::atomic<size_t>(2 * i);
+    }
+    return c;
+}
+
+void uthread::detail::chan_destroy(ChanCore* c) {
+    if (c->sendq.head || c->recvq.head) {
+        fprintf(stderr, "uthread: Channel destroyed with threads parked on it\n");
+        std::abort();
+    }
+    if (c->capacity > 0) {
+        for (size_t pos = c->dequeue_pos.load(); pos != c->enqueue_pos.load(); ++pos) {
+            c->destroy(c->elem(pos % c->capacity));
+        }
+        ::operator delete(c->cells, std::align_val_t(c->cell_align));
+    }
+    delete c;
+}
+
+void uthread::detail::chan_close(ChanCore* c) {
+    PreemptGuard guard;
+    WakeList wake;
+    c->lock.lock();
+    if (c->closed.exchange(true, std::memory_order_relaxed)) {
+        fprintf(stderr, "uthread: Channel closed twice\n");
+        std::abort();
+    }
+    while (ChanOp* op = claim(c->recvq)) wake.add(op, CHAN_WOKEN_CLOSED);
+    while (ChanOp* op = claim(c->sendq)) wake.add(op, CHAN_WOKEN_CLOSED);
+    c->lock.unlock();
+    wake.wake();
+}
+
+bool uthread::detail::chan_closed(const ChanCore* c) {
+    return c->closed.load(std::memory_order_relaxed);
+}
+
+size_t uthread::detail::chan_size(const ChanCore* c) {
+    size_t head = c->dequeue_pos.load(std::memory_order_relaxed);
+    size_t tail = c->enqueue_pos.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+ChanResult uthread::detail::chan_send(ChanCore* c, void* elem, Deadline deadline, bool block) {
+    {
+        PreemptGuard guard;
+        // Straight into the ring unless a receiver is parked, which gets
+        // the value handed over under the lock instead.
+        if (c->recvq.count.load(std::memory_order_relaxed) == 0 && !c->closed.load(std::memory_order_relaxed) &&
+            ring_push(c, elem)) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (c->recvq.count.load(std::memory_order_relaxed) > 0) {
+                WakeList wake;
+                c->lock.lock();
+                serve_receivers(c, wake);
+                c->lock.unlock();
+                wake.wake();
+            }
+            return CHAN_OK;
+        }
+    }
+    ChanOp op;
+    op.core = c;
+    op.elem = elem;
+    op.send = true;
+    if (chan_select(&op, 1, deadline, block) < 0) return CHAN_NOT_READY;
+    return op.closed ? CHAN_CLOSED : CHAN_OK;
+}
+
+ChanResult uthread::detail::chan_recv(ChanCore* c, void* elem, Deadline deadline, bool block) {
+    {
+        PreemptGuard guard;
+        if (ring_pop(c, elem)) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (c->sendq.count.load(std::memory_order_relaxed) > 0) {
+                WakeList wake;
+                c->lock.lock();
+                serve_senders(c, wake);
+                c->lock.unlock();
+                wake.wake();
+            }
+            return CHAN_OK;
+        }
+    }
+    ChanOp op;
+    op.core = c;
+    op.elem = elem;
+    if (chan_select(&op, 1, deadline, block) < 0) return CHAN_NOT_READY;
+    return op.closed ? CHAN_CLOSED : CHAN_OK;
+}
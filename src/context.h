@@ -0,0 +1,99 @@
+#ifndef UTHREAD_CONTEXT_H
+#define UTHREAD_CONTEXT_H
+
+#include <ucontext.h>
+#include <cstddef>
+#include <cstdint>
+
+// ---------------------------------------------------------
+// Execution context backends
+// ---------------------------------------------------------
+// AsmContext saves only the callee-saved registers and the stack pointer
+// (see context_switch.S). UContext is the glibc swapcontext path, which
+// also saves the signal mask and therefore costs an rt_sigprocmask
+// syscall per switch. Both are always compiled so bench/latency can time
+// them side by side; the runtime picks one at build time through the
+// `Context` alias. Build with -DUTHREAD_USE_UCONTEXT to force the fallback.
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define UTHREAD_HAVE_ASM_CONTEXT 1
+#endif
+
+extern "C" void uthread_ctx_swap(void** save_sp, void* load_sp);
+extern "C" void uthread_ctx_trampoline();
+
+struct UContext {
+    static constexpr const char* name = "ucontext";
+    ucontext_t uc;
+
+    void make(char* stack, size_t size, void (*entry)()) {
+        getcontext(&uc);
+        uc.uc_stack.ss_sp = stack;
+        uc.uc_stack.ss_size = size;
+        uc.uc_link = nullptr;
+        makecontext(&uc, entry, 0);
+    }
+
+    static void swap(UContext& from, UContext& to) {
+        swapcontext(&from.uc, &to.uc);
+    }
+
+    [[noreturn]] static void jump(UContext& to) {
+        setcontext(&to.uc);
+        __builtin_unreachable();
+    }
+};
+
+#ifdef UTHREAD_HAVE_ASM_CONTEXT
+struct AsmContext {
+    static constexpr const char* name = "asm";
+    void* sp = nullptr;
+
+    // Lays out a frame that looks like uthread_ctx_swap's own save area,
+    // so the first switch "returns" into uthread_ctx_trampoline, which
+    // calls `entry` on the fresh stack.
+    void make(char* stack, size_t size, void (*entry)()) {
+        uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + size) & ~uintptr_t(15);
+        uint64_t* frame;
+#if defined(__x86_64__)
+        // [mxcsr|x87 cw] r15 r14 r13 r12 rbx rbp ret pad pad
+        frame = reinterpret_cast<uint64_t*>(top) - 10;
+        frame[0] = 0x1F80ull | (0x037Full << 32); // default MXCSR, x87 CW
+        frame[1] = 0;                             // r15
+        frame[2] = 0;                             // r14
+        frame[3] = 0;                             // r13
+        frame[4] = reinterpret_cast<uint64_t>(entry); // r12
+        frame[5] = 0;                             // rbx
+        frame[6] = 0;                             // rbp (terminates backtraces)
+        frame[7] = reinterpret_cast<uint64_t>(&uthread_ctx_trampoline);
+        frame[8] = 0;
+        frame[9] = 0;
+#elif defined(__aarch64__)
+        // x19..x28, x29, x30, d8..d15
+        frame = reinterpret_cast<uint64_t*>(top) - 20;
+        for (int i = 0; i < 20; ++i) frame[i] = 0;
+        frame[0] = reinterpret_cast<uint64_t>(entry);                    // x19
+        frame[11] = reinterpret_cast<uint64_t>(&uthread_ctx_trampoline); // x30
+#endif
+        sp = frame;
+    }
+
+    static void swap(AsmContext& from, AsmContext& to) {
+        uthread_ctx_swap(&from.sp, to.sp);
+    }
+
+    [[noreturn]] static void jump(AsmContext& to) {
+        void* discard;
+        uthread_ctx_swap(&discard, to.sp);
+        __builtin_unreachable();
+    }
+};
+#endif
+
+#if defined(UTHREAD_HAVE_ASM_CONTEXT) && !defined(UTHREAD_USE_UCONTEXT)
+using Context = AsmContext;
+#else
+using Context = UContext;
+#endif
+
+#endif
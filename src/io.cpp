@@ -0,0 +1,354 @@
+#include "../include/uthread.h"
+#include "runtime.h"
+#include <cerrno>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+using namespace uthread::detail;
+
+// ---------------------------------------------------------
+// Async IO Implementation
+// ---------------------------------------------------------
+// Every operation goes through the io_uring backend when init() enabled
+// it, and otherwise through the netpoller: try the non-blocking syscall,
+// and on EAGAIN block on the fd's PollDesc until the next edge. Either
+// way the calling thread parks and its worker keeps running others.
+// Results follow the syscalls: -1 with errno set on failure, ETIMEDOUT
+// once the caller's deadline passes.
+
+// errno is per kernel thread, and glibc lets the compiler keep its
+// address in a register across calls. A thread that blocked may resume
+// on another worker, so anything that touches errno after a wait goes
+// through these, which look the address up again.
+__attribute__((noinline)) static int get_errno() {
+    return errno;
+}
+
+__attribute__((noinline)) static void set_errno(int err) {
+    errno = err;
+}
+
+static ssize_t uring_result(int res) {
+    if (res < 0) {
+        set_errno(-res);
+        return -1;
+    }
+    return res;
+}
+
+static io_uring_sqe* prep(uint8_t opcode, int fd, const void* addr, uint32_t len, uint64_t off) {
+    io_uring_sqe* sqe = uring_sqe();
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(addr);
+    sqe->len = len;
+    sqe->off = off;
+    return sqe;
+}
+
+// Submits the request built by `prep_op` on the ring. io_uring honours
+// O_NONBLOCK (sockets from accept4 or the epoll path have it set) and
+// fails such requests with EAGAIN instead of waiting, so those wait for
+// readiness with a POLL_ADD on the same ring and resubmit.
+template <typename Prep>
+static ssize_t uring_retry(int fd, bool write, uint64_t deadline, Prep prep_op) {
+    while (true) {
+        int res = uring_wait(prep_op(), deadline);
+        if (res != -EAGAIN) return uring_result(res);
+
+        io_uring_sqe* sqe = prep(IORING_OP_POLL_ADD, fd, nullptr, 0, 0);
+        sqe->poll32_events = write ? POLLOUT : POLLIN;
+        res = uring_wait(sqe, deadline);
+        if (res < 0) return uring_result(res);
+    }
+}
+
+// Retries `op` until it stops failing with EAGAIN, waiting for readiness
+// in the given direction in between.
+template <typename Op>
+static ssize_t poll_retry(int fd, bool write, uint64_t deadline, Op op) {
+    PollDesc* pd = netpoll_open(fd);
+    if (!pd) return -1;
+
+    while (true) {
+        ssize_t n = op();
+
+        if (n >= 0) return n;
+        int err = get_errno();
+        if (err == EINTR) continue;
+        if (err != EAGAIN && err != EWOULDBLOCK) return -1;
+
+        err = netpoll_wait(pd, write, deadline);
+        if (err != 0) {
+            set_errno(err);
+            return -1;
+        }
+    }
+}
+
+// Both backends through one call site: `prep_op` builds the SQE for
+// io_uring, `op` is the non-blocking syscall for the netpoller.
+template <typename Prep, typename Op>
+static ssize_t do_io(int fd, bool write, uthread::Deadline deadline, Prep prep_op, Op op) {
+    // An SQE belongs to the ring of the worker that handed it out.
+    PreemptGuard guard;
+    uint64_t d = deadline_to_ns(deadline);
+    if (uring_active()) return uring_retry(fd, write, d, prep_op);
+    return poll_retry(fd, write, d, op);
+}
+
+namespace uthread {
+    bool io_uring_active() {
+        return uring_active();
+    }
+
+    ssize_t socket_read(int fd, char* buf, size_t len, Deadline deadline) {
+        return do_io(fd, false, deadline,
+                     [&] { return prep(IORING_OP_READ, fd, buf, len, uint64_t(-1)); },
+                     [&] { return read(fd, buf, len); });
+    }
+
+    // A short count means the error or deadline hit after some of the
+    // data went out; -1 means none did.
+    ssize_t socket_write(int fd, const char* buf, size_t len, Deadline deadline) {
+        size_t sent = 0;
+        while (sent < len) {
+            const char* p = buf + sent;
+            size_t left = len - sent;
+            ssize_t n = do_io(fd, true, deadline,
+                              [&] { return prep(IORING_OP_WRITE, fd, p, left, uint64_t(-1)); },
+                              [&] { return write(fd, p, left); });
+            if (n < 0) return sent > 0 ? static_cast<ssize_t>(sent) : -1;
+            sent += n;
+        }
+        return static_cast<ssize_t>(sent);
+    }
+
+    ssize_t socket_recv(int fd, char* buf, size_t len, int flags, Deadline deadline) {
+        return do_io(fd, false, deadline,
+                     [&] {
+                         io_uring_sqe* sqe = prep(IORING_OP_RECV, fd, buf, len, 0);
+                         sqe->msg_flags = flags;
+                         return sqe;
+                     },
+                     [&] { return recv(fd, buf, len, flags); });
+    }
+
+    ssize_t socket_send(int fd, const char* buf, size_t len, int flags, Deadline deadline) {
+        flags |= MSG_NOSIGNAL;
+        return do_io(fd, true, deadline,
+                     [&] {
+                         io_uring_sqe* sqe = prep(IORING_OP_SEND, fd, buf, len, 0);
+                         sqe->msg_flags = flags;
+                         return sqe;
+                     },
+                     [&] { return send(fd, buf, len, flags); });
+    }
+
+    ssize_t socket_readv(int fd, const iovec* iov, int iovcnt, Deadline deadline) {
+        return do_io(fd, false, deadline,
+                     [&] { return prep(IORING_OP_READV, fd, iov, iovcnt, uint64_t(-1)); },
+                     [&] { return readv(fd, iov, iovcnt); });
+    }
+
+    // Like socket_write: keeps going until every iovec is written.
+    ssize_t socket_writev(int fd, const iovec* iov, int iovcnt, Deadline deadline) {
+        std::vector<iovec> rest(iov, iov + iovcnt);
+        iovec* cur = rest.data();
+        int cnt = iovcnt;
+        size_t sent = 0;
+        while (cnt > 0) {
+            ssize_t n = do_io(fd, true, deadline,
+                              [&] { return prep(IORING_OP_WRITEV, fd, cur, cnt, uint64_t(-1)); },
+                              [&] { return writev(fd, cur, cnt); });
+            if (n < 0) return sent > 0 ? static_cast<ssize_t>(sent) : -1;
+            sent += n;
+
+            // Drop what went out: whole iovecs, then a prefix of the next.
+            size_t done = static_cast<size_t>(n);
+            while (cnt > 0 && done >= cur->iov_len) {
+                done -= cur->iov_len;
+                ++cur;
+                --cnt;
+            }
+            if (cnt > 0) {
+                cur->iov_base = static_cast<char*>(cur->iov_base) + done;
+                cur->iov_len -= done;
+            }
+        }
+        return static_cast<ssize_t>(sent);
+    }
+
+    ssize_t socket_recvmsg(int fd, msghdr* msg, int flags, Deadline deadline) {
+        return do_io(fd, false, deadline,
+                     [&] {
+                         io_uring_sqe* sqe = prep(IORING_OP_RECVMSG, fd, msg, 1, 0);
+                         sqe->msg_flags = flags;
+                         return sqe;
+                     },
+                     [&] { return recvmsg(fd, msg, flags); });
+    }
+
+    ssize_t socket_sendmsg(int fd, const msghdr* msg, int flags, Deadline deadline) {
+        flags |= MSG_NOSIGNAL;
+        return do_io(fd, true, deadline,
+                     [&] {
+                         io_uring_sqe* sqe = prep(IORING_OP_SENDMSG, fd, msg, 1, 0);
+                         sqe->msg_flags = flags;
+                         return sqe;
+                     },
+                     [&] { return sendmsg(fd, msg, flags); });
+    }
+
+    int socket_accept(int fd, sockaddr* addr, socklen_t* addrlen, Deadline deadline) {
+        return static_cast<int>(do_io(fd, false, deadline,
+                     [&] {
+                         // addr2 (aliasing off) carries the addrlen pointer.
+                         io_uring_sqe* sqe = prep(IORING_OP_ACCEPT, fd, addr, 0,
+                                                  reinterpret_cast<uint64_t>(addrlen));
+                         sqe->accept_flags = SOCK_CLOEXEC;
+                         return sqe;
+                     },
+                     [&] { return accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC); }));
+    }
+
+    int socket_connect(int fd, const sockaddr* addr, socklen_t addrlen, Deadline deadline) {
+        PreemptGuard guard;
+        uint64_t d = deadline_to_ns(deadline);
+        if (uring_active()) {
+            // For connect, off carries the address length.
+            int res = uring_wait(prep(IORING_OP_CONNECT, fd, addr, 0, addrlen), d);
+            if (res != -EINPROGRESS) return static_cast<int>(uring_result(res));
+
+            // Non-blocking socket: writable means the handshake finished.
+            io_uring_sqe* sqe = prep(IORING_OP_POLL_ADD, fd, nullptr, 0, 0);
+            sqe->poll32_events = POLLOUT;
+            res = uring_wait(sqe, d);
+            if (res < 0) return static_cast<int>(uring_result(res));
+        } else {
+            PollDesc* pd = netpoll_open(fd);
+            if (!pd) return -1;
+            if (connect(fd, addr, addrlen) == 0) return 0;
+            if (errno != EINPROGRESS) return -1;
+
+            // Writable means the handshake finished, one way or the other.
+            int err = netpoll_wait(pd, true, d);
+            if (err != 0) {
+                set_errno(err);
+                return -1;
+            }
+        }
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0) return -1;
+        if (err != 0) {
+            set_errno(err);
+            return -1;
+        }
+        return 0;
+    }
+
+    int socket_close(int fd) {
+        PreemptGuard guard;
+        // Operations in flight on a ring hold their own reference to the
+        // socket, so close() alone would not finish them; shutting the
+        // socket down first makes them complete.
+        if (uring_active()) shutdown(fd, SHUT_RDWR);
+        netpoll_close(fd);
+        return close(fd);
+    }
+
+    // On the epoll backend each call goes to the blocking pool; regular
+    // files are always "ready", so readiness polling would not help.
+    int file_open(const char* path, int flags, mode_t mode) {
+        if (uring_active()) {
+            PreemptGuard guard;
+            io_uring_sqe* sqe = prep(IORING_OP_OPENAT, AT_FDCWD, path, mode, 0);
+            sqe->open_flags = static_cast<uint32_t>(flags);
+            return static_cast<int>(uring_result(uring_wait(sqe)));
+        }
+        return block_on_os([=] { return open(path, flags, mode); });
+    }
+
+    // An offset of -1 makes io_uring use the file position.
+    ssize_t file_read(int fd, void* buf, size_t len) {
+        if (uring_active()) {
+            PreemptGuard guard;
+            return uring_result(uring_wait(prep(IORING_OP_READ, fd, buf, len, uint64_t(-1))));
+        }
+        return block_on_os([=] { return read(fd, buf, len); });
+    }
+
+    ssize_t file_write(int fd, const void* buf, size_t len) {
+        if (uring_active()) {
+            PreemptGuard guard;
+            return uring_result(uring_wait(prep(IORING_OP_WRITE, fd, buf, len, uint64_t(-1))));
+        }
+        return block_on_os([=] { return write(fd, buf, len); });
+    }
+
+    ssize_t file_pread(int fd, void* buf, size_t len, off_t offset) {
+        if (uring_active()) {
+            PreemptGuard guard;
+            return uring_result(uring_wait(prep(IORING_OP_READ, fd, buf, len, offset)));
+        }
+        return block_on_os([=] { return pread(fd, buf, len, offset); });
+    }
+
+    ssize_t file_pwrite(int fd, const void* buf, size_t len, off_t offset) {
+        if (uring_active()) {
+            PreemptGuard guard;
+            return uring_result(uring_wait(prep(IORING_OP_WRITE, fd, buf, len, offset)));
+        }
+        return block_on_os([=] { return pwrite(fd, buf, len, offset); });
+    }
+
+    int file_fsync(int fd) {
+        if (uring_active()) {
+            PreemptGuard guard;
+            return static_cast<int>(uring_result(uring_wait(prep(IORING_OP_FSYNC, fd, nullptr, 0, 0))));
+        }
+        return block_on_os([=] { return fsync(fd); });
+    }
+
+    int register_buffers(const iovec* iovs, unsigned count) {
+        return static_cast<int>(uring_result(uring_register(IORING_REGISTER_BUFFERS, iovs, count)));
+    }
+
+    int register_files(const int* fds, unsigned count) {
+        return static_cast<int>(uring_result(uring_register(IORING_REGISTER_FILES, fds, count)));
+    }
+
+    // `file_index` names a slot in register_files(). With buf_index >= 0,
+    // buf must lie inside that registered buffer and the kernel skips
+    // pinning the pages for this request.
+    ssize_t file_pread_fixed(int file_index, void* buf, size_t len, off_t offset, int buf_index) {
+        if (!uring_active()) {
+            set_errno(ENOSYS);
+            return -1;
+        }
+        PreemptGuard guard;
+        io_uring_sqe* sqe = prep(buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ,
+                                 file_index, buf, len, offset);
+        sqe->flags = IOSQE_FIXED_FILE;
+        if (buf_index >= 0) sqe->buf_index = static_cast<uint16_t>(buf_index);
+        return uring_result(uring_wait(sqe));
+    }
+
+    ssize_t file_pwrite_fixed(int file_index, const void* buf, size_t len, off_t offset, int buf_index) {
+        if (!uring_active()) {
+            set_errno(ENOSYS);
+            return -1;
+        }
+        PreemptGuard guard;
+        io_uring_sqe* sqe = prep(buf_index >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE,
+                                 file_index, buf, len, offset);
+        sqe->flags = IOSQE_FIXED_FILE;
+        if (buf_index >= 0) sqe->buf_index = static_cast<uint16_t>(buf_index);
+        return uring_result(uring_wait(sqe));
+    }
+}
@@ -0,0 +1,288 @@
+#include "runtime.h"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+using namespace uthread::detail;
+
+// ---------------------------------------------------------
+// io_uring Backend
+// ---------------------------------------------------------
+// One ring per worker, driven with raw syscalls (no liburing). Only the
+// owning worker thread touches its SQ and CQ: a thread fills an SQE on
+// the ring of the worker it is running on and blocks, and that worker
+// submits pending SQEs in batches from its scheduler loop and reaps
+// completions there. The ring fd sits in the worker's epoll set, so a
+// parked worker wakes for completions just like for socket readiness.
+
+const unsigned RING_ENTRIES = 256;
+const unsigned SUBMIT_BATCH = 16; // Pending SQEs that force a submit
+
+struct IoRing {
+    int fd = -1;
+    unsigned sq_entries = 0;
+
+    // SQ ring
+    std::atomic<unsigned>* sq_head = nullptr;
+    std::atomic<unsigned>* sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned* sq_array = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    unsigned sq_local_tail = 0; // Filled but not yet published
+    unsigned sq_submitted = 0;  // Published and handed to the kernel
+
+    // CQ ring
+    std::atomic<unsigned>* cq_head = nullptr;
+    std::atomic<unsigned>* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    void* sq_map = nullptr;
+    size_t sq_map_size = 0;
+    void* cq_map = nullptr;
+    size_t cq_map_size = 0;
+    size_t sqes_size = 0;
+};
+
+// Lives on the blocked thread's stack until its completion is reaped.
+struct IoRequest {
+    TCB* waiter = nullptr;
+    int32_t res = 0;
+};
+
+static bool uring_enabled = false;
+
+static int sys_io_uring_setup(unsigned entries, io_uring_params* p) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+template <typename T>
+static T* ring_ptr(void* base, uint32_t offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+static void ring_destroy(IoRing* r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_size);
+    if (r->sq_map) munmap(r->sq_map, r->sq_map_size);
+    if (r->fd >= 0) close(r->fd);
+    delete r;
+}
+
+static IoRing* ring_create() {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = sys_io_uring_setup(RING_ENTRIES, &p);
+    if (fd < 0) return nullptr;
+
+    IoRing* r = new IoRing();
+    r->fd = fd;
+    r->sq_entries = p.sq_entries;
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && r->cq_map_size > r->sq_map_size) r->sq_map_size = r->cq_map_size;
+
+    r->sq_map = mmap(nullptr, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        r->sq_map = nullptr;
+        ring_destroy(r);
+        return nullptr;
+    }
+    if (single) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(nullptr, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            r->cq_map = nullptr;
+            ring_destroy(r);
+            return nullptr;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        ring_destroy(r);
+        return nullptr;
+    }
+    r->sqes = static_cast<io_uring_sqe*>(sqes);
+
+    r->sq_head = ring_ptr<std::atomic<unsigned>>(r->sq_map, p.sq_off.head);
+    r->sq_tail = ring_ptr<std::atomic<unsigned>>(r->sq_map, p.sq_off.tail);
+    r->sq_mask = *ring_ptr<unsigned>(r->sq_map, p.sq_off.ring_mask);
+    r->sq_array = ring_ptr<unsigned>(r->sq_map, p.sq_off.array);
+    r->cq_head = ring_ptr<std::atomic<unsigned>>(r->cq_map, p.cq_off.head);
+    r->cq_tail = ring_ptr<std::atomic<unsigned>>(r->cq_map, p.cq_off.tail);
+    r->cq_mask = *ring_ptr<unsigned>(r->cq_map, p.cq_off.ring_mask);
+    r->cqes = ring_ptr<io_uring_cqe>(r->cq_map, p.cq_off.cqes);
+
+    r->sq_local_tail = r->sq_tail->load(std::memory_order_relaxed);
+    r->sq_submitted = r->sq_local_tail;
+    return r;
+}
+
+bool uthread::detail::uring_init(const std::vector<std::unique_ptr<Worker>>& ws) {
+    std::vector<IoRing*> rings;
+    for (size_t i = 0; i < ws.size(); ++i) {
+        IoRing* r = ring_create();
+        if (!r) {
+            for (IoRing* made : rings) ring_destroy(made);
+            return false;
+        }
+        rings.push_back(r);
+    }
+
+    for (size_t i = 0; i < ws.size(); ++i) {
+        ws[i]->ring = rings[i];
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = rings[i]->fd;
+        epoll_ctl(ws[i]->epoll_fd, EPOLL_CTL_ADD, rings[i]->fd, &ev);
+    }
+    uring_enabled = true;
+    return true;
+}
+
+bool uthread::detail::uring_active() {
+    return uring_enabled;
+}
+
+int uthread::detail::uring_fd(Worker* w) {
+    return w->ring ? w->ring->fd : -1;
+}
+
+// Hands every filled SQE to the kernel in one io_uring_enter.
+void uthread::detail::uring_flush(Worker* w) {
+    IoRing* r = w->ring;
+    if (!r) return;
+    unsigned pending = r->sq_local_tail - r->sq_submitted;
+    if (pending == 0) return;
+
+    r->sq_tail->store(r->sq_local_tail, std::memory_order_release);
+    while (pending > 0) {
+        int n = sys_io_uring_enter(r->fd, pending, 0, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EBUSY) {
+                // Completion queue backpressure: make room and retry.
+                uring_reap(w);
+                continue;
+            }
+            break;
+        }
+        pending -= n;
+        r->sq_submitted += n;
+    }
+}
+
+// Submission is deferred so threads blocking back to back on one worker
+// share a syscall: flush once SUBMIT_BATCH SQEs are pending, or when the
+// worker is about to run out of local work.
+bool uthread::detail::uring_wants_flush(Worker* w, bool idle) {
+    IoRing* r = w->ring;
+    if (!r) return false;
+    unsigned pending = r->sq_local_tail - r->sq_submitted;
+    return pending > 0 && (idle || pending >= SUBMIT_BATCH);
+}
+
+int uthread::detail::uring_reap(Worker* w) {
+    IoRing* r = w->ring;
+    if (!r) return 0;
+
+    unsigned head = r->cq_head->load(std::memory_order_relaxed);
+    unsigned tail = r->cq_tail->load(std::memory_order_acquire);
+    int readied = 0;
+    for (; head != tail; ++head) {
+        io_uring_cqe* cqe = &r->cqes[head & r->cq_mask];
+        auto* req = reinterpret_cast<IoRequest*>(cqe->user_data);
+        if (!req) continue; // Fire-and-forget (e.g. cancellations)
+        req->res = cqe->res;
+        make_runnable(req->waiter);
+        ++readied;
+    }
+    r->cq_head->store(head, std::memory_order_release);
+    return readied;
+}
+
+static io_uring_sqe* ring_next(IoRing* r) {
+    unsigned idx = r->sq_local_tail & r->sq_mask;
+    io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    ++r->sq_local_tail;
+    return sqe;
+}
+
+// Keeps a second slot free, so uring_wait can always link a timeout
+// behind the request without a flush splitting the pair.
+io_uring_sqe* uthread::detail::uring_sqe() {
+    Worker* w = my_worker;
+    IoRing* r = w->ring;
+    while (r->sq_local_tail - r->sq_head->load(std::memory_order_acquire) + 2 > r->sq_entries) {
+        uring_flush(w);
+        uring_reap(w);
+    }
+    return ring_next(r);
+}
+
+// The completion is only reaped by this worker's scheduler loop, which
+// runs after this commit, so recording the waiter cannot race it.
+static bool uring_commit(TCB* tcb, void* arg) {
+    static_cast<IoRequest*>(arg)->waiter = tcb;
+    return true;
+}
+
+int uthread::detail::uring_wait(io_uring_sqe* sqe, uint64_t deadline_ns) {
+    IoRequest req;
+    sqe->user_data = reinterpret_cast<uint64_t>(&req);
+
+    // The kernel reads the timespec when the pair is submitted, which is
+    // after we block; our stack stays put until then. An absolute
+    // CLOCK_MONOTONIC timeout is unaffected by batching delays.
+    __kernel_timespec ts;
+    if (deadline_ns != NO_DEADLINE_NS) {
+        sqe->flags |= IOSQE_IO_LINK;
+        io_uring_sqe* t = ring_next(my_worker->ring);
+        ts.tv_sec = deadline_ns / 1000000000ull;
+        ts.tv_nsec = deadline_ns % 1000000000ull;
+        t->opcode = IORING_OP_LINK_TIMEOUT;
+        t->fd = -1;
+        t->addr = reinterpret_cast<uint64_t>(&ts);
+        t->len = 1;
+        t->timeout_flags = IORING_TIMEOUT_ABS;
+        t->user_data = 0; // Its own completion is ignored
+    }
+
+    trace(TRACE_WAIT_IO, my_worker->running->id, sqe->opcode);
+    block_current(uring_commit, &req);
+    // A request cut off by its timeout completes with -ECANCELED, or with
+    // -EINTR if it had already been handed to an io-wq worker.
+    if (deadline_ns != NO_DEADLINE_NS && (req.res == -ECANCELED || req.res == -EINTR)) {
+        return -ETIMEDOUT;
+    }
+    return req.res;
+}
+
+int uthread::detail::uring_register(unsigned opcode, const void* arg, unsigned nr_args) {
+    if (!uring_enabled) return -ENOSYS;
+    for (auto& w : workers) {
+        if (sys_io_uring_register(w->ring->fd, opcode, arg, nr_args) < 0) return -errno;
+    }
+    return 0;
+}
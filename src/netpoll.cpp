@@ -0,0 +1,286 @@
+#include "../include/uthread.h"
+#include "runtime.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+using namespace uthread::detail;
+
+// ---------------------------------------------------------
+// Poll Descriptors
+// ---------------------------------------------------------
+// Every fd the runtime waits on gets a PollDesc, found by indexing a flat
+// table with the fd. It is registered once, edge-triggered for both
+// directions, with the epoll instance of the worker that first uses it,
+// and stays registered until socket_close(). rg/wg carry the readiness
+// state of each direction (the same protocol as Go's pollDesc):
+//   0         nothing pending
+//   PD_READY  an edge arrived and nobody has consumed it yet
+//   PD_WAIT   a thread is switching out to wait (not committed yet)
+//   TCB*      that thread is blocked
+// Only one thread at a time holds a direction's slot. Any other waiter
+// parks on the direction's turn counter, which the holder bumps when it
+// leaves, and then retries its syscall: the edge the holder consumed may
+// have covered it too (two connections behind one accept edge).
+static constexpr uintptr_t PD_READY = 1;
+static constexpr uintptr_t PD_WAIT = 2;
+
+enum : int { PD_UNREGISTERED = 0, PD_REGISTERING = 1, PD_REGISTERED = 2 };
+
+struct uthread::detail::PollDesc {
+    std::atomic<uintptr_t> rg;
+    std::atomic<uintptr_t> wg;
+    // Bumped by each deadline wait, so a stale timer can tell it no
+    // longer applies.
+    std::atomic<uint32_t> rseq;
+    std::atomic<uint32_t> wseq;
+    std::atomic<int32_t> rturn;
+    std::atomic<int32_t> wturn;
+    std::atomic<int> state;
+    std::atomic<bool> closing;
+    int worker; // Owner of the epoll instance the fd is registered with
+};
+
+// mmap'd MAP_NORESERVE and zero-filled by the kernel, so only pages
+// covering fds actually in use are ever committed.
+static PollDesc* poll_table = nullptr;
+static size_t poll_table_size = 0;
+const size_t MAX_POLL_FDS = size_t(1) << 22;
+
+void uthread::detail::netpoll_init() {
+    if (poll_table) return;
+
+    struct rlimit rl;
+    size_t n = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_max != RLIM_INFINITY && rl.rlim_max > n) {
+        n = rl.rlim_max;
+    }
+    if (n > MAX_POLL_FDS) n = MAX_POLL_FDS;
+
+    void* mem = mmap(nullptr, n * sizeof(PollDesc), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap poll table");
+        std::exit(1);
+    }
+    poll_table = static_cast<PollDesc*>(mem);
+    poll_table_size = n;
+}
+
+void uthread::detail::netpoll_init_worker(Worker* w) {
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->epoll_fd == -1 || w->wake_fd == -1) {
+        perror("netpoll_init_worker");
+        std::exit(1);
+    }
+    // Level-triggered, so a thief polling this instance cannot swallow
+    // the owner's wakeup.
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = w->wake_fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wake_fd, &ev);
+}
+
+void uthread::detail::netpoll_wake(Worker* w) {
+    uint64_t one = 1;
+    (void)!write(w->wake_fd, &one, sizeof(one));
+}
+
+static PollDesc* poll_desc(int fd) {
+    if (fd < 0 || static_cast<size_t>(fd) >= poll_table_size) return nullptr;
+    return &poll_table[fd];
+}
+
+// First use of an fd: switch it to non-blocking and register it with the
+// calling worker's epoll instance for its whole lifetime.
+PollDesc* uthread::detail::netpoll_open(int fd) {
+    PollDesc* pd = poll_desc(fd);
+    if (!pd) {
+        errno = EMFILE;
+        return nullptr;
+    }
+    while (true) {
+        int state = pd->state.load(std::memory_order_acquire);
+        if (state == PD_REGISTERED) return pd;
+        if (state == PD_UNREGISTERED &&
+            pd->state.compare_exchange_strong(state, PD_REGISTERING, std::memory_order_acquire)) {
+            break;
+        }
+        // Somebody else is registering it, which takes two syscalls and
+        // never blocks. If they fail we try ourselves and report why.
+        cpu_relax();
+    }
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        pd->state.store(PD_UNREGISTERED);
+        return nullptr;
+    }
+    if (!(flags & O_NONBLOCK)) {
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    pd->rg.store(0, std::memory_order_relaxed);
+    pd->wg.store(0, std::memory_order_relaxed);
+    pd->closing.store(false, std::memory_order_relaxed);
+    pd->worker = my_worker->id;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(my_worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        pd->state.store(PD_UNREGISTERED);
+        return nullptr;
+    }
+    my_worker->poll_fds.fetch_add(1, std::memory_order_relaxed);
+    pd->state.store(PD_REGISTERED, std::memory_order_release);
+    return pd;
+}
+
+// An edge arrived (or the fd is closing): remember it and wake the waiter.
+// Returns true if a blocked thread was readied.
+static bool poll_unblock(std::atomic<uintptr_t>& g) {
+    uintptr_t old = g.load(std::memory_order_acquire);
+    while (true) {
+        if (old == PD_READY) return false;
+        if (g.compare_exchange_weak(old, PD_READY, std::memory_order_acq_rel)) break;
+    }
+    // PD_WAIT: the waiter has not committed yet and will see PD_READY.
+    if (old <= PD_WAIT) return false;
+    make_runnable(reinterpret_cast<TCB*>(old));
+    return true;
+}
+
+static bool poll_commit(TCB* tcb, void* arg) {
+    auto* g = static_cast<std::atomic<uintptr_t>*>(arg);
+    uintptr_t expected = PD_WAIT;
+    return g->compare_exchange_strong(expected, reinterpret_cast<uintptr_t>(tcb),
+                                      std::memory_order_acq_rel);
+}
+
+// Deadline timer: wakes the waiter as if an edge had arrived, unless the
+// wait it was armed for is over. The low bit of arg picks the direction.
+static bool poll_deadline(uintptr_t arg, uint32_t seq) {
+    PollDesc* pd = reinterpret_cast<PollDesc*>(arg & ~uintptr_t(1));
+    bool write = arg & 1;
+    std::atomic<uint32_t>& s = write ? pd->wseq : pd->rseq;
+    if (s.load(std::memory_order_acquire) != seq) return false;
+    return poll_unblock(write ? pd->wg : pd->rg);
+}
+
+static int poll_result(PollDesc* pd, bool timed, uint64_t deadline_ns) {
+    if (pd->closing.load(std::memory_order_acquire)) return EBADF;
+    if (timed && now_ns() >= deadline_ns) return ETIMEDOUT;
+    return 0;
+}
+
+// Waits for the next edge in one direction, or for the thread ahead of
+// us to finish its wait.
+int uthread::detail::netpoll_wait(PollDesc* pd, bool write, uint64_t deadline_ns) {
+    std::atomic<uintptr_t>& g = write ? pd->wg : pd->rg;
+    std::atomic<uint32_t>& seq = write ? pd->wseq : pd->rseq;
+    std::atomic<int32_t>& turn = write ? pd->wturn : pd->rturn;
+    bool timed = deadline_ns != NO_DEADLINE_NS;
+    if (timed && now_ns() >= deadline_ns) return ETIMEDOUT;
+
+    while (true) {
+        uintptr_t old = g.load(std::memory_order_acquire);
+        if (old == PD_READY) {
+            // An edge arrived while nobody waited; consume it.
+            if (g.compare_exchange_strong(old, 0, std::memory_order_acq_rel)) {
+                return poll_result(pd, timed, deadline_ns);
+            }
+        } else if (old != 0) {
+            // Another thread holds the slot. Read the turn before the
+            // re-check, so a holder leaving in between is not missed.
+            int32_t t = turn.load(std::memory_order_acquire);
+            if (g.load(std::memory_order_acquire) != old) continue;
+            if (!futex_wait(&turn, t, deadline_ns)) return ETIMEDOUT;
+            return poll_result(pd, timed, deadline_ns);
+        } else if (g.compare_exchange_strong(old, PD_WAIT, std::memory_order_acq_rel)) {
+            break;
+        }
+    }
+
+    int err = 0;
+    if (pd->closing.load(std::memory_order_acquire)) {
+        err = EBADF;
+        uintptr_t old = PD_WAIT;
+        g.compare_exchange_strong(old, 0, std::memory_order_release);
+    } else {
+        TimerNode timer;
+        if (timed) {
+            uint32_t s = seq.fetch_add(1, std::memory_order_acq_rel) + 1;
+            timer_arm(&timer, deadline_ns, poll_deadline, reinterpret_cast<uintptr_t>(pd) | write, s);
+        }
+        trace(TRACE_WAIT_FD, my_worker->running->id, uint32_t(pd - poll_table) << 1 | write);
+        block_current(poll_commit, &g);
+        if (timed) {
+            // The timer may already be firing; the bumped seq stops it
+            // from waking whatever waits on this fd next.
+            seq.fetch_add(1, std::memory_order_release);
+            timer_cancel(&timer);
+        }
+        // Woken by an edge (or the deadline, or close), which left
+        // PD_READY. A newcomer may have consumed it and taken the slot
+        // already, so only clear our own.
+        uintptr_t old = PD_READY;
+        g.compare_exchange_strong(old, 0, std::memory_order_release);
+    }
+    turn.fetch_add(1, std::memory_order_release);
+    futex_wake_all(&turn);
+    return err ? err : poll_result(pd, timed, deadline_ns);
+}
+
+int uthread::detail::netpoll_poll(Worker* w, int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout_ms);
+
+    int readied = 0;
+    for (int i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == w->wake_fd || fd == uring_fd(w)) {
+            // Only the owner drains its wakeup or reaps its ring; both are
+            // level-triggered, so a thief just leaves them pending.
+            if (w != my_worker) continue;
+            if (fd == w->wake_fd) {
+                uint64_t count;
+                (void)!read(w->wake_fd, &count, sizeof(count));
+            } else {
+                readied += uring_reap(w);
+            }
+            continue;
+        }
+
+        PollDesc* pd = poll_desc(fd);
+        if (!pd) continue;
+        uint32_t ev = events[i].events;
+        if ((ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && poll_unblock(pd->rg)) {
+            ++readied;
+        }
+        if ((ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && poll_unblock(pd->wg)) {
+            ++readied;
+        }
+    }
+    return readied;
+}
+
+// Wakes anybody waiting on fd and forgets it, before the number can be
+// reused. close() itself drops the fd from the epoll set.
+void uthread::detail::netpoll_close(int fd) {
+    PollDesc* pd = poll_desc(fd);
+    if (pd && pd->state.load(std::memory_order_acquire) == PD_REGISTERED) {
+        pd->closing.store(true, std::memory_order_release);
+        poll_unblock(pd->rg);
+        poll_unblock(pd->wg);
+        workers[pd->worker]->poll_fds.fetch_sub(1, std::memory_order_relaxed);
+        pd->state.store(PD_UNREGISTERED, std::memory_order_release);
+    }
+}
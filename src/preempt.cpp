@@ -0,0 +1,151 @@
+#include "../include/uthread.h"
+#include "runtime.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+using namespace uthread::detail;
+
+// ---------------------------------------------------------
+// Preemption
+// ---------------------------------------------------------
+// Every worker arms a timer on its own thread CPU clock that sends
+// PREEMPT_SIGNAL to that kernel thread once per slice, so parked workers
+// cost nothing. The handler yields on behalf of the running thread, from
+// inside the signal frame on that thread's stack; when the thread is
+// resumed (on any worker) the handler returns and sigreturn puts it back
+// exactly where it was interrupted.
+//
+// Switching is only safe when the thread is running its own code:
+//   * Runtime code runs under a PreemptGuard, which holds the signal off
+//     until the guard is released and then yields there instead.
+//   * Anything outside the program's own text (libc, libstdc++, the
+//     dynamic linker) may hold a lock that the next thread on the same
+//     worker needs, e.g. malloc's, so such a slice is retried on the
+//     next tick.
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+const int PREEMPT_SIGNAL = SIGVTALRM;
+
+// Bounds of the executable's text, from the default linker script.
+extern "C" char __executable_start[];
+extern "C" char etext[];
+
+static bool preempt_on = false;
+static std::chrono::microseconds preempt_slice{0};
+
+__attribute__((noinline)) static int get_errno() {
+    return errno;
+}
+
+__attribute__((noinline)) static void set_errno(int err) {
+    errno = err;
+}
+
+static uintptr_t interrupted_pc(void* uctx) {
+    auto* uc = static_cast<ucontext_t*>(uctx);
+#if defined(__x86_64__)
+    return static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__aarch64__)
+    return static_cast<uintptr_t>(uc->uc_mcontext.pc);
+#else
+    (void)uc;
+    return 0; // Unknown layout: never preempt asynchronously
+#endif
+}
+
+static bool in_program_text(uintptr_t pc) {
+    return pc >= reinterpret_cast<uintptr_t>(__executable_start) &&
+           pc < reinterpret_cast<uintptr_t>(etext);
+}
+
+static void preempt_handler(int, siginfo_t*, void* uctx) {
+    Worker* w = my_worker;
+    if (!w) return;
+    TCB* tcb = w->running;
+    if (!tcb) return;
+
+    // A thread scheduled since the last tick has not used a full slice.
+    if (w->preempt_tick != w->tick) {
+        w->preempt_tick = w->tick;
+        return;
+    }
+    if (tcb->preempt_off > 0 || !in_program_text(interrupted_pc(uctx))) {
+        tcb->preempt_pending = true;
+        return;
+    }
+
+    // The scheduler must be able to take the next signal, and the mask
+    // restored by sigreturn later is the one from before this signal.
+    int saved_errno = get_errno();
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, PREEMPT_SIGNAL);
+    pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+
+    w->preempted = true;
+    uthread::yield();
+
+    // errno travels with the thread, which may now be on another worker.
+    set_errno(saved_errno);
+}
+
+void uthread::detail::preempt_init(std::chrono::microseconds slice) {
+    struct sigaction sa = {};
+    sa.sa_sigaction = preempt_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(PREEMPT_SIGNAL, &sa, nullptr) != 0) {
+        perror("sigaction");
+        std::exit(1);
+    }
+    preempt_slice = slice;
+    preempt_on = true;
+}
+
+bool uthread::detail::preempt_enabled() {
+    return preempt_on;
+}
+
+void uthread::detail::preempt_start_worker(Worker* w) {
+    struct sigevent sev = {};
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = PREEMPT_SIGNAL;
+    sev.sigev_notify_thread_id = static_cast<pid_t>(syscall(SYS_gettid));
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &w->preempt_timer) != 0) {
+        perror("timer_create");
+        std::exit(1);
+    }
+
+    long long us = preempt_slice.count();
+    struct itimerspec its = {};
+    its.it_interval.tv_sec = us / 1000000;
+    its.it_interval.tv_nsec = (us % 1000000) * 1000;
+    its.it_value = its.it_interval;
+    if (timer_settime(w->preempt_timer, 0, &its, nullptr) != 0) {
+        perror("timer_settime");
+        std::exit(1);
+    }
+}
+
+void uthread::detail::preempt_stop_worker(Worker* w) {
+    if (!w->preempt_timer) return;
+    timer_delete(w->preempt_timer);
+    w->preempt_timer = nullptr;
+}
+
+void uthread::detail::preempt_deferred() {
+    // Called with preempt_off back at 0, so a signal may move us first.
+    TCB* tcb = current_tcb();
+    if (!tcb) return;
+    tcb->preempt_pending = false;
+    uthread::yield();
+}
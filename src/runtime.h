@@ -0,0 +1,507 @@
+#ifndef UTHREAD_RUNTIME_H
+#define UTHREAD_RUNTIME_H
+
+// Internal runtime structures shared by the scheduler (uthread.cpp) and
+// the subsystems built on it. Not part of the public API.
+
+#include "context.h"
+#include "stack_pool.h"
+#include "work_deque.h"
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Configuration
+const size_t STACK_SIZE = 64 * 1024; // Default, see uthread::create
+const int MAX_EVENTS = 64; // Max IO events to process per tick
+const size_t LOCAL_QUEUE_SIZE = 256; // Per-worker ring, spills to the injection queue
+const unsigned INJECT_CHECK_INTERVAL = 61; // Ticks between forced injection-queue checks
+const int SPIN_ROUNDS = 64; // Searching rounds before an idle worker parks
+const int PRIORITY_LEVELS = 3; // Ready-queue levels per worker, 0 is the highest
+const unsigned PRIORITY_AGING = 16; // Picks a waiting level can be passed over
+const int WHEEL_LEVELS = 6; // Timer wheel: 64^6 ticks (~2 years) before clamping
+const int WHEEL_SLOTS = 64;
+const uint64_t WHEEL_TICK_NS = 1000000; // Timer resolution, 1 ms
+const size_t CLOSURE_INLINE_MAX = 1024; // spawn() closures above this go on the heap
+const unsigned RUNNEXT_STREAK_MAX = 32; // runnext picks in a row before the ready queue gets a turn
+const unsigned RUNNEXT_GRACE_US = 3; // How long a thief leaves a worker's runnext alone
+const size_t TCB_SLAB = 64; // TCBs allocated at a time once a worker's free list runs dry
+const size_t FORK_QUEUE_SIZE = 64; // Per-worker parallel_for splits awaiting a thief
+const int STATS_BUCKETS = 64; // log2 buckets of stats_ticks() per histogram
+const uint32_t STATS_SAMPLE_INTERVAL = 16; // One switch (and one wakeup) in this many is timed
+const size_t TRACE_RING_SIZE = 64 * 1024; // Events kept per worker, a power of two
+
+struct IoRing;        // io_uring.cpp
+struct io_uring_sqe;  // <linux/io_uring.h>
+namespace uthread { namespace detail { struct ForkTask; } } // uthread.h
+
+enum class ThreadState : uint8_t { READY, RUNNING, BLOCKED, FINISHED };
+
+// Allocated and freed only by the scheduler (see uthread.cpp's Thread
+// Control Blocks): a spawn takes one from its worker's free list, and
+// the worker that sees the thread finish puts it back on its own. The
+// fields a switch touches come first, so they share one cache line.
+struct alignas(64) TCB {
+    TCB* next = nullptr; // Injection queue or free list link
+    uint64_t ready_ticks = 0; // stats_ticks() when made READY, if sampled
+    ThreadState state = ThreadState::READY;
+    bool preempt_pending = false; // A slice ended while preempt_off > 0
+    int priority = 1; // Ready-queue level, see priority_level()
+    // Preemption (see preempt.cpp): non-zero while the thread is inside
+    // the runtime, and held across every switch out, so only a thread
+    // running its own code can be preempted.
+    int preempt_off = 1;
+    int id = 0;
+    Context context;
+
+    // Start and finish only.
+    Stack stack;
+    void (*func)() = nullptr;
+    // spawn(): the closure lives at the top of the stack, or on the heap
+    // if it is too big, in which case closure_align is set.
+    void (*closure_run)(void*) = nullptr;
+    void* closure = nullptr;
+    size_t closure_align = 0;
+};
+
+// FIFO linked through TCB::next, so queueing never allocates.
+struct TcbList {
+    TCB* head = nullptr;
+    TCB* tail = nullptr;
+
+    void push_back(TCB* tcb) {
+        tcb->next = nullptr;
+        if (tail) tail->next = tcb; else head = tcb;
+        tail = tcb;
+    }
+
+    TCB* pop_front() {
+        TCB* tcb = head;
+        if (!tcb) return nullptr;
+        head = tcb->next;
+        if (!head) tail = nullptr;
+        tcb->next = nullptr;
+        return tcb;
+    }
+};
+
+// New threads another worker placed here (see uthread.cpp's Spawn
+// Placement). The owner moves them to its ready queues; an idle thief may
+// take them too, since only the owner can push to the deques.
+struct alignas(64) Inbox {
+    std::mutex lock;
+    TcbList list;
+    std::atomic<size_t> size{0}; // Lets the owner skip the lock
+};
+
+// One deque per priority level. Level 0 runs first.
+struct ReadyQueues {
+    WorkDeque<TCB*, LOCAL_QUEUE_SIZE> level[PRIORITY_LEVELS];
+
+    bool empty() const {
+        for (const auto& q : level) {
+            if (!q.empty()) return false;
+        }
+        return true;
+    }
+};
+
+// Maps the public priority (any int) to a level: positive is high, zero
+// normal, negative low.
+static inline int priority_level(int priority) {
+    return priority > 0 ? 0 : (priority == 0 ? 1 : 2);
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// xorshift32: per-worker, so victim selection never touches shared state.
+struct FastRand {
+    uint32_t state;
+    explicit FastRand(uint32_t seed) : state(seed ? seed : 0x9E3779B9u) {}
+    uint32_t next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+};
+
+// Written only by the owning worker; read by uthread::steal_stats().
+struct alignas(64) StealCounters {
+    std::atomic<uint64_t> attempts{0};
+    std::atomic<uint64_t> successes{0};
+    std::atomic<uint64_t> tasks_moved{0};
+    std::atomic<uint64_t> cross_node{0};
+};
+
+// Per-worker statistics (see stats.cpp), same rules as StealCounters.
+// Counters are always kept; the *_ticks fields and the histograms only
+// while stats_timing is on, from one switch in STATS_SAMPLE_INTERVAL.
+struct alignas(64) WorkerCounters {
+    uint32_t switch_sample = 0; // Owner only, picks the switches to time
+    uint32_t ready_sample = 0;  // Same for make_runnable
+
+    std::atomic<uint64_t> switches{0};
+    std::atomic<uint64_t> spawns{0};
+    std::atomic<uint64_t> parks{0};
+    std::atomic<uint64_t> io_wakeups{0};
+    std::atomic<uint64_t> timer_wakeups{0};
+    std::atomic<uint64_t> busy_ticks{0}; // Sampled slices times the interval
+    std::atomic<uint64_t> idle_ticks{0};
+    std::atomic<uint64_t> wait_hist[STATS_BUCKETS] = {};  // READY until switched in
+    std::atomic<uint64_t> slice_hist[STATS_BUCKETS] = {}; // Switched in until out
+};
+
+// Tracer events (see trace.cpp). Each carries a thread id and a 24-bit
+// argument.
+enum TraceType : uint8_t {
+    TRACE_CREATE,  // Thread created here
+    TRACE_RUN,     // Switched in
+    TRACE_YIELD,   // Switched out READY
+    TRACE_PREEMPT, // Switched out READY at the end of its slice
+    TRACE_BLOCK,   // Switched out BLOCKED
+    TRACE_FINISH,  // Switched out FINISHED
+    TRACE_WAIT_FD, // About to block on an fd; arg = fd << 1 | write
+    TRACE_WAIT_IO, // About to block on io_uring; arg = opcode
+    TRACE_WAKE,    // Made READY by this worker
+    TRACE_STEAL,   // Taken from another worker; arg = its id
+};
+
+struct TraceRecord {
+    uint64_t ticks; // stats_ticks()
+    uint32_t tid;
+    uint32_t type_arg; // TraceType | arg << 8
+};
+
+// Written only by the owning worker, oldest events overwritten.
+struct TraceRing {
+    std::atomic<uint64_t> head{0}; // Events ever written
+    TraceRecord events[TRACE_RING_SIZE];
+};
+
+// Where a CPU sits (see topology.cpp). Ids are the lowest CPU sharing
+// the resource, so only compare them for equality.
+struct CpuPlace {
+    int cpu = -1;  // -1: the worker is not pinned
+    int core = -1; // SMT siblings share a core
+    int l3 = -1;   // Last-level cache
+    int node = 0;  // NUMA node
+};
+
+// Workers at one distance from a thief, with strides coprime to their
+// number so a random start and stride visit each once.
+struct StealTier {
+    std::vector<uint32_t> victims;
+    std::vector<uint32_t> strides;
+};
+
+static inline void bump(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Runs on the scheduler stack right after a thread switches out BLOCKED;
+// returning false cancels the block and requeues the thread.
+using BlockCommit = bool (*)(TCB* tcb, void* arg);
+
+// Returns true if it readied a thread. `seq` is whatever the arming code
+// passed to timer_arm; callbacks that can race the wait they were armed
+// for compare it to tell whether that wait is still on.
+using TimerFn = bool (*)(uintptr_t arg, uint32_t seq);
+
+struct Worker;
+
+// Owned by whoever arms it, usually on the waiting thread's stack; it
+// must stay put until it fires or timer_cancel() returns. The callback
+// gets copies of fn/arg/seq, so the node may go away while it runs.
+struct TimerNode {
+    uint64_t when_tick = 0; // WHEEL_TICK_NS units of CLOCK_MONOTONIC
+    TimerFn fn = nullptr;
+    uintptr_t arg = 0;
+    uint32_t seq = 0;
+    // Wheel links, guarded by the owner's TimerWheel::lock.
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    int slot = 0; // level * WHEEL_SLOTS + slot
+    std::atomic<Worker*> owner{nullptr}; // Non-null while armed
+};
+
+// Hierarchical timing wheel (see timer.cpp). Only the owning worker
+// arms and fires timers; any thread may cancel, hence the lock.
+struct TimerWheel {
+    std::mutex lock;
+    std::atomic<size_t> count{0};
+    uint64_t elapsed;                 // Ticks processed so far
+    uint64_t next_ns = UINT64_MAX;    // Nothing fires before this; owner only
+    uint64_t occupied[WHEEL_LEVELS] = {}; // Bit per non-empty slot
+    TimerNode* slots[WHEEL_LEVELS][WHEEL_SLOTS] = {};
+
+    TimerWheel();
+};
+
+// Sentinel for "no deadline" in internal nanosecond deadlines.
+const uint64_t NO_DEADLINE_NS = UINT64_MAX;
+
+struct Worker {
+    int id;
+    std::thread thread_obj;
+    ReadyQueues ready_queue;
+    // A thread the running one woke, run ahead of ready_queue (see
+    // find_runnable). Thieves take it only after RUNNEXT_GRACE_US.
+    std::atomic<TCB*> runnext{nullptr};
+    unsigned runnext_streak = 0;
+    // Halves split off by parallel algorithms running here (see
+    // uthread.cpp's Fork-Join section).
+    WorkDeque<uthread::detail::ForkTask*, FORK_QUEUE_SIZE> forks;
+    unsigned starve[PRIORITY_LEVELS] = {}; // Times each level was passed over
+    unsigned tick = 0;
+    // The thread being run; the preemption signal handler reads it too.
+    TCB* running = nullptr;
+    unsigned preempt_tick = 0; // `tick` at the last preemption signal
+    bool preempted = false;    // The last thread run used up its slice
+    timer_t preempt_timer = nullptr;
+    FastRand rng;
+    Context sched_context;
+    StackPool stack_pool;
+    TCB* free_tcbs = nullptr; // See alloc_tcb()
+    Inbox inbox;
+    unsigned deal = 0; // Next worker for Placement::RoundRobin
+    StealCounters steal_stats;
+    WorkerCounters stats;
+    TraceRing* trace_ring = nullptr; // Allocated by the first trace_start()
+    CpuPlace place;
+    // Everybody else, nearest first: SMT siblings, same L3, same node,
+    // other nodes. A single tier unless workers are pinned.
+    std::vector<StealTier> steal_tiers;
+
+    // Idle protocol (see park_worker). park_word is 1 while parked.
+    std::atomic<uint32_t> park_word{0};
+    bool searching = false;
+
+    // Netpoller (see netpoll.cpp). Parked workers sleep in epoll_wait on
+    // epoll_fd; writing wake_fd interrupts them.
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    std::atomic<int> poll_fds{0}; // fds registered with epoll_fd
+    IoRing* ring = nullptr;       // Set when the io_uring backend is active
+    TimerWheel timers;
+
+    BlockCommit block_commit = nullptr;
+    void* block_arg = nullptr;
+
+    Worker(int worker_id) : id(worker_id), rng(0x2545F491u * (worker_id + 1)) {}
+};
+
+namespace uthread {
+namespace detail {
+    extern std::vector<std::unique_ptr<Worker>> workers;
+    extern std::atomic<bool> system_running;
+    extern thread_local Worker* my_worker;
+
+    // Marks `tcb` READY, queues it on the calling worker and wakes an
+    // idle worker if nobody is searching.
+    void make_runnable(TCB* tcb);
+
+    // Switches the running thread out as BLOCKED. Once its context is
+    // saved, the scheduler calls commit(tcb, arg) (see BlockCommit).
+    // Whoever later wakes the thread calls make_runnable().
+    void block_current(BlockCommit commit, void* arg);
+
+    void wake_one();
+
+    // netpoll.cpp
+    void netpoll_init();
+    void netpoll_init_worker(Worker* w);
+    // Harvests readiness from w's epoll instance and readies blocked
+    // threads onto the calling worker. Returns the number readied.
+    int netpoll_poll(Worker* w, int timeout_ms);
+    void netpoll_wake(Worker* w);
+    struct PollDesc;
+    // Registers fd on first use (see netpoll.cpp); nullptr on failure.
+    PollDesc* netpoll_open(int fd);
+    // Blocks until the next edge in one direction. Returns 0, EBADF if
+    // the fd is closing, or ETIMEDOUT once deadline_ns has passed.
+    int netpoll_wait(PollDesc* pd, bool write, uint64_t deadline_ns);
+    void netpoll_close(int fd);
+
+    // preempt.cpp
+    void preempt_init(std::chrono::microseconds slice);
+    bool preempt_enabled();
+    // Arm and disarm the calling worker's slice timer.
+    void preempt_start_worker(Worker* w);
+    void preempt_stop_worker(Worker* w);
+    // Yields for a preemption deferred by a PreemptGuard.
+    void preempt_deferred();
+
+    // io_uring.cpp
+    bool uring_init(const std::vector<std::unique_ptr<Worker>>& ws);
+    bool uring_active();
+    int uring_fd(Worker* w);
+    bool uring_wants_flush(Worker* w, bool idle);
+    void uring_flush(Worker* w);
+    // Readies the threads whose operations completed. Owner only.
+    int uring_reap(Worker* w);
+    // Zeroed SQE on the calling worker's ring; fill it in and pass it to
+    // uring_wait, which blocks until completion and returns cqe->res
+    // (-ETIMEDOUT if deadline_ns passed first).
+    io_uring_sqe* uring_sqe();
+    int uring_wait(io_uring_sqe* sqe, uint64_t deadline_ns = NO_DEADLINE_NS);
+    // Applies an io_uring_register call to every worker's ring.
+    int uring_register(unsigned opcode, const void* arg, unsigned nr_args);
+
+    // sync.cpp: counting semaphores on the shared wait queues. acquire
+    // blocks until *addr > 0 and decrements it, or returns false once
+    // deadline_ns passes; lifo queues at the front. With handoff, release
+    // gives the count straight to the woken waiter and yields to it.
+    bool sema_acquire(std::atomic<uint32_t>* addr, bool lifo = false,
+                      uint64_t deadline_ns = NO_DEADLINE_NS);
+    void sema_release(std::atomic<uint32_t>* addr, bool handoff = false);
+    // Parks until *word differs from expected (false once deadline_ns
+    // passes); wake_all wakes everything parked on word.
+    bool futex_wait(const std::atomic<int32_t>* word, int32_t expected,
+                    uint64_t deadline_ns = NO_DEADLINE_NS);
+    void futex_wake_all(const std::atomic<int32_t>* word);
+
+    // blocking.cpp
+    void blocking_init(int max_threads);
+
+    // stats.cpp
+    extern bool stats_timing;
+    void stats_init(bool timing, bool dump_on_signal);
+    // Dumps to stderr if SIGUSR1 asked for it. Called by the scheduler.
+    void stats_poll_dump();
+    // Measured rate of stats_ticks() since init.
+    double ns_per_tick();
+    // uthread.cpp
+    size_t injection_queued();
+
+    // trace.cpp
+    extern std::atomic<bool> trace_on;
+
+    // topology.cpp
+    void topology_init();
+    // CPUs this process may run on, in the order workers are pinned.
+    const std::vector<CpuPlace>& topology_cpus();
+    int topology_nodes();
+    void pin_thread(int cpu);
+    // Back to the affinity the process started with.
+    void unpin_thread();
+
+    // timer.cpp
+    uint64_t now_ns();
+    // uthread::Deadline to nanoseconds on now_ns()'s clock.
+    uint64_t deadline_to_ns(std::chrono::steady_clock::time_point deadline);
+    // Arms t on the calling worker to call fn(arg, seq) once when_ns has
+    // passed. O(1).
+    void timer_arm(TimerNode* t, uint64_t when_ns, TimerFn fn, uintptr_t arg, uint32_t seq);
+    // Disarms t from any thread. False if it already fired (its callback
+    // may still be running). O(1).
+    bool timer_cancel(TimerNode* t);
+    // Fires w's expired timers; owner only. Returns the number readied.
+    int timers_run(Worker* w);
+    // epoll_wait timeout until w's next timer, or -1 if none.
+    int timers_timeout_ms(Worker* w);
+}
+}
+
+// Cheap timestamps for the stats: the cycle counter where there is one,
+// converted to nanoseconds only when a snapshot is taken.
+static inline uint64_t stats_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return uthread::detail::now_ns();
+#endif
+}
+
+static inline void stats_record(std::atomic<uint64_t>* hist, uint64_t ticks) {
+    if (static_cast<int64_t>(ticks) < 0) ticks = 0; // Counters a little apart across CPUs
+    bump(hist[ticks ? 63 - __builtin_clzll(ticks) : 0]);
+}
+
+static inline bool stats_sample(uint32_t& n) {
+    return uthread::detail::stats_timing && (++n & (STATS_SAMPLE_INTERVAL - 1)) == 0;
+}
+
+// Two reads of a cycle counter still cost as much as a third of a
+// switch in some VMs, so only a sample of threads are timed.
+static inline void stats_mark_ready(TCB* tcb) {
+    Worker* w = uthread::detail::my_worker;
+    if (w && stats_sample(w->stats.ready_sample)) tcb->ready_ticks = stats_ticks();
+}
+
+// Records one tracer event on the calling worker. Without UTHREAD_TRACE
+// it compiles to nothing; with it, a disabled tracer costs a load and a
+// branch.
+#ifdef UTHREAD_TRACE
+static inline void trace(TraceType type, uint32_t tid, uint32_t arg = 0) {
+    Worker* w = uthread::detail::my_worker;
+    if (!uthread::detail::trace_on.load(std::memory_order_acquire) || !w) return;
+    TraceRing* r = w->trace_ring;
+    uint64_t i = r->head.load(std::memory_order_relaxed);
+    r->events[i & (TRACE_RING_SIZE - 1)] = {stats_ticks(), tid, uint32_t(type) | arg << 8};
+    r->head.store(i + 1, std::memory_order_release);
+}
+#else
+static inline void trace(TraceType, uint32_t, uint32_t = 0) {}
+#endif
+
+// The calling thread's TCB, or nullptr on the scheduler stack or off the
+// runtime. Preemption may move the thread to another worker between
+// reading my_worker and its `running`, which then belongs to somebody
+// else. Getting back to the same worker means being switched in there
+// again, so an unchanged switch count proves the read was ours.
+static inline TCB* current_tcb() {
+    while (true) {
+        Worker* w = uthread::detail::my_worker;
+        if (!w) return nullptr;
+        uint64_t switches = w->stats.switches.load(std::memory_order_relaxed);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        TCB* tcb = w->running;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        if (uthread::detail::my_worker == w && w->stats.switches.load(std::memory_order_relaxed) == switches) {
+            return tcb;
+        }
+    }
+}
+
+// Holds off preemption while the running thread is inside the runtime,
+// e.g. between queueing itself on a worker's structures and parking.
+// Guards nest and stay with the thread if it blocks and resumes on
+// another worker; a slice that ended meanwhile yields on the way out.
+// A no-op on the scheduler stack.
+struct PreemptGuard {
+    TCB* tcb;
+
+    PreemptGuard() {
+        tcb = current_tcb();
+        if (tcb) ++tcb->preempt_off;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+
+    ~PreemptGuard() {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        if (tcb && --tcb->preempt_off == 0 && tcb->preempt_pending) {
+            uthread::detail::preempt_deferred();
+        }
+    }
+
+    PreemptGuard(const PreemptGuard&) = delete;
+    PreemptGuard& operator=(const PreemptGuard&) = delete;
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include "stack_pool.h"
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+static size_t page_size() {
+    static const size_t ps = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return ps;
+}
+
+StackPool::StackPool(size_t high_water, size_t max_cached)
+    : high_water_(high_water), max_cached_(max_cached) {}
+
+StackPool::~StackPool() {
+    for (auto& bucket : free_) {
+        for (auto& s : bucket) unmap_stack(s);
+    }
+}
+
+int StackPool::size_class(size_t size) {
+    int cls = 0;
+    size_t cap = MIN_STACK;
+    while (cap < size && cls < NUM_CLASSES - 1) {
+        cap <<= 1;
+        ++cls;
+    }
+    return cap >= size ? cls : -1;
+}
+
+// mbind(2) without libnuma. Pages already present stay where they are,
+// so callers drop them first. Failure just leaves placement to the
+// kernel's default policy.
+static void bind_to_node(void* addr, size_t len, int node) {
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+}
+
+Stack StackPool::map_stack(size_t size, int node) {
+    const size_t guard = page_size();
+    size = (size + guard - 1) & ~(guard - 1);
+
+    // MAP_NORESERVE: nothing is committed until the fiber touches it.
+    void* mem = mmap(nullptr, size + guard, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap stack");
+        abort();
+    }
+    // Stacks grow down, so the guard page goes at the low end.
+    if (mprotect(mem, guard, PROT_NONE) != 0) {
+        perror("mprotect guard page");
+        abort();
+    }
+
+    Stack s;
+    s.base = static_cast<char*>(mem) + guard;
+    s.size = size;
+    if (node >= 0 && node < 64) {
+        bind_to_node(s.base, s.size, node);
+        s.node = node;
+    }
+    return s;
+}
+
+void StackPool::unmap_stack(Stack stack) {
+    if (!stack) return;
+    const size_t guard = page_size();
+    munmap(stack.base - guard, stack.size + guard);
+}
+
+Stack StackPool::allocate(size_t size) {
+    int cls = size_class(size);
+    if (cls < 0) return map_stack(size, node_); // Oversized: not pooled
+
+    auto& bucket = free_[cls];
+    if (!bucket.empty()) {
+        Stack s = bucket.back();
+        bucket.pop_back();
+        return s;
+    }
+    return map_stack(MIN_STACK << cls, node_);
+}
+
+void StackPool::release(Stack stack) {
+    if (!stack) return;
+    int cls = size_class(stack.size);
+    if (cls < 0 || (MIN_STACK << cls) != stack.size) {
+        unmap_stack(stack);
+        return;
+    }
+
+    auto& bucket = free_[cls];
+    if (bucket.size() >= max_cached_) {
+        unmap_stack(stack);
+        return;
+    }
+    if (node_ >= 0 && node_ < 64 && stack.node != node_) {
+        // The thread finished here but its stack came from another node.
+        madvise(stack.base, stack.size, MADV_DONTNEED);
+        bind_to_node(stack.base, stack.size, node_);
+        stack.node = node_;
+    } else if (bucket.size() >= high_water_) {
+        // Keep the mapping for reuse but hand the dirty pages back.
+        madvise(stack.base, stack.size, MADV_DONTNEED);
+    }
+    bucket.push_back(stack);
+}
@@ -0,0 +1,55 @@
+#ifndef UTHREAD_STACK_POOL_H
+#define UTHREAD_STACK_POOL_H
+
+#include <cstddef>
+#include <vector>
+
+// A fiber stack: `base`/`size` is the usable region, which sits directly
+// above a PROT_NONE guard page so an overflow faults instead of running
+// into whatever was mapped below it.
+struct Stack {
+    char* base = nullptr;
+    size_t size = 0;
+    int node = -1; // NUMA node its pages are bound to, or -1
+
+    explicit operator bool() const { return base != nullptr; }
+};
+
+// Per-worker cache of mmap'd stacks, bucketed by power-of-two size class.
+// Pages are only committed when the fiber touches them. Released stacks
+// are kept for reuse; once a class holds more than `high_water` stacks,
+// further ones have their pages dropped with MADV_DONTNEED before being
+// cached, and past `max_cached` they are unmapped outright.
+class StackPool {
+public:
+    static constexpr size_t MIN_STACK = 16 * 1024;
+    static constexpr int NUM_CLASSES = 10; // 16 KiB .. 8 MiB
+
+    StackPool(size_t high_water = 64, size_t max_cached = 1024);
+    ~StackPool();
+
+    StackPool(const StackPool&) = delete;
+    StackPool& operator=(const StackPool&) = delete;
+
+    Stack allocate(size_t size);
+    void release(Stack stack);
+
+    // Binds the pages of stacks this pool hands out to a NUMA node (-1,
+    // the default, leaves placement to the kernel). A stack released here
+    // from another node is rebound, and its pages dropped, on the way in.
+    void set_node(int node) { node_ = node; }
+
+    // Bypass the cache (used when no worker owns the caller).
+    static Stack map_stack(size_t size, int node = -1);
+    static void unmap_stack(Stack stack);
+
+private:
+    static int size_class(size_t size);
+
+    size_t high_water_;
+    size_t max_cached_;
+    int node_ = -1;
+    std::vector<Stack> free_[NUM_CLASSES];
+};
+
+#endif
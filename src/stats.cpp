@@ -0,0 +1,153 @@
+#include "../include/uthread.h"
+#include "runtime.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+
+using namespace uthread::detail;
+
+// ---------------------------------------------------------
+// Runtime Statistics
+// ---------------------------------------------------------
+// Every worker counts into its own cache line (WorkerCounters) with
+// plain relaxed stores, so keeping stats costs no shared writes. Times
+// are taken with stats_ticks(), the cycle counter on x86 and arm64, and
+// only turned into nanoseconds when somebody asks for a snapshot, using
+// the rate measured between init() and then.
+
+bool uthread::detail::stats_timing = false;
+
+static uint64_t ticks_at_init;
+static uint64_t ns_at_init;
+static std::atomic<bool> dump_requested{false};
+
+// Only sets a flag; the scheduler does the writing (stats_poll_dump).
+// Worker 0 is woken in case every worker is parked.
+static void on_sigusr1(int) {
+    int saved = errno;
+    dump_requested.store(true, std::memory_order_relaxed);
+    if (!workers.empty()) netpoll_wake(workers[0].get());
+    errno = saved;
+}
+
+void uthread::detail::stats_init(bool timing, bool dump_on_signal) {
+    stats_timing = timing;
+    ticks_at_init = stats_ticks();
+    ns_at_init = now_ns();
+    if (dump_on_signal) {
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_sigusr1;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGUSR1, &sa, nullptr) != 0) {
+            std::fprintf(stderr, "uthread: could not install the SIGUSR1 handler: %s\n", std::strerror(errno));
+        }
+    }
+}
+
+void uthread::detail::stats_poll_dump() {
+    if (!dump_requested.load(std::memory_order_relaxed)) return;
+    if (dump_requested.exchange(false)) uthread::dump_stats(2);
+}
+
+double uthread::detail::ns_per_tick() {
+    uint64_t ticks = stats_ticks() - ticks_at_init;
+    uint64_t ns = now_ns() - ns_at_init;
+    return ticks > 0 ? double(ns) / double(ticks) : 1.0;
+}
+
+static uint64_t to_ns(uint64_t ticks, double scale) {
+    return static_cast<uint64_t>(double(ticks) * scale);
+}
+
+// Tick bucket b starts at 2^b ticks; it lands in the nanosecond bucket
+// holding that start.
+static uthread::Histogram to_histogram(const std::atomic<uint64_t>* hist, double scale) {
+    uthread::Histogram h;
+    for (int b = 0; b < STATS_BUCKETS; ++b) {
+        uint64_t n = hist[b].load(std::memory_order_relaxed);
+        if (n == 0) continue;
+        double start = std::ldexp(scale, b);
+        int i = start < 2.0 ? 0 : static_cast<int>(std::floor(std::log2(start)));
+        h.counts[std::min(i, uthread::Histogram::BUCKETS - 1)] += n;
+    }
+    return h;
+}
+
+namespace uthread {
+    uint64_t Histogram::total() const {
+        uint64_t n = 0;
+        for (uint64_t c : counts) n += c;
+        return n;
+    }
+
+    uint64_t Histogram::percentile(double q) const {
+        uint64_t n = total();
+        if (n == 0) return 0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * double(n))));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank) return uint64_t(1) << (i + 1);
+        }
+        return uint64_t(1) << BUCKETS;
+    }
+
+    RuntimeStats stats() {
+        double scale = ns_per_tick();
+        RuntimeStats out;
+        out.uptime_ns = now_ns() - ns_at_init;
+        out.injection_queued = injection_queued();
+        out.blocking = blocking_stats();
+        for (auto& w : workers) {
+            const WorkerCounters& c = w->stats;
+            WorkerStats st;
+            st.worker_id = w->id;
+            st.switches = c.switches.load(std::memory_order_relaxed);
+            st.spawns = c.spawns.load(std::memory_order_relaxed);
+            st.steal_attempts = w->steal_stats.attempts.load(std::memory_order_relaxed);
+            st.steals = w->steal_stats.successes.load(std::memory_order_relaxed);
+            st.parks = c.parks.load(std::memory_order_relaxed);
+            st.io_wakeups = c.io_wakeups.load(std::memory_order_relaxed);
+            st.timer_wakeups = c.timer_wakeups.load(std::memory_order_relaxed);
+            st.busy_ns = to_ns(c.busy_ticks.load(std::memory_order_relaxed), scale);
+            st.idle_ns = to_ns(c.idle_ticks.load(std::memory_order_relaxed), scale);
+            st.queued = 0;
+            for (const auto& q : w->ready_queue.level) st.queued += q.size();
+            if (w->runnext.load(std::memory_order_relaxed)) ++st.queued;
+            st.run_queue_wait = to_histogram(c.wait_hist, scale);
+            st.run_slice = to_histogram(c.slice_hist, scale);
+            out.workers.push_back(st);
+        }
+        return out;
+    }
+
+    void dump_stats(int fd) {
+        RuntimeStats st = stats();
+        dprintf(fd, "uthread: stats after %.3f s: injection queue %zu, blocking pool %d threads (%d idle), "
+                    "%zu queued, %llu calls\n",
+                st.uptime_ns / 1e9, st.injection_queued, st.blocking.threads, st.blocking.idle_threads,
+                st.blocking.queued, (unsigned long long)st.blocking.calls);
+        for (const WorkerStats& w : st.workers) {
+            dprintf(fd, "  worker %d: %llu switches, %llu spawns, %llu/%llu steals, %llu parks, "
+                        "%llu io / %llu timer wakeups, busy %.1f ms, idle %.1f ms, %zu queued\n",
+                    w.worker_id, (unsigned long long)w.switches, (unsigned long long)w.spawns,
+                    (unsigned long long)w.steals, (unsigned long long)w.steal_attempts,
+                    (unsigned long long)w.parks, (unsigned long long)w.io_wakeups,
+                    (unsigned long long)w.timer_wakeups, w.busy_ns / 1e6, w.idle_ns / 1e6, w.queued);
+            if (w.run_slice.total() == 0) continue;
+            dprintf(fd, "    run-queue wait p50 < %llu ns, p99 < %llu ns, max < %llu ns; "
+                        "run slice p50 < %llu ns, p99 < %llu ns, max < %llu ns\n",
+                    (unsigned long long)w.run_queue_wait.percentile(0.5),
+                    (unsigned long long)w.run_queue_wait.percentile(0.99),
+                    (unsigned long long)w.run_queue_wait.percentile(1.0),
+                    (unsigned long long)w.run_slice.percentile(0.5),
+                    (unsigned long long)w.run_slice.percentile(0.99),
+                    (unsigned long long)w.run_slice.percentile(1.0));
+        }
+    }
+}
@@ -0,0 +1,740 @@
+#include "../include/uthread.h"
+#include "runtime.h"
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
+using namespace uthread::detail;
+
+// ---------------------------------------------------------
+// Wait Queues
+// ---------------------------------------------------------
+// Every blocking primitive parks its threads here rather than in the
+// object, so the public types stay a few words with no runtime internals
+// (the same scheme as Go's semaphore table). Waiters are hashed by a key
+// (the address of a word in the object) into a fixed set of buckets; each
+// bucket is a lock plus an intrusive list of waiters, who live on their
+// own stacks while they sleep.
+//
+// A waiter is queued under the bucket lock and then parks without it, so
+// `park` follows the PollDesc protocol: 0 while the thread is still
+// switching out, WAIT_WOKEN if it was woken before it committed, or its
+// TCB* once it is blocked.
+static constexpr uintptr_t WAIT_WOKEN = 1;
+
+struct Waiter {
+    const void* key;
+    std::atomic<uintptr_t> park{0};
+    Waiter* prev = nullptr;
+    Waiter* next = nullptr;
+    uint32_t id = 0;         // Non-zero while a deadline timer may refer to us
+    TimerNode timer;
+    bool ticket = false;     // Semaphores: the waker took the count for us
+    bool timed_out = false;
+};
+
+struct alignas(64) WaitBucket {
+    std::mutex lock;
+    std::atomic<uint32_t> nwait{0}; // Lets wakers skip the lock
+    Waiter* head = nullptr;
+    Waiter* tail = nullptr;
+};
+
+const size_t WAIT_BUCKETS = 251;
+static WaitBucket wait_table[WAIT_BUCKETS];
+static std::atomic<uint32_t> next_waiter_id{1};
+
+static WaitBucket& wait_bucket(const void* key) {
+    return wait_table[(reinterpret_cast<uintptr_t>(key) >> 3) % WAIT_BUCKETS];
+}
+
+// The wait_* list helpers expect the bucket lock to be held.
+static void wait_enqueue(WaitBucket& b, Waiter* w, bool lifo) {
+    w->prev = w->next = nullptr;
+    if (lifo) {
+        w->next = b.head;
+        if (b.head) b.head->prev = w; else b.tail = w;
+        b.head = w;
+    } else {
+        w->prev = b.tail;
+        if (b.tail) b.tail->next = w; else b.head = w;
+        b.tail = w;
+    }
+    // seq_cst pairs with the wakers' unlocked check of nwait.
+    b.nwait.fetch_add(1, std::memory_order_seq_cst);
+}
+
+static void wait_remove(WaitBucket& b, Waiter* w) {
+    if (w->prev) w->prev->next = w->next; else b.head = w->next;
+    if (w->next) w->next->prev = w->prev; else b.tail = w->prev;
+    b.nwait.fetch_sub(1, std::memory_order_relaxed);
+}
+
+static Waiter* wait_dequeue(WaitBucket& b, const void* key) {
+    for (Waiter* w = b.head; w; w = w->next) {
+        if (w->key == key) {
+            wait_remove(b, w);
+            return w;
+        }
+    }
+    return nullptr;
+}
+
+static bool wait_commit(TCB* tcb, void* arg) {
+    auto* w = static_cast<Waiter*>(arg);
+    uintptr_t expected = 0;
+    return w->park.compare_exchange_strong(expected, reinterpret_cast<uintptr_t>(tcb),
+                                           std::memory_order_acq_rel);
+}
+
+// Wakes a waiter already taken off its list. Once this returns the
+// waiter may have run and gone, so set its flags first.
+static bool wait_wake(Waiter* w) {
+    uintptr_t old = w->park.exchange(WAIT_WOKEN, std::memory_order_acq_rel);
+    if (old <= WAIT_WOKEN) return false;
+    make_runnable(reinterpret_cast<TCB*>(old));
+    return true;
+}
+
+// Deadline timer. Only a waiter still on its list is blocked (and so
+// still alive), hence the search by key and id instead of a pointer.
+static bool wait_timeout(uintptr_t key, uint32_t id) {
+    WaitBucket& b = wait_bucket(reinterpret_cast<const void*>(key));
+    std::unique_lock<std::mutex> lock(b.lock);
+    for (Waiter* w = b.head; w; w = w->next) {
+        if (w->key != reinterpret_cast<const void*>(key) || w->id != id) continue;
+        wait_remove(b, w);
+        w->timed_out = true;
+        lock.unlock();
+        return wait_wake(w);
+    }
+    return false;
+}
+
+// Called with w queued and the bucket locked: arms a deadline timer on
+// the calling worker if needed and releases the lock. The caller then
+// does whatever must follow queueing (e.g. unlocking a Mutex) and parks.
+static void wait_arm(WaitBucket& b, Waiter* w, uint64_t deadline_ns) {
+    if (deadline_ns != NO_DEADLINE_NS) {
+        uint32_t id = next_waiter_id.fetch_add(1, std::memory_order_relaxed);
+        if (id == 0) id = next_waiter_id.fetch_add(1, std::memory_order_relaxed);
+        w->id = id;
+        timer_arm(&w->timer, deadline_ns, wait_timeout, reinterpret_cast<uintptr_t>(w->key), id);
+    }
+    b.lock.unlock();
+}
+
+static void wait_park(Waiter* w) {
+    if (w->park.load(std::memory_order_acquire) == 0) block_current(wait_commit, w);
+    if (w->id != 0) timer_cancel(&w->timer);
+}
+
+static void wait_wake_all(const void* key) {
+    WaitBucket& b = wait_bucket(key);
+    if (b.nwait.load(std::memory_order_seq_cst) == 0) return;
+    PreemptGuard guard;
+
+    // Unlink them all under the lock, wake them outside it.
+    Waiter* woken = nullptr;
+    b.lock.lock();
+    while (Waiter* w = wait_dequeue(b, key)) {
+        w->next = woken;
+        woken = w;
+    }
+    b.lock.unlock();
+    while (woken) {
+        Waiter* next = woken->next;
+        wait_wake(woken);
+        woken = next;
+    }
+}
+
+// Futex-style: parks on `key` unless *word has changed from `expected`.
+// The check follows queueing, so a change and wake_all in between is
+// not lost. False if deadline_ns passed first.
+static bool wait_while_equal(const void* key, const std::atomic<int32_t>* word, int32_t expected,
+                             uint64_t deadline_ns) {
+    PreemptGuard guard;
+    Waiter w;
+    w.key = key;
+    WaitBucket& b = wait_bucket(key);
+    b.lock.lock();
+    wait_enqueue(b, &w, false);
+    if (word->load(std::memory_order_seq_cst) != expected) {
+        wait_remove(b, &w);
+        b.lock.unlock();
+        return true;
+    }
+    wait_arm(b, &w, deadline_ns);
+    wait_park(&w);
+    return !w.timed_out;
+}
+
+bool uthread::detail::futex_wait(const std::atomic<int32_t>* word, int32_t expected, uint64_t deadline_ns) {
+    return wait_while_equal(word, word, expected, deadline_ns);
+}
+
+void uthread::detail::futex_wake_all(const std::atomic<int32_t>* word) {
+    wait_wake_all(word);
+}
+
+// Semaphores on top of the wait queues.
+static bool sema_try_acquire(std::atomic<uint32_t>* addr) {
+    uint32_t v = addr->load(std::memory_order_relaxed);
+    while (v > 0) {
+        if (addr->compare_exchange_weak(v, v - 1, std::memory_order_acquire)) return true;
+    }
+    return false;
+}
+
+bool uthread::detail::sema_acquire(std::atomic<uint32_t>* addr, bool lifo, uint64_t deadline_ns) {
+    if (sema_try_acquire(addr)) return true;
+
+    // Bucket locks are OS mutexes: a thread preempted while holding one
+    // would block the next thread on its worker that wants it.
+    PreemptGuard guard;
+
+    WaitBucket& b = wait_bucket(addr);
+    while (true) {
+        if (deadline_ns != NO_DEADLINE_NS && now_ns() >= deadline_ns) return false;
+
+        Waiter w;
+        w.key = addr;
+        b.lock.lock();
+        // Queue (and count) ourselves before the re-check, so a release
+        // that lands in between sees us and takes the lock.
+        wait_enqueue(b, &w, lifo);
+        if (sema_try_acquire(addr)) {
+            wait_remove(b, &w);
+            b.lock.unlock();
+            return true;
+        }
+        wait_arm(b, &w, deadline_ns);
+        wait_park(&w);
+        if (w.ticket || sema_try_acquire(addr)) return true;
+        if (w.timed_out) return false;
+    }
+}
+
+void uthread::detail::sema_release(std::atomic<uint32_t>* addr, bool handoff) {
+    addr->fetch_add(1, std::memory_order_seq_cst);
+
+    WaitBucket& b = wait_bucket(addr);
+    if (b.nwait.load(std::memory_order_seq_cst) == 0) return;
+
+    PreemptGuard guard;
+    b.lock.lock();
+    Waiter* w = wait_dequeue(b, addr);
+    b.lock.unlock();
+    if (!w) return;
+
+    // Handing the count over directly means a thread that keeps
+    // re-acquiring cannot barge ahead of the one we wake.
+    if (handoff && sema_try_acquire(addr)) w->ticket = true;
+    bool direct = w->ticket;
+    wait_wake(w);
+    if (direct && current_tcb()) uthread::yield();
+}
+
+// ---------------------------------------------------------
+// Mutex
+// ---------------------------------------------------------
+// A port of Go's sync.Mutex. state packs the lock bit, a "woken" bit
+// (a spinner or woken waiter is already competing, so unlock need not
+// wake another), a starvation bit and the waiter count. Normally woken
+// waiters compete with newly arriving threads, which usually win; once a
+// waiter has been starved for STARVATION_NS the mutex switches to handing
+// ownership directly to the head of the queue until it drains.
+//
+// Timed lockers stay out of that protocol, whose waiter count cannot give
+// a slot back: they set MUTEX_TIMED, which sends the next unlock down the
+// slow path, and wait on the state word itself to be woken and retry.
+enum : int32_t {
+    MUTEX_LOCKED = 1,
+    MUTEX_WOKEN = 2,
+    MUTEX_STARVING = 4,
+    MUTEX_TIMED = 8,
+    MUTEX_WAITER_SHIFT = 4,
+};
+
+const uint64_t STARVATION_NS = 1000000; // 1 ms
+const int MUTEX_SPIN_ITERS = 4;
+const int MUTEX_SPIN_PAUSES = 30;
+
+// Spinning only pays off if the owner is running on another worker right
+// now and nothing else is waiting for this one.
+static bool mutex_can_spin(int iter) {
+    return iter < MUTEX_SPIN_ITERS && workers.size() > 1 && my_worker->ready_queue.empty();
+}
+
+static void mutex_spin() {
+    for (int i = 0; i < MUTEX_SPIN_PAUSES; ++i) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+}
+
+namespace uthread {
+    Mutex::Mutex() : state_(0), sema_(0) {}
+
+    bool Mutex::try_lock() {
+        int32_t old = state_.load(std::memory_order_relaxed);
+        if (old & (MUTEX_LOCKED | MUTEX_STARVING)) return false;
+        return state_.compare_exchange_strong(old, old | MUTEX_LOCKED, std::memory_order_acquire);
+    }
+
+    void Mutex::lock() {
+        int32_t expected = 0;
+        if (state_.compare_exchange_strong(expected, MUTEX_LOCKED, std::memory_order_acquire)) return;
+        lock_slow();
+    }
+
+    void Mutex::lock_slow() {
+        uint64_t wait_start = 0;
+        bool starving = false;
+        bool awoke = false;
+        int iter = 0;
+        int32_t old = state_.load(std::memory_order_relaxed);
+        while (true) {
+            // Spin while it is held (but not in starvation mode, where
+            // ownership goes to a waiter and spinning is pointless).
+            if ((old & (MUTEX_LOCKED | MUTEX_STARVING)) == MUTEX_LOCKED && mutex_can_spin(iter)) {
+                // Setting WOKEN tells unlock not to wake anybody else.
+                if (!awoke && !(old & MUTEX_WOKEN) && (old >> MUTEX_WAITER_SHIFT) != 0 &&
+                    state_.compare_exchange_strong(old, old | MUTEX_WOKEN)) {
+                    awoke = true;
+                }
+                mutex_spin();
+                ++iter;
+                old = state_.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            int32_t next = old;
+            // Newcomers do not try to take a starving mutex; they queue.
+            if (!(old & MUTEX_STARVING)) next |= MUTEX_LOCKED;
+            if (old & (MUTEX_LOCKED | MUTEX_STARVING)) next += 1 << MUTEX_WAITER_SHIFT;
+            // Only switch to starvation mode while it is still held;
+            // otherwise unlock would expect a waiter that is not there.
+            if (starving && (old & MUTEX_LOCKED)) next |= MUTEX_STARVING;
+            if (awoke) {
+                if (!(next & MUTEX_WOKEN)) {
+                    fprintf(stderr, "uthread: inconsistent mutex state\n");
+                    std::abort();
+                }
+                next &= ~MUTEX_WOKEN;
+            }
+
+            if (!state_.compare_exchange_strong(old, next, std::memory_order_acquire)) continue;
+            if (!(old & (MUTEX_LOCKED | MUTEX_STARVING))) return; // Took it
+
+            // A thread that already waited once goes back to the front.
+            bool lifo = wait_start != 0;
+            if (wait_start == 0) wait_start = now_ns();
+            sema_acquire(&sema_, lifo);
+            starving = starving || now_ns() - wait_start > STARVATION_NS;
+
+            old = state_.load(std::memory_order_relaxed);
+            if (old & MUTEX_STARVING) {
+                // Ownership was handed to us; the lock bit is not set yet
+                // and we are still counted as a waiter.
+                int32_t delta = MUTEX_LOCKED - (1 << MUTEX_WAITER_SHIFT);
+                // Leave starvation mode when we are the last waiter, or
+                // when we did not actually wait long.
+                if (!starving || (old >> MUTEX_WAITER_SHIFT) == 1) delta -= MUTEX_STARVING;
+                state_.fetch_add(delta, std::memory_order_acquire);
+                return;
+            }
+            awoke = true;
+            iter = 0;
+        }
+    }
+
+    bool Mutex::try_lock_until(Deadline deadline) {
+        if (try_lock()) return true;
+
+        uint64_t d = deadline_to_ns(deadline);
+        int32_t old = state_.load(std::memory_order_relaxed);
+        while (true) {
+            if (!(old & (MUTEX_LOCKED | MUTEX_STARVING))) {
+                if (state_.compare_exchange_weak(old, old | MUTEX_LOCKED, std::memory_order_acquire)) return true;
+                continue;
+            }
+            if (d != NO_DEADLINE_NS && now_ns() >= d) return false;
+            if (!(old & MUTEX_TIMED)) {
+                if (!state_.compare_exchange_weak(old, old | MUTEX_TIMED, std::memory_order_relaxed)) continue;
+                old |= MUTEX_TIMED;
+            }
+            wait_while_equal(&state_, &state_, old, d);
+            old = state_.load(std::memory_order_relaxed);
+        }
+    }
+
+    void Mutex::unlock() {
+        int32_t next = state_.fetch_sub(MUTEX_LOCKED, std::memory_order_release) - MUTEX_LOCKED;
+        if (next != 0) unlock_slow(next);
+    }
+
+    void Mutex::unlock_slow(int32_t next) {
+        if (!((next + MUTEX_LOCKED) & MUTEX_LOCKED)) {
+            fprintf(stderr, "uthread: unlock of unlocked mutex\n");
+            std::abort();
+        }
+
+        if (next & MUTEX_STARVING) {
+            // Hand ownership straight to the next waiter and let it run.
+            // Timed lockers could not take it anyway; they stay asleep.
+            sema_release(&sema_, true);
+            return;
+        }
+
+        if (next & MUTEX_TIMED) {
+            next = state_.fetch_and(~MUTEX_TIMED, std::memory_order_relaxed) & ~MUTEX_TIMED;
+            wait_wake_all(&state_);
+        }
+
+        int32_t old = next;
+        while (true) {
+            // Nobody to wake, or someone already took it / is competing.
+            if ((old >> MUTEX_WAITER_SHIFT) == 0 ||
+                (old & (MUTEX_LOCKED | MUTEX_WOKEN | MUTEX_STARVING))) {
+                return;
+            }
+            next = (old - (1 << MUTEX_WAITER_SHIFT)) | MUTEX_WOKEN;
+            if (state_.compare_exchange_strong(old, next)) {
+                sema_release(&sema_, false);
+                return;
+            }
+        }
+    }
+
+    // -----------------------------------------------------
+    // CondVar
+    // -----------------------------------------------------
+    // The waiter queues itself before releasing the mutex, so a notify
+    // issued after the predicate changed (which needs the mutex) always
+    // finds it.
+    void CondVar::wait(Mutex& m) {
+        wait_until(m, Deadline::max());
+    }
+
+    bool CondVar::wait_until(Mutex& m, Deadline deadline) {
+        uint64_t d = deadline_to_ns(deadline);
+        if (d != NO_DEADLINE_NS && now_ns() >= d) return false;
+
+        PreemptGuard guard;
+        Waiter w;
+        w.key = this;
+        WaitBucket& b = wait_bucket(this);
+        b.lock.lock();
+        wait_enqueue(b, &w, false);
+        wait_arm(b, &w, d);
+        m.unlock();
+        wait_park(&w);
+        m.lock();
+        return !w.timed_out;
+    }
+
+    void CondVar::notify_one() {
+        WaitBucket& b = wait_bucket(this);
+        if (b.nwait.load(std::memory_order_seq_cst) == 0) return;
+        PreemptGuard guard;
+        b.lock.lock();
+        Waiter* w = wait_dequeue(b, this);
+        b.lock.unlock();
+        if (w) wait_wake(w);
+    }
+
+    void CondVar::notify_all() {
+        wait_wake_all(this);
+    }
+
+    // -----------------------------------------------------
+    // Semaphore
+    // -----------------------------------------------------
+    Semaphore::Semaphore(uint32_t initial) : count_(initial) {}
+
+    void Semaphore::acquire() {
+        sema_acquire(&count_);
+    }
+
+    bool Semaphore::try_acquire() {
+        return sema_try_acquire(&count_);
+    }
+
+    bool Semaphore::try_acquire_until(Deadline deadline) {
+        return sema_acquire(&count_, false, deadline_to_ns(deadline));
+    }
+
+    void Semaphore::release(uint32_t n) {
+        while (n-- > 0) sema_release(&count_);
+    }
+
+    // -----------------------------------------------------
+    // RWLock
+    // -----------------------------------------------------
+    // A port of Go's sync.RWMutex. reader_count_ is the number of active
+    // readers, pushed negative by RWLOCK_MAX_READERS while a writer is
+    // pending, so new readers queue behind it. reader_wait_ counts the
+    // readers the writer still waits for. Writers serialize on writer_.
+    const int32_t RWLOCK_MAX_READERS = 1 << 30;
+
+    RWLock::RWLock() : writer_sem_(0), reader_sem_(0), reader_count_(0), reader_wait_(0) {}
+
+    void RWLock::lock_shared() {
+        if (reader_count_.fetch_add(1, std::memory_order_acquire) + 1 < 0) {
+            // A writer is pending; wait for it.
+            sema_acquire(&reader_sem_);
+        }
+    }
+
+    void RWLock::unlock_shared() {
+        int32_t r = reader_count_.fetch_sub(1, std::memory_order_release) - 1;
+        if (r >= 0) return;
+        if (r + 1 == 0 || r + 1 == -RWLOCK_MAX_READERS) {
+            fprintf(stderr, "uthread: unlock_shared of unlocked RWLock\n");
+            std::abort();
+        }
+        // A writer is pending; the last departing reader lets it in.
+        if (reader_wait_.fetch_sub(1) - 1 == 0) sema_release(&writer_sem_);
+    }
+
+    void RWLock::lock() {
+        writer_.lock();
+        // Announce the writer, then wait for the readers already inside.
+        int32_t r = reader_count_.fetch_sub(RWLOCK_MAX_READERS, std::memory_order_acquire);
+        if (r != 0 && reader_wait_.fetch_add(r) + r != 0) sema_acquire(&writer_sem_);
+    }
+
+    void RWLock::unlock() {
+        int32_t r = reader_count_.fetch_add(RWLOCK_MAX_READERS, std::memory_order_release) +
+                    RWLOCK_MAX_READERS;
+        if (r >= RWLOCK_MAX_READERS) {
+            fprintf(stderr, "uthread: unlock of unlocked RWLock\n");
+            std::abort();
+        }
+        // Let in the readers that queued behind us, then other writers.
+        for (int32_t i = 0; i < r; ++i) sema_release(&reader_sem_);
+        writer_.unlock();
+    }
+
+    // -----------------------------------------------------
+    // WaitGroup
+    // -----------------------------------------------------
+    // A port of Go's sync.WaitGroup: the counter lives in the high half of
+    // state_ and the number of waiters in the low half, so add() can tell
+    // whether anybody needs waking in the same atomic.
+    WaitGroup::WaitGroup() : state_(0), sema_(0) {}
+
+    void WaitGroup::add(int delta) {
+        uint64_t state = state_.fetch_add(static_cast<uint64_t>(static_cast<int64_t>(delta)) << 32,
+                                          std::memory_order_acq_rel) +
+                         (static_cast<uint64_t>(static_cast<int64_t>(delta)) << 32);
+        int32_t v = static_cast<int32_t>(state >> 32);
+        uint32_t waiters = static_cast<uint32_t>(state);
+        if (v < 0) {
+            fprintf(stderr, "uthread: negative WaitGroup counter\n");
+            std::abort();
+        }
+        if (v > 0 || waiters == 0) return;
+
+        // Counter hit zero with waiters: nobody may touch the group until
+        // they are all released, so resetting state_ is safe.
+        state_.store(0, std::memory_order_relaxed);
+        for (; waiters > 0; --waiters) sema_release(&sema_);
+    }
+
+    void WaitGroup::done() {
+        add(-1);
+    }
+
+    void WaitGroup::wait() {
+        uint64_t state = state_.load(std::memory_order_acquire);
+        while (true) {
+            if ((state >> 32) == 0) return;
+            if (state_.compare_exchange_weak(state, state + 1, std::memory_order_acq_rel)) {
+                sema_acquire(&sema_);
+                return;
+            }
+        }
+    }
+
+    // -----------------------------------------------------
+    // Barrier
+    // -----------------------------------------------------
+    Barrier::Barrier(int count) : count_(count), arrived_(0), generation_(0) {}
+
+    bool Barrier::arrive_and_wait() {
+        lock_.lock();
+        uint64_t gen = generation_;
+        if (++arrived_ == count_) {
+            // Last one in opens the barrier and resets it for reuse.
+            arrived_ = 0;
+            ++generation_;
+            cond_.notify_all();
+            lock_.unlock();
+            return true;
+        }
+        while (gen == generation_) cond_.wait(lock_);
+        lock_.unlock();
+        return false;
+    }
+
+    // -----------------------------------------------------
+    // Futures
+    // -----------------------------------------------------
+    // Waiters park on the core's address with the futex-style wait, so a
+    // completion with nobody waiting costs one look at a bucket counter.
+    // Continuations form a lock-free stack that complete() swaps for
+    // CONTINUATIONS_DONE; a continuation pushed after that is refused and
+    // its owner runs it instead.
+    const uintptr_t CONTINUATIONS_DONE = 1;
+
+    void detail::future_misuse(const char* what) {
+        fprintf(stderr, "uthread: %s\n", what);
+        std::abort();
+    }
+
+    void detail::FutureCore::wait() {
+        while (!ready()) wait_while_equal(this, &ready_, 0, NO_DEADLINE_NS);
+    }
+
+    bool detail::FutureCore::wait_until(Deadline deadline) {
+        uint64_t d = deadline_to_ns(deadline);
+        while (!ready()) {
+            if (!wait_while_equal(this, &ready_, 0, d)) return ready();
+        }
+        return true;
+    }
+
+    void detail::FutureCore::complete() {
+        if (ready_.exchange(1, std::memory_order_seq_cst)) future_misuse("future completed twice");
+        wait_wake_all(this);
+
+        // Pushed newest first; run them in the order they were added.
+        uintptr_t list = continuations_.exchange(CONTINUATIONS_DONE, std::memory_order_acq_rel);
+        Continuation* c = nullptr;
+        for (auto* n = reinterpret_cast<Continuation*>(list); n;) {
+            Continuation* next = n->next;
+            n->next = c;
+            c = n;
+            n = next;
+        }
+        while (c) {
+            Continuation* next = c->next;
+            c->run(c);
+            c = next;
+        }
+    }
+
+    bool detail::FutureCore::add_continuation(Continuation* c) {
+        uintptr_t head = continuations_.load(std::memory_order_acquire);
+        do {
+            if (head == CONTINUATIONS_DONE) return false;
+            c->next = reinterpret_cast<Continuation*>(head);
+        } while (!continuations_.compare_exchange_weak(head, reinterpret_cast<uintptr_t>(c),
+                                                       std::memory_order_release, std::memory_order_acquire));
+        return true;
+    }
+
+    // Both keep their per-input data after the object, in the same
+    // allocation.
+    template <typename T, typename Item>
+    static T* new_with_items(size_t n) {
+        static_assert(sizeof(T) % alignof(Item) == 0, "items would be misaligned");
+        void* mem = ::operator new(sizeof(T) + n * sizeof(Item));
+        return new (mem) T(n);
+    }
+
+    // Waits for its inputs one at a time with a single continuation: each
+    // time the input it is queued on completes, it skips those already
+    // done and queues on the next one.
+    struct WhenAll final : detail::FutureState<void>, detail::Continuation {
+        size_t n;
+        size_t next = 0;
+
+        explicit WhenAll(size_t count) : FutureState<void>(&destroy), n(count) { run = &advance; }
+        detail::FutureCore** inputs() { return reinterpret_cast<detail::FutureCore**>(this + 1); }
+
+        static void destroy(detail::FutureCore* c) {
+            auto* s = static_cast<WhenAll*>(c);
+            s->~WhenAll();
+            ::operator delete(s);
+        }
+
+        static void advance(detail::Continuation* c) {
+            auto* s = static_cast<WhenAll*>(c);
+            for (; s->next < s->n; ++s->next) {
+                if (s->inputs()[s->next]->add_continuation(s)) return;
+            }
+            for (size_t i = 0; i < s->n; ++i) s->inputs()[i]->release();
+            s->complete();
+            s->release();
+        }
+    };
+
+    detail::FutureState<void>* detail::when_all(FutureCore* const* futures, size_t n) {
+        WhenAll* s = new_with_items<WhenAll, FutureCore*>(n);
+        for (size_t i = 0; i < n; ++i) {
+            futures[i]->add_ref();
+            s->inputs()[i] = futures[i];
+        }
+        s->add_ref(); // For the continuation
+        WhenAll::advance(s);
+        return s;
+    }
+
+    // One continuation per input; the first to run sets the index. Each
+    // holds a reference on the state and on its input until the input
+    // completes.
+    struct WhenAny final : detail::FutureState<size_t> {
+        struct Node : detail::Continuation {
+            WhenAny* owner;
+            detail::FutureCore* input;
+            size_t index;
+        };
+        std::atomic<bool> decided{false};
+        size_t n;
+
+        explicit WhenAny(size_t count) : FutureState<size_t>(&destroy), n(count) {}
+        Node* nodes() { return reinterpret_cast<Node*>(this + 1); }
+
+        static void destroy(detail::FutureCore* c) {
+            auto* s = static_cast<WhenAny*>(c);
+            s->~WhenAny();
+            ::operator delete(s);
+        }
+
+        static void fire(detail::Continuation* c) {
+            auto* node = static_cast<Node*>(c);
+            WhenAny* s = node->owner;
+            if (!s->decided.exchange(true, std::memory_order_acq_rel)) {
+                s->emplace(node->index);
+                s->complete();
+            }
+            node->input->release();
+            s->release();
+        }
+    };
+
+    detail::FutureState<size_t>* detail::when_any(FutureCore* const* futures, size_t n) {
+        if (n == 0) future_misuse("when_any needs at least one future");
+        WhenAny* s = new_with_items<WhenAny, WhenAny::Node>(n);
+        for (size_t i = 0; i < n; ++i) {
+            WhenAny::Node* node = new (&s->nodes()[i]) WhenAny::Node();
+            node->run = &WhenAny::fire;
+            node->owner = s;
+            node->input = futures[i];
+            node->index = i;
+            futures[i]->add_ref();
+            s->add_ref();
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (!futures[i]->add_continuation(&s->nodes()[i])) WhenAny::fire(&s->nodes()[i]);
+        }
+        return s;
+    }
+}
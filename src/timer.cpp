@@ -0,0 +1,230 @@
+#include "../include/uthread.h"
+#include "runtime.h"
+#include <algorithm>
+#include <ctime>
+
+using namespace uthread::detail;
+
+// ---------------------------------------------------------
+// Timer Wheel
+// ---------------------------------------------------------
+// Each worker keeps a hierarchical timing wheel: WHEEL_LEVELS levels of
+// WHEEL_SLOTS slots, each slot an intrusive list. A level-0 slot spans
+// one tick, a level-1 slot 64 ticks, and so on. A timer goes in the
+// lowest level at which its expiry and the wheel's current position
+// still differ, so arming and cancelling are O(1). When the wheel
+// reaches a slot above level 0, its timers cascade down to finer slots.
+// A bit per occupied slot lets the wheel jump straight to the next
+// non-empty slot instead of stepping tick by tick.
+//
+// The scheduler fires expired timers every loop. A parked worker sleeps
+// in epoll_wait no longer than its next expiry. Timers never fire early:
+// expiries round up to the next tick.
+
+const uint64_t WHEEL_MAX_TICKS = (uint64_t(1) << (6 * WHEEL_LEVELS)) - 1;
+
+struct Expiration {
+    int level;
+    int slot;
+    uint64_t deadline; // Tick at which the slot is due
+};
+
+// What a fired timer needs once its node is off the wheel.
+struct TimerCall {
+    TimerFn fn;
+    uintptr_t arg;
+    uint32_t seq;
+};
+
+TimerWheel::TimerWheel() : elapsed(now_ns() / WHEEL_TICK_NS) {}
+
+uint64_t uthread::detail::now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t uthread::detail::deadline_to_ns(std::chrono::steady_clock::time_point deadline) {
+    if (deadline == std::chrono::steady_clock::time_point::max()) return NO_DEADLINE_NS;
+    // steady_clock is CLOCK_MONOTONIC, the clock timers and io_uring use.
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+    return ns > 0 ? static_cast<uint64_t>(ns) : 0;
+}
+
+// The level is picked by the highest 6-bit group in which `when` and
+// `elapsed` differ; beyond the wheel's range, the top level.
+static int wheel_level(uint64_t elapsed, uint64_t when) {
+    uint64_t masked = (elapsed ^ when) | (WHEEL_SLOTS - 1);
+    if (masked >= WHEEL_MAX_TICKS) masked = WHEEL_MAX_TICKS - 1;
+    int significant = 63 - __builtin_clzll(masked);
+    return significant / 6;
+}
+
+static void wheel_insert(TimerWheel& wheel, TimerNode* t) {
+    int level = wheel_level(wheel.elapsed, t->when_tick);
+    int slot = static_cast<int>((t->when_tick >> (6 * level)) % WHEEL_SLOTS);
+    TimerNode*& head = wheel.slots[level][slot];
+    t->slot = level * WHEEL_SLOTS + slot;
+    t->prev = nullptr;
+    t->next = head;
+    if (head) head->prev = t;
+    head = t;
+    wheel.occupied[level] |= uint64_t(1) << slot;
+}
+
+static void wheel_unlink(TimerWheel& wheel, TimerNode* t) {
+    int level = t->slot / WHEEL_SLOTS;
+    int slot = t->slot % WHEEL_SLOTS;
+    if (t->prev) t->prev->next = t->next; else wheel.slots[level][slot] = t->next;
+    if (t->next) t->next->prev = t->prev;
+    if (!wheel.slots[level][slot]) wheel.occupied[level] &= ~(uint64_t(1) << slot);
+}
+
+// The earliest non-empty slot. Lower levels always expire before higher
+// ones, so the first level with anything in it has the answer.
+static bool wheel_next(const TimerWheel& wheel, Expiration& exp) {
+    for (int level = 0; level < WHEEL_LEVELS; ++level) {
+        uint64_t occupied = wheel.occupied[level];
+        if (!occupied) continue;
+
+        int shift = 6 * level;
+        uint64_t slot_range = uint64_t(1) << shift;
+        uint64_t level_range = slot_range * WHEEL_SLOTS;
+        int now_slot = static_cast<int>((wheel.elapsed >> shift) % WHEEL_SLOTS);
+        // First occupied slot at or after the current one, wrapping.
+        uint64_t rotated = now_slot ? (occupied >> now_slot) | (occupied << (WHEEL_SLOTS - now_slot)) : occupied;
+        int slot = (__builtin_ctzll(rotated) + now_slot) % WHEEL_SLOTS;
+
+        uint64_t deadline = (wheel.elapsed & ~(level_range - 1)) + slot * slot_range;
+        if (deadline <= wheel.elapsed && level > 0) deadline += level_range;
+        exp = Expiration{level, slot, std::max(deadline, wheel.elapsed)};
+        return true;
+    }
+    return false;
+}
+
+// Advances the wheel to `now` (ticks): timers due by then move to
+// `fired`, those in a coarser slot that is now current cascade down.
+static void wheel_advance(TimerWheel& wheel, uint64_t now, std::vector<TimerCall>& fired) {
+    Expiration exp;
+    while (wheel_next(wheel, exp) && exp.deadline <= now) {
+        TimerNode* t = wheel.slots[exp.level][exp.slot];
+        wheel.slots[exp.level][exp.slot] = nullptr;
+        wheel.occupied[exp.level] &= ~(uint64_t(1) << exp.slot);
+        wheel.elapsed = exp.deadline;
+
+        while (t) {
+            TimerNode* next = t->next;
+            if (t->when_tick <= wheel.elapsed) {
+                fired.push_back(TimerCall{t->fn, t->arg, t->seq});
+                t->owner.store(nullptr, std::memory_order_release);
+                wheel.count.fetch_sub(1, std::memory_order_relaxed);
+            } else {
+                wheel_insert(wheel, t);
+            }
+            t = next;
+        }
+    }
+    if (now > wheel.elapsed) wheel.elapsed = now;
+    wheel.next_ns = wheel_next(wheel, exp) ? exp.deadline * WHEEL_TICK_NS : UINT64_MAX;
+}
+
+void uthread::detail::timer_arm(TimerNode* t, uint64_t when_ns, TimerFn fn, uintptr_t arg, uint32_t seq) {
+    PreemptGuard guard;
+    Worker* w = my_worker;
+    TimerWheel& wheel = w->timers;
+    t->fn = fn;
+    t->arg = arg;
+    t->seq = seq;
+
+    std::lock_guard<std::mutex> lock(wheel.lock);
+    // Round up, so it never fires early, and at least a tick ahead: the
+    // slot for the current tick has already been processed.
+    uint64_t when = when_ns / WHEEL_TICK_NS + (when_ns % WHEEL_TICK_NS != 0);
+    t->when_tick = std::max(when, wheel.elapsed + 1);
+    wheel_insert(wheel, t);
+    t->owner.store(w, std::memory_order_relaxed);
+    wheel.count.fetch_add(1, std::memory_order_relaxed);
+    wheel.next_ns = std::min(wheel.next_ns, t->when_tick * WHEEL_TICK_NS);
+}
+
+bool uthread::detail::timer_cancel(TimerNode* t) {
+    Worker* w = t->owner.load(std::memory_order_acquire);
+    if (!w) return false;
+    PreemptGuard guard;
+    TimerWheel& wheel = w->timers;
+    std::lock_guard<std::mutex> lock(wheel.lock);
+    // Fired while we took the lock.
+    if (t->owner.load(std::memory_order_relaxed) != w) return false;
+    wheel_unlink(wheel, t);
+    t->owner.store(nullptr, std::memory_order_relaxed);
+    wheel.count.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+int uthread::detail::timers_run(Worker* w) {
+    TimerWheel& wheel = w->timers;
+    if (wheel.count.load(std::memory_order_relaxed) == 0) return 0;
+    uint64_t now = now_ns();
+    if (now < wheel.next_ns) return 0;
+
+    // Reused across calls; callbacks run outside the lock since they may
+    // arm or cancel timers themselves.
+    static thread_local std::vector<TimerCall> fired;
+    {
+        std::lock_guard<std::mutex> lock(wheel.lock);
+        wheel_advance(wheel, now / WHEEL_TICK_NS, fired);
+    }
+    int readied = 0;
+    for (const TimerCall& c : fired) {
+        if (c.fn(c.arg, c.seq)) ++readied;
+    }
+    fired.clear();
+    return readied;
+}
+
+int uthread::detail::timers_timeout_ms(Worker* w) {
+    TimerWheel& wheel = w->timers;
+    if (wheel.count.load(std::memory_order_relaxed) == 0) return -1;
+    uint64_t now = now_ns();
+    uint64_t when = wheel.next_ns;
+    if (when <= now) return 0;
+    // Round up, so we never wake just before the deadline.
+    return static_cast<int>(std::min<uint64_t>((when - now + 999999) / 1000000, 1 << 30));
+}
+
+// ---------------------------------------------------------
+// Sleeping
+// ---------------------------------------------------------
+// The timer is armed from the commit, on the scheduler stack, so it
+// cannot fire before the thread is off its stack and it needs no cancel.
+// Without a deadline the commit arms nothing and the thread sleeps for
+// good.
+
+struct Sleep {
+    TimerNode node;
+    uint64_t when_ns;
+};
+
+static bool sleep_wake(uintptr_t arg, uint32_t) {
+    make_runnable(reinterpret_cast<TCB*>(arg));
+    return true;
+}
+
+static bool sleep_commit(TCB* tcb, void* arg) {
+    auto* s = static_cast<Sleep*>(arg);
+    if (s->when_ns == NO_DEADLINE_NS) return true;
+    timer_arm(&s->node, s->when_ns, sleep_wake, reinterpret_cast<uintptr_t>(tcb), 0);
+    return true;
+}
+
+namespace uthread {
+    void sleep_until(Deadline deadline) {
+        uint64_t when = deadline_to_ns(deadline);
+        if (now_ns() >= when) return;
+
+        Sleep s;
+        s.when_ns = when;
+        block_current(sleep_commit, &s);
+    }
+}
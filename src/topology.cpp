@@ -0,0 +1,147 @@
+#include "runtime.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <sched.h>
+#include <dirent.h>
+
+using namespace uthread::detail;
+
+// ---------------------------------------------------------
+// CPU Topology
+// ---------------------------------------------------------
+// Read once from sysfs: for every CPU the process may run on, its
+// physical core (SMT siblings share one), last-level cache and NUMA
+// node. Anything sysfs does not say defaults to "one of each", which is
+// also what a container without /sys gets. Ids are the lowest CPU
+// sharing the resource, so they are only good for equality.
+
+static cpu_set_t process_mask; // Affinity at startup, for unpin_thread()
+static std::vector<CpuPlace> placement;
+static int nr_nodes = 1;
+
+// "0-3,8,10-11"; empty if the file is missing.
+static std::vector<int> read_cpu_list(const std::string& path) {
+    std::vector<int> cpus;
+    std::ifstream f(path);
+    std::string list;
+    if (!(f >> list)) return cpus;
+
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) end = list.size();
+        std::string range = list.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        int lo = std::atoi(range.c_str());
+        int hi = dash == std::string::npos ? lo : std::atoi(range.c_str() + dash + 1);
+        for (int c = lo; c <= hi; ++c) cpus.push_back(c);
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+static int read_int(const std::string& path, int fallback) {
+    std::ifstream f(path);
+    int v;
+    return f >> v ? v : fallback;
+}
+
+// Lowest CPU sharing the highest-level cache, L3 on most machines.
+static int last_level_cache(int cpu) {
+    std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cache/index";
+    int best_level = 0, id = -1;
+    for (int i = 0; i < 8; ++i) {
+        int level = read_int(base + std::to_string(i) + "/level", -1);
+        if (level < 0) break;
+        if (level < best_level) continue;
+        std::vector<int> shared = read_cpu_list(base + std::to_string(i) + "/shared_cpu_list");
+        if (shared.empty()) continue;
+        best_level = level;
+        id = shared.front();
+    }
+    return id;
+}
+
+static void load_nodes(std::vector<CpuPlace>& cpus) {
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (!dir) return;
+    int seen = 0;
+    while (dirent* e = readdir(dir)) {
+        int node;
+        if (std::sscanf(e->d_name, "node%d", &node) != 1) continue;
+        std::vector<int> members = read_cpu_list("/sys/devices/system/node/" + std::string(e->d_name) + "/cpulist");
+        if (members.empty()) continue; // Memory-only node
+        ++seen;
+        for (CpuPlace& p : cpus) {
+            if (std::find(members.begin(), members.end(), p.cpu) != members.end()) p.node = node;
+        }
+    }
+    closedir(dir);
+    nr_nodes = std::max(seen, 1);
+}
+
+void uthread::detail::topology_init() {
+    placement.clear();
+    if (sched_getaffinity(0, sizeof(process_mask), &process_mask) != 0) {
+        CPU_ZERO(&process_mask);
+        for (int c = 0; c < static_cast<int>(std::thread::hardware_concurrency()); ++c) CPU_SET(c, &process_mask);
+    }
+
+    std::vector<int> smt_rank; // Position among its SMT siblings
+    for (int c = 0; c < CPU_SETSIZE; ++c) {
+        if (!CPU_ISSET(c, &process_mask)) continue;
+        std::string topo = "/sys/devices/system/cpu/cpu" + std::to_string(c) + "/topology/";
+        std::vector<int> siblings = read_cpu_list(topo + "thread_siblings_list");
+        CpuPlace p;
+        p.cpu = c;
+        p.core = siblings.empty() ? c : siblings.front();
+        p.l3 = last_level_cache(c);
+        if (p.l3 < 0) p.l3 = read_int(topo + "physical_package_id", 0);
+        placement.push_back(p);
+        smt_rank.push_back(static_cast<int>(std::find(siblings.begin(), siblings.end(), c) - siblings.begin()));
+    }
+    load_nodes(placement);
+
+    // Workers take CPUs in this order: one per physical core first, then
+    // SMT siblings, each round filling a node (and within it an L3) before
+    // moving to the next, so a small runtime stays on one socket.
+    std::vector<size_t> order(placement.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        const CpuPlace& x = placement[a];
+        const CpuPlace& y = placement[b];
+        if (smt_rank[a] != smt_rank[b]) return smt_rank[a] < smt_rank[b];
+        if (x.node != y.node) return x.node < y.node;
+        if (x.l3 != y.l3) return x.l3 < y.l3;
+        return x.cpu < y.cpu;
+    });
+    std::vector<CpuPlace> sorted;
+    for (size_t i : order) sorted.push_back(placement[i]);
+    placement.swap(sorted);
+}
+
+const std::vector<CpuPlace>& uthread::detail::topology_cpus() {
+    return placement;
+}
+
+int uthread::detail::topology_nodes() {
+    return nr_nodes;
+}
+
+void uthread::detail::pin_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        std::fprintf(stderr, "uthread: could not pin a worker to CPU %d: %s\n", cpu, std::strerror(errno));
+    }
+}
+
+void uthread::detail::unpin_thread() {
+    sched_setaffinity(0, sizeof(process_mask), &process_mask);
+}
@@ -0,0 +1,199 @@
+#include "../include/uthread.h"
+#include "runtime.h"
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <linux/io_uring.h>
+
+using namespace uthread::detail;
+
+// ---------------------------------------------------------
+// Fiber Tracing
+// ---------------------------------------------------------
+// With -DUTHREAD_TRACE, the scheduler, the netpoller and io_uring call
+// trace() at every switch, block, wake, steal and create (see TraceType).
+// Each event is a timestamp and two words in the worker's own ring, so
+// recording needs no atomics beyond the owner's head store; once a ring
+// wraps the oldest events are lost. trace_write() merges the rings by
+// timestamp into Chrome's JSON trace format, which chrome://tracing and
+// ui.perfetto.dev both load:
+//   * one track per worker, with a slice per run of a thread, ending in
+//     yield, preempt, block or finish;
+//   * a flow arrow through each thread's slices, so a thread that moved
+//     between workers can be followed;
+//   * create, wake and steal as instant events on the worker that did
+//     them, and an async span per blocked period naming what it waited
+//     on.
+
+std::atomic<bool> uthread::detail::trace_on{false};
+
+struct Event {
+    uint64_t ticks;
+    uint32_t tid;
+    TraceType type;
+    uint32_t arg;
+    int worker;
+};
+
+// Per thread, while merging.
+struct FiberTrace {
+    bool ran = false;            // A slice was written already
+    std::string waiting;         // From the last TRACE_WAIT_*
+    bool blocked = false;
+    std::string blocked_on;
+};
+
+static const char* uring_op_name(uint32_t op) {
+    switch (op) {
+        case IORING_OP_READ: return "read";
+        case IORING_OP_WRITE: return "write";
+        case IORING_OP_READV: return "readv";
+        case IORING_OP_WRITEV: return "writev";
+        case IORING_OP_READ_FIXED: return "read_fixed";
+        case IORING_OP_WRITE_FIXED: return "write_fixed";
+        case IORING_OP_RECV: return "recv";
+        case IORING_OP_SEND: return "send";
+        case IORING_OP_ACCEPT: return "accept";
+        case IORING_OP_CONNECT: return "connect";
+        case IORING_OP_OPENAT: return "openat";
+        case IORING_OP_FSYNC: return "fsync";
+        default: return "op";
+    }
+}
+
+// Everything the rings still hold, oldest first.
+static std::vector<Event> collect() {
+    std::vector<Event> events;
+    for (auto& w : workers) {
+        TraceRing* r = w->trace_ring;
+        if (!r) continue;
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (uint64_t i = first; i < head; ++i) {
+            const TraceRecord& e = r->events[i & (TRACE_RING_SIZE - 1)];
+            events.push_back({e.ticks, e.tid, TraceType(e.type_arg & 0xff), e.type_arg >> 8, w->id});
+        }
+    }
+    std::stable_sort(events.begin(), events.end(),
+                     [](const Event& a, const Event& b) { return a.ticks < b.ticks; });
+    return events;
+}
+
+namespace uthread {
+    bool trace_start() {
+#ifdef UTHREAD_TRACE
+        for (auto& w : workers) {
+            if (!w->trace_ring) w->trace_ring = new TraceRing();
+        }
+        trace_on.store(true, std::memory_order_release);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void trace_stop() {
+        trace_on.store(false, std::memory_order_release);
+    }
+
+    bool trace_write(const char* path) {
+        FILE* f = std::fopen(path, "w");
+        if (!f) return false;
+
+        std::vector<Event> events = collect();
+        uint64_t origin = events.empty() ? 0 : events.front().ticks;
+        double scale = ns_per_tick() / 1000.0; // Chrome wants microseconds
+        auto us = [&](uint64_t ticks) { return double(ticks - origin) * scale; };
+
+        std::fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        std::fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"uthread\"}}");
+        for (auto& w : workers) {
+            std::fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                            "\"args\":{\"name\":\"worker %d\"}}",
+                         w->id, w->id);
+        }
+
+        struct Slice {
+            bool open = false;
+            uint32_t tid = 0;
+            uint64_t start = 0;
+        };
+        std::vector<Slice> running(workers.size());
+        std::unordered_map<uint32_t, FiberTrace> fibers;
+
+        auto instant = [&](const Event& e, const std::string& name) {
+            std::fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"sched\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,"
+                            "\"ts\":%.3f}",
+                         name.c_str(), e.worker, us(e.ticks));
+        };
+
+        for (const Event& e : events) {
+            FiberTrace& fiber = fibers[e.tid];
+            std::string id = std::to_string(e.tid);
+            switch (e.type) {
+                case TRACE_CREATE:
+                    instant(e, "create " + id);
+                    break;
+                case TRACE_STEAL:
+                    instant(e, "steal " + id + " from worker " + std::to_string(e.arg));
+                    break;
+                case TRACE_RUN:
+                    running[e.worker] = {true, e.tid, e.ticks};
+                    break;
+                case TRACE_WAIT_FD:
+                    fiber.waiting = "fd " + std::to_string(e.arg >> 1) + ((e.arg & 1) ? " write" : " read");
+                    break;
+                case TRACE_WAIT_IO:
+                    fiber.waiting = std::string("io_uring ") + uring_op_name(e.arg);
+                    break;
+                case TRACE_WAKE:
+                    if (fiber.blocked) {
+                        std::fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"blocked\",\"ph\":\"e\",\"id\":%u,\"pid\":1,"
+                                        "\"tid\":%d,\"ts\":%.3f}",
+                                     fiber.blocked_on.c_str(), e.tid, e.worker, us(e.ticks));
+                        fiber.blocked = false;
+                    }
+                    instant(e, "wake " + id);
+                    break;
+                case TRACE_YIELD:
+                case TRACE_PREEMPT:
+                case TRACE_BLOCK:
+                case TRACE_FINISH: {
+                    Slice& s = running[e.worker];
+                    if (!s.open || s.tid != e.tid) break; // Its start was overwritten
+                    s.open = false;
+                    static const char* const reasons[] = {"", "", "yield", "preempt", "block", "finish"};
+                    std::fprintf(f, ",\n{\"name\":\"thread %u\",\"cat\":\"run\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"end\":\"%s\"}}",
+                                 e.tid, e.worker, us(s.start), us(e.ticks) - us(s.start), reasons[e.type]);
+
+                    // Flow arrow from this thread's previous slice, bound to
+                    // the enclosing slice of each step.
+                    bool last = e.type == TRACE_FINISH;
+                    if (fiber.ran || !last) {
+                        const char* ph = !fiber.ran ? "s" : (last ? "f" : "t");
+                        std::fprintf(f, ",\n{\"name\":\"thread %u\",\"cat\":\"flow\",\"ph\":\"%s\",\"id\":%u,"
+                                        "\"pid\":1,\"tid\":%d,\"ts\":%.3f%s}",
+                                     e.tid, ph, e.tid, e.worker, us(s.start), last ? ",\"bp\":\"e\"" : "");
+                    }
+                    fiber.ran = true;
+
+                    if (e.type == TRACE_BLOCK) {
+                        fiber.blocked = true;
+                        fiber.blocked_on = fiber.waiting.empty() ? "blocked" : "blocked on " + fiber.waiting;
+                        std::fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"blocked\",\"ph\":\"b\",\"id\":%u,\"pid\":1,"
+                                        "\"tid\":%d,\"ts\":%.3f}",
+                                     fiber.blocked_on.c_str(), e.tid, e.worker, us(e.ticks));
+                    }
+                    fiber.waiting.clear();
+                    if (last) fibers.erase(e.tid);
+                    break;
+                }
+            }
+        }
+        std::fprintf(f, "\n]}\n");
+        return std::fclose(f) == 0;
+    }
+}
@@ -1,152 +1,835 @@
 #include "../include/uthread.h"
-#include <ucontext.h>
+#include "runtime.h"
 #include <vector>
-#include <deque>
 #include <iostream>
 #include <memory>
 #include <thread>
 #include <mutex>
 #include <atomic>
-#include <unordered_map>
 #include <cassert>
 #include <algorithm>
-#include <random>
+#include <numeric>
 #include <cstring>
+#include <new>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/epoll.h>
 
-// Configuration
-const int STACK_SIZE = 64 * 1024;
-const int MAX_EVENTS = 64; // Max IO events to process per tick
+using namespace uthread::detail;
 
-enum class ThreadState { READY, RUNNING, BLOCKED, FINISHED };
+// Global State
+std::vector<std::unique_ptr<Worker>> uthread::detail::workers;
+std::atomic<bool> uthread::detail::system_running{true};
+thread_local Worker* uthread::detail::my_worker = nullptr;
+static std::atomic<int> next_tid{0};
 
-struct TCB {
-    int id;
-    ucontext_t context;
-    std::vector<char> stack;
-    ThreadState state;
-    void (*func)();
-    
-    TCB(int tid, void (*f)()) : id(tid), state(ThreadState::READY), func(f) {
-        stack.resize(STACK_SIZE);
+// Global injection queue: overflow from full local queues, and threads
+// made runnable by OS threads outside the runtime (create() and spawn()
+// callers, the blocking pool). Any worker may drain it; `inject_size`
+// lets the fast path skip the lock.
+static std::mutex inject_lock;
+static TcbList inject_queue[PRIORITY_LEVELS];
+static std::atomic<size_t> inject_size{0};
+
+// ---------------------------------------------------------
+// Idle Workers
+// ---------------------------------------------------------
+// A worker that runs dry first *searches* (spins over the injection queue
+// and the other workers' deques) for SPIN_ROUNDS, then parks inside
+// epoll_wait on its own netpoll instance, so it wakes for I/O readiness
+// on the fds it owns as well as for new work. Whoever makes work runnable calls wake_one(), which unparks
+// a single worker and only when nobody is searching already: a searcher
+// will find the new work by itself. The woken worker inherits the
+// searching slot, and a searcher that finds work and was the last one
+// wakes a replacement, so a burst of creates fans out one worker at a
+// time instead of waking everybody.
+static std::atomic<int> nr_searching{0};
+static std::atomic<int> nr_idle{0};
+static std::mutex idle_lock;
+static std::vector<Worker*> idle_workers;
+
+// `w` has already been taken off idle_workers.
+static void unpark(Worker* w) {
+    w->park_word.store(0, std::memory_order_release);
+    netpoll_wake(w);
+}
+
+// Returns true if `w` was still listed (and is now removed).
+static bool unlist_idle(Worker* w) {
+    std::lock_guard<std::mutex> lock(idle_lock);
+    auto it = std::find(idle_workers.begin(), idle_workers.end(), w);
+    if (it == idle_workers.end()) return false;
+    idle_workers.erase(it);
+    nr_idle.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+void uthread::detail::wake_one() {
+    // Pairs with the fence in park_worker: either we see the idle worker,
+    // or it sees the work we just published.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (nr_idle.load(std::memory_order_relaxed) == 0) return;
+
+    int expected = 0;
+    if (!nr_searching.compare_exchange_strong(expected, 1)) return;
+
+    Worker* w = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(idle_lock);
+        if (!idle_workers.empty()) {
+            w = idle_workers.back();
+            idle_workers.pop_back();
+            nr_idle.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    if (!w) {
+        nr_searching.fetch_sub(1);
+        return;
+    }
+    w->searching = true; // Hand over the searching slot we claimed
+    unpark(w);
+}
+
+static void wake_all() {
+    std::vector<Worker*> woken;
+    {
+        std::lock_guard<std::mutex> lock(idle_lock);
+        woken.swap(idle_workers);
+        nr_idle.store(0);
     }
-};
+    for (Worker* w : woken) unpark(w);
+}
 
-struct Worker {
-    int id;
-    std::thread thread_obj; 
-    std::deque<std::shared_ptr<TCB>> ready_queue;
-    std::mutex queue_lock;
-    std::shared_ptr<TCB> current_thread;
-    ucontext_t sched_context; 
+static bool work_available() {
+    if (inject_size.load(std::memory_order_relaxed) > 0) return true;
+    for (auto& w : workers) {
+        if (!w->ready_queue.empty() || !w->forks.empty()) return true;
+        if (w->inbox.size.load(std::memory_order_relaxed) > 0) return true;
+        if (w->runnext.load(std::memory_order_relaxed)) return true;
+    }
+    return false;
+}
 
-    Worker(int worker_id) : id(worker_id) {}
-};
+// ---------------------------------------------------------
+// Ready Queues
+// ---------------------------------------------------------
 
-// Global State
-static std::vector<std::unique_ptr<Worker>> workers;
-static std::atomic<int> next_tid{0};
-static std::atomic<bool> system_running{true};
-static thread_local Worker* my_worker = nullptr;
+// Owner-side enqueue. When the local ring is full, move half of it plus
+// the new task to the injection queue in one locked batch (as Go's runq
+// does) so the next few pushes are lock-free again.
+static void push_ready(TCB* tcb) {
+    auto& queue = my_worker->ready_queue.level[tcb->priority];
+    if (queue.push(tcb)) return;
+
+    TCB* batch[LOCAL_QUEUE_SIZE / 2 + 1];
+    size_t n = 0;
+    while (n < LOCAL_QUEUE_SIZE / 2) {
+        TCB* t = queue.take();
+        if (!t) break;
+        batch[n++] = t;
+    }
+    batch[n++] = tcb;
+
+    std::lock_guard<std::mutex> lock(inject_lock);
+    for (size_t i = 0; i < n; ++i) inject_queue[tcb->priority].push_back(batch[i]);
+    inject_size.fetch_add(n, std::memory_order_relaxed);
+}
+
+// Highest level first. Takes up to `max` threads of that level in one
+// lock hold, but no more than a fair share of the queue (its length over
+// the number of workers, as Go's globrunqget), so a burst of external
+// submissions spreads over the workers that come for it. The first is
+// returned and the rest go to our own deques.
+static TCB* inject_pop(size_t max = 1) {
+    if (inject_size.load(std::memory_order_relaxed) == 0) return nullptr;
+    TCB* batch[LOCAL_QUEUE_SIZE / 2];
+    size_t n = 0;
+    {
+        std::lock_guard<std::mutex> lock(inject_lock);
+        size_t share = inject_size.load(std::memory_order_relaxed) / workers.size() + 1;
+        max = std::min({max, share, LOCAL_QUEUE_SIZE / 2});
+        for (auto& q : inject_queue) {
+            while (n < max) {
+                TCB* tcb = q.pop_front();
+                if (!tcb) break;
+                batch[n++] = tcb;
+            }
+            if (n > 0) break;
+        }
+        inject_size.fetch_sub(n, std::memory_order_relaxed);
+    }
+    for (size_t k = 1; k < n; ++k) push_ready(batch[k]);
+    return n > 0 ? batch[0] : nullptr;
+}
+
+// Moves every thread in `w`'s inbox to our own deques, returning the
+// first.
+static TCB* inbox_take(Worker* w) {
+    if (w->inbox.size.load(std::memory_order_relaxed) == 0) return nullptr;
+    TcbList list;
+    {
+        std::lock_guard<std::mutex> lock(w->inbox.lock);
+        list = w->inbox.list;
+        w->inbox.list = TcbList();
+        w->inbox.size.store(0, std::memory_order_relaxed);
+    }
+    TCB* first = list.pop_front();
+    while (TCB* tcb = list.pop_front()) push_ready(tcb);
+    return first;
+}
+
+// Highest level first, except that a level passed over PRIORITY_AGING
+// times while it had work gets the next turn, so low priorities make
+// progress under a steady stream of higher-priority work.
+static TCB* take_local() {
+    Worker* w = my_worker;
+    for (int p = PRIORITY_LEVELS - 1; p > 0; --p) {
+        if (w->starve[p] < PRIORITY_AGING) continue;
+        w->starve[p] = 0;
+        if (TCB* t = w->ready_queue.level[p].take()) return t;
+    }
+    for (int p = 0; p < PRIORITY_LEVELS; ++p) {
+        TCB* t = w->ready_queue.level[p].take();
+        if (!t) continue;
+        w->starve[p] = 0;
+        for (int q = p + 1; q < PRIORITY_LEVELS; ++q) {
+            if (!w->ready_queue.level[q].empty()) ++w->starve[q];
+        }
+        return t;
+    }
+    return nullptr;
+}
+
+// Kernel threads outside the runtime (the blocking pool, create() and
+// spawn() callers) have no queue of their own and go through the
+// injection queue.
+static void inject_push(TCB* tcb) {
+    std::lock_guard<std::mutex> lock(inject_lock);
+    inject_queue[tcb->priority].push_back(tcb);
+    inject_size.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Wakes `w` if it is parked; any other state means it will look at its
+// inbox before it next parks.
+static void wake_worker(Worker* w) {
+    // Pairs with the fence in park_worker, as in wake_one().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (w->park_word.load(std::memory_order_relaxed) != 0 && unlist_idle(w)) unpark(w);
+}
+
+// Queues a READY thread on `target`: our own deques, another worker's
+// inbox, or the injection queue when called from outside the runtime.
+// With `next`, a woken thread of at least the waker's priority takes our
+// runnext slot instead, and whatever was there goes to the back of the
+// ready queue (as in Go's runqput). A lower-priority one queues as usual,
+// so it cannot jump ahead of more urgent work. In message passing the
+// woken thread is the one with work to do, and it should run here while
+// the message is still in cache, not wait behind the whole queue or be
+// stolen onto another core.
+static void ready_on(TCB* tcb, Worker* target, bool next = false) {
+    PreemptGuard guard;
+    tcb->state = ThreadState::READY;
+    stats_mark_ready(tcb);
+    trace(TRACE_WAKE, tcb->id);
+    if (!my_worker) {
+        inject_push(tcb);
+    } else if (target == my_worker) {
+#ifndef UTHREAD_NO_RUNNEXT
+        TCB* running = my_worker->running;
+        if (next && running && tcb->priority <= running->priority) {
+            tcb = my_worker->runnext.exchange(tcb, std::memory_order_acq_rel);
+        }
+        if (tcb) push_ready(tcb);
+#else
+        (void)next;
+        push_ready(tcb);
+#endif
+    } else {
+        {
+            std::lock_guard<std::mutex> lock(target->inbox.lock);
+            target->inbox.list.push_back(tcb);
+            target->inbox.size.fetch_add(1, std::memory_order_relaxed);
+        }
+        wake_worker(target);
+        return;
+    }
+    wake_one();
+}
+
+void uthread::detail::make_runnable(TCB* tcb) {
+    ready_on(tcb, my_worker, true);
+}
+
+// Calls visit(victim) on every other worker until it returns true:
+// nearest tier first, each tier in a random order (start + i*stride
+// mod n, with the stride coprime to n, visits every member once).
+template <typename Visit>
+static bool visit_victims(Visit visit) {
+    for (const StealTier& tier : my_worker->steal_tiers) {
+        const uint32_t n = tier.victims.size();
+        uint32_t start = my_worker->rng.next() % n;
+        uint32_t stride = tier.strides[my_worker->rng.next() % tier.strides.size()];
+        for (uint32_t i = 0, k = start; i < n; ++i, k = (k + stride) % n) {
+            if (visit(workers[tier.victims[k]].get())) return true;
+        }
+    }
+    return false;
+}
+
+static void count_steal(Worker* victim, uint64_t moved) {
+    bump(my_worker->steal_stats.successes);
+    bump(my_worker->steal_stats.tasks_moved, moved);
+    if (victim->place.node != my_worker->place.node) bump(my_worker->steal_stats.cross_node);
+}
+
+// Called with empty local deques. Takes half of the first non-empty
+// queue found: the first task is returned to run, the rest land in our
+// own deques. All workers are searched for high-priority work before any
+// lower level.
+static TCB* steal_work() {
+    TCB* batch[LOCAL_QUEUE_SIZE / 2];
+    TCB* found = nullptr;
+    for (int p = 0; p < PRIORITY_LEVELS && !found; ++p) {
+        visit_victims([&](Worker* victim) {
+            auto& queue = victim->ready_queue.level[p];
+            if (queue.empty()) return false;
+
+            bump(my_worker->steal_stats.attempts);
+            size_t got = queue.steal_half(batch, LOCAL_QUEUE_SIZE / 2);
+            if (got == 0) return false;
+
+            count_steal(victim, got);
+            for (size_t k = 0; k < got; ++k) trace(TRACE_STEAL, batch[k]->id, victim->id);
+            for (size_t k = 1; k < got; ++k) {
+                push_ready(batch[k]);
+            }
+            found = batch[0];
+            return true;
+        });
+    }
+    // Threads placed on a worker that has not got round to them yet.
+    if (!found) {
+        visit_victims([&](Worker* victim) {
+            found = inbox_take(victim);
+            if (!found) return false;
+            count_steal(victim, 1);
+            trace(TRACE_STEAL, found->id, victim->id);
+            return true;
+        });
+    }
+    // Last, a runnext slot. A busy victim is most likely about to switch
+    // to it, so give it the grace period first. Go sleeps for it, but a
+    // 3 us usleep() takes some 50 us of timer slack, so spin instead.
+    if (!found) {
+        visit_victims([&](Worker* victim) {
+            TCB* t = victim->runnext.load(std::memory_order_relaxed);
+            if (!t) return false;
+            bump(my_worker->steal_stats.attempts);
+            if (victim->park_word.load(std::memory_order_relaxed) == 0) {
+                uint64_t until = now_ns() + RUNNEXT_GRACE_US * 1000;
+                while (victim->runnext.load(std::memory_order_relaxed) == t && now_ns() < until) cpu_relax();
+            }
+            if (!victim->runnext.compare_exchange_strong(t, nullptr, std::memory_order_acquire)) return false;
+            count_steal(victim, 1);
+            trace(TRACE_STEAL, t->id, victim->id);
+            found = t;
+            return true;
+        });
+    }
+    return found;
+}
 
 // ---------------------------------------------------------
-// NEW: IO Poller (Global)
+// Thread Control Blocks
 // ---------------------------------------------------------
-static int global_epoll_fd = -1;
-static std::mutex poll_lock;
-static std::unordered_map<int, std::shared_ptr<TCB>> fd_to_thread;
+// A TCB's lifetime is explicit: alloc_tcb() when the thread is created,
+// free_tcb() when the scheduler switches out of it FINISHED. Nothing else
+// owns one; queues and waiters borrow it only while the thread is READY
+// or BLOCKED. Each worker keeps freed TCBs on an intrusive free list and
+// refills it TCB_SLAB at a time, so spawning never calls malloc in the
+// steady state. Slabs are never handed back: the runtime keeps as many
+// TCBs as it ever had threads alive at once, as Go does with its Gs.
 
-static void init_poller() {
-    global_epoll_fd = epoll_create1(0);
-    if (global_epoll_fd == -1) {
-        perror("epoll_create1");
-        exit(1);
+static TCB* alloc_tcb(Stack stack) {
+    Worker* w = my_worker;
+    if (!w) {
+        // Created outside the runtime; it joins a free list when it ends.
+        TCB* tcb = new TCB();
+        tcb->id = next_tid++;
+        tcb->stack = stack;
+        return tcb;
+    }
+    if (!w->free_tcbs) {
+        TCB* slab = new TCB[TCB_SLAB];
+        for (size_t i = TCB_SLAB; i-- > 0;) {
+            slab[i].next = w->free_tcbs;
+            w->free_tcbs = &slab[i];
+        }
     }
+    TCB* tcb = w->free_tcbs;
+    w->free_tcbs = tcb->next;
+    new (tcb) TCB();
+    tcb->id = next_tid++;
+    tcb->stack = stack;
+    return tcb;
+}
+
+// From the calling worker's pool. Outside the runtime the stack is
+// mapped directly, and joins a pool when the thread finishes.
+static Stack new_stack(size_t size) {
+    return my_worker ? my_worker->stack_pool.allocate(size) : StackPool::map_stack(size);
+}
+
+// On the worker that saw the thread finish, whichever created it.
+static void free_tcb(TCB* tcb) {
+    Worker* w = my_worker;
+    w->stack_pool.release(tcb->stack);
+    if (tcb->closure_align) ::operator delete(tcb->closure, std::align_val_t(tcb->closure_align));
+    tcb->next = w->free_tcbs;
+    w->free_tcbs = tcb;
 }
 
 // ---------------------------------------------------------
-// Scheduler Logic
+// Spawn Placement
 // ---------------------------------------------------------
+// A new thread goes to the worker its Placement picks. Local is the
+// creator's own deque. The other policies may pick another worker, and
+// since only a worker pushes to its own deques the thread goes to that
+// worker's inbox, which it drains before its local queue, and it is
+// woken if parked. Loads are read without synchronization, which is
+// good enough for spreading work.
+static uthread::Placement spawn_placement = uthread::Placement::Local;
 
-static void check_io_events() {
-    if (poll_lock.try_lock()) {
-        struct epoll_event events[MAX_EVENTS];
-        int n = epoll_wait(global_epoll_fd, events, MAX_EVENTS, 0);
-        
-        for (int i = 0; i < n; ++i) {
-            int fd = events[i].data.fd;
-            auto it = fd_to_thread.find(fd);
-            if (it != fd_to_thread.end()) {
-                auto tcb = it->second;
-                fd_to_thread.erase(it); // Remove from waiting map
-                
-                epoll_ctl(global_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
-
-                tcb->state = ThreadState::READY;
-                {
-                    std::lock_guard<std::mutex> qlock(my_worker->queue_lock);
-                    my_worker->ready_queue.push_back(tcb);
+// Threads queued on `w`, plus the one it is running unless parked.
+static size_t worker_load(Worker* w) {
+    size_t n = w->inbox.size.load(std::memory_order_relaxed);
+    if (w->runnext.load(std::memory_order_relaxed)) ++n;
+    for (const auto& q : w->ready_queue.level) n += q.size();
+    if (w->park_word.load(std::memory_order_relaxed) == 0) ++n;
+    return n;
+}
+
+static Worker* place(uthread::Placement placement) {
+    Worker* me = my_worker;
+    if (placement == uthread::Placement::Default) placement = spawn_placement;
+    if (workers.size() == 1) return me;
+    switch (placement) {
+        case uthread::Placement::RoundRobin:
+            return workers[me->deal++ % workers.size()].get();
+        case uthread::Placement::LeastLoaded: {
+            // Ties go to ourselves, then to the lowest id.
+            Worker* best = me;
+            size_t least = worker_load(me);
+            for (auto& w : workers) {
+                if (least == 0) break;
+                size_t load = worker_load(w.get());
+                if (load < least) {
+                    best = w.get();
+                    least = load;
                 }
             }
+            return best;
         }
-        poll_lock.unlock();
+        default:
+            return me;
     }
 }
 
-static void schedule() {
-    while (system_running) {
-        std::shared_ptr<TCB> next_task = nullptr;
+// The common tail of create() and spawn().
+static void start_thread(TCB* tcb, uthread::Placement placement) {
+    if (my_worker) bump(my_worker->stats.spawns);
+    trace(TRACE_CREATE, tcb->id);
+    ready_on(tcb, my_worker ? place(placement) : nullptr);
+}
+
+// ---------------------------------------------------------
+// Fork-Join
+// ---------------------------------------------------------
+// parallel_for and friends push the halves they split off onto their
+// worker's fork deque rather than spawning threads. The forking thread
+// pops its half back when it gets to it and runs it inline, so a split
+// nobody wanted costs a push and a pop. Only a half that an idle worker
+// steals, or that the worker finds still queued once the forking thread
+// has blocked, gets a thread of its own.
+
+static void thread_start_wrapper();
+
+static void run_fork(void* p) {
+    auto* t = static_cast<ForkTask*>(p);
+    t->run(t);
+    sema_release(&t->done);
+}
+
+// Like spawn_closure, with the task itself as the closure.
+static TCB* fork_thread(ForkTask* t) {
+    Stack stack = my_worker->stack_pool.allocate(t->stack_size);
+    TCB* tcb = alloc_tcb(stack);
+    tcb->priority = t->priority;
+    tcb->closure_run = run_fork;
+    tcb->closure = t;
+    tcb->context.make(stack.base, stack.size, thread_start_wrapper);
+    stats_mark_ready(tcb);
+    bump(my_worker->stats.spawns);
+    trace(TRACE_CREATE, tcb->id);
+    return tcb;
+}
+
+// One fork from another worker's deque, whose id goes to *from.
+static ForkTask* steal_fork(int* from = nullptr) {
+    ForkTask* found = nullptr;
+    visit_victims([&](Worker* victim) {
+        if (victim->forks.empty()) return false;
+        bump(my_worker->steal_stats.attempts);
+        found = victim->forks.steal();
+        if (!found) return false;
+        count_steal(victim, 1);
+        if (from) *from = victim->id;
+        return true;
+    });
+    return found;
+}
+
+// Scheduler side: forks left on our own deque (their threads blocked or
+// moved away), then other workers'.
+static TCB* take_fork() {
+    ForkTask* t = my_worker->forks.pop();
+    if (t) return fork_thread(t);
+    int victim = 0;
+    t = steal_fork(&victim);
+    if (!t) return nullptr;
+    TCB* tcb = fork_thread(t);
+    trace(TRACE_STEAL, tcb->id, victim);
+    return tcb;
+}
+
+// Helping runs other forks on the joining thread's stack, so keep the
+// deeper half of it in reserve.
+static bool stack_room(const TCB* tcb) {
+    char probe;
+    return static_cast<size_t>(&probe - tcb->stack.base) > tcb->stack.size / 2;
+}
+
+bool uthread::detail::fork_wanted() {
+    // Lazy binary splitting: a split still sitting in our deque means
+    // nobody has been hungry enough to take the last one.
+    return current_tcb() && workers.size() > 1 && my_worker->forks.empty();
+}
 
-        check_io_events();
+void uthread::detail::fork(ForkTask* t) {
+    if (current_tcb()) {
+        PreemptGuard guard;
+        TCB* self = guard.tcb;
+        t->priority = self->priority;
+        t->stack_size = self->stack.size;
+        if (my_worker->forks.push(t)) {
+            wake_one();
+            return;
+        }
+    }
+    // Not on a user thread, or the deque is full: nobody could take it.
+    t->run(t);
+    t->done.store(1, std::memory_order_release);
+}
 
-        // Try local queue
+void uthread::detail::join(ForkTask* t) {
+    // While t is still ours, it is the newest fork on our deque. If it is
+    // gone, help with whatever forks are about instead of parking, until
+    // t is done or there is nothing left to take.
+    while (t->done.load(std::memory_order_acquire) == 0) {
+        ForkTask* next;
         {
-            std::lock_guard<std::mutex> lock(my_worker->queue_lock);
-            if (!my_worker->ready_queue.empty()) {
-                next_task = my_worker->ready_queue.front();
-                my_worker->ready_queue.pop_front();
+            PreemptGuard guard;
+            bool room = stack_room(my_worker->running);
+            next = my_worker->forks.pop();
+            if (next && next != t && !room) {
+                my_worker->forks.push(next); // Just popped, so there is space
+                next = nullptr;
             }
+            if (!next && room) next = steal_fork();
         }
+        if (!next) break;
+        if (next == t) {
+            t->run(t);
+            return;
+        }
+        run_fork(next);
+    }
+    sema_acquire(&t->done);
+}
 
-        // Work Stealing
-        if (!next_task && workers.size() > 1) {
-            int victim_id = rand() % workers.size();
-            if (victim_id != my_worker->id) {
-                Worker* victim = workers[victim_id].get();
-                if (victim->queue_lock.try_lock()) {
-                    if (!victim->ready_queue.empty()) {
-                        next_task = victim->ready_queue.back();
-                        victim->ready_queue.pop_back();
-                    }
-                    victim->queue_lock.unlock();
-                }
-            }
+// ---------------------------------------------------------
+// Scheduler Logic
+// ---------------------------------------------------------
+
+// Harvest I/O readiness without blocking: our own instance, then (when
+// `steal` is set) those of busy workers, whose fds nobody else watches
+// while they run a thread.
+static int poll_io(bool steal) {
+    int readied = 0;
+    if (my_worker->poll_fds.load(std::memory_order_relaxed) > 0) {
+        readied += netpoll_poll(my_worker, 0);
+    }
+    if (steal && readied == 0) {
+        for (auto& w : workers) {
+            if (w.get() == my_worker || w->park_word.load(std::memory_order_relaxed) != 0) continue;
+            if (w->poll_fds.load(std::memory_order_relaxed) == 0) continue;
+            readied += netpoll_poll(w.get(), 0);
+            if (readied) break;
         }
+    }
+    if (readied) bump(my_worker->stats.io_wakeups, readied);
+    return readied;
+}
+
+static TCB* take_runnext(Worker* w) {
+    if (!w->runnext.load(std::memory_order_relaxed)) return nullptr;
+    return w->runnext.exchange(nullptr, std::memory_order_acquire);
+}
+
+static TCB* find_runnable() {
+    Worker* w = my_worker;
+    TCB* next_task = nullptr;
 
+    // A thread woken by the last one runs first, in the rest of its
+    // slice: `tick` only advances below, so a ping-ponging pair is
+    // preempted like a single thread would be. After RUNNEXT_STREAK_MAX
+    // in a row the ready queue gets one turn.
+    if (w->runnext_streak < RUNNEXT_STREAK_MAX) {
+        next_task = take_runnext(w);
         if (next_task) {
-            my_worker->current_thread = next_task;
-            next_task->state = ThreadState::RUNNING;
-            swapcontext(&my_worker->sched_context, &next_task->context);
-            my_worker->current_thread = nullptr;
-        } else {
-            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            ++w->runnext_streak;
+            return next_task;
         }
     }
+    w->runnext_streak = 0;
+
+    // Every so often look at the injection queue first, so spilled
+    // tasks are not starved by a worker that keeps its ring busy.
+    if (++my_worker->tick % INJECT_CHECK_INTERVAL == 0) {
+        next_task = inject_pop();
+    }
+
+    // New threads placed here by other workers join our deques first,
+    // then the local queue, then a batch from the injection queue.
+    if (!next_task) {
+        if (TCB* placed = inbox_take(my_worker)) push_ready(placed);
+        next_task = take_local();
+    }
+    if (!next_task) next_task = take_runnext(w);
+    if (!next_task) next_task = inject_pop(LOCAL_QUEUE_SIZE / 2);
+
+    // Work Stealing
+    if (!next_task && workers.size() > 1) {
+        next_task = steal_work();
+    }
+    if (!next_task) next_task = take_fork();
+    return next_task;
+}
+
+static TCB* search_for_work() {
+    if (!my_worker->searching) {
+        // At most half of the busy workers spin at once.
+        int busy = static_cast<int>(workers.size()) - nr_idle.load(std::memory_order_relaxed);
+        if (2 * nr_searching.load(std::memory_order_relaxed) >= busy) return nullptr;
+        my_worker->searching = true;
+        nr_searching.fetch_add(1);
+    }
+
+    for (int i = 0; i < SPIN_ROUNDS && system_running; ++i) {
+        cpu_relax();
+        if (i == 0) poll_io(true);
+        TCB* next_task = find_runnable();
+        if (next_task) return next_task;
+    }
+    return nullptr;
+}
+
+static void stop_searching() {
+    if (!my_worker->searching) return;
+    my_worker->searching = false;
+    // The last searcher to find work wakes a replacement, since where
+    // there was one task there are often more.
+    if (nr_searching.fetch_sub(1) == 1) wake_one();
+}
+
+static void park_worker() {
+    Worker* me = my_worker;
+    if (me->searching) {
+        me->searching = false;
+        nr_searching.fetch_sub(1);
+    }
+
+    me->park_word.store(1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(idle_lock);
+        idle_workers.push_back(me);
+        nr_idle.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    // Re-check after advertising ourselves: a producer that pushed before
+    // seeing us idle will not wake anybody.
+    if ((work_available() || !system_running) && unlist_idle(me)) {
+        me->park_word.store(0, std::memory_order_relaxed);
+        return;
+    }
+
+    // Sleep until a waker writes our eventfd, one of our fds turns ready
+    // or our next timer is due.
+    bump(me->stats.parks);
+    uint64_t parked = stats_timing ? stats_ticks() : 0;
+    while (me->park_word.load(std::memory_order_acquire) != 0) {
+        int io = netpoll_poll(me, timers_timeout_ms(me));
+        int timed = timers_run(me);
+        if (io) bump(me->stats.io_wakeups, io);
+        if (timed) bump(me->stats.timer_wakeups, timed);
+        if (io + timed > 0 && unlist_idle(me)) {
+            me->park_word.store(0, std::memory_order_relaxed);
+        }
+        stats_poll_dump();
+    }
+    if (stats_timing) bump(me->stats.idle_ticks, stats_ticks() - parked);
+}
+
+static void schedule() {
+    while (system_running) {
+        // Local work first; look at our fds when the queue runs dry and
+        // every INJECT_CHECK_INTERVAL ticks, so a busy worker still
+        // notices readiness without a syscall per switch. After a thread
+        // was preempted the queue is CPU-bound and ticks are a slice
+        // apart, so look right away.
+        bool queue_empty = my_worker->ready_queue.empty() && !my_worker->runnext.load(std::memory_order_relaxed);
+        bool check_io = my_worker->tick % INJECT_CHECK_INTERVAL == 0 || queue_empty || my_worker->preempted;
+        my_worker->preempted = false;
+        if (check_io) {
+            poll_io(false);
+            stats_poll_dump();
+        }
+        if (int timed = timers_run(my_worker)) bump(my_worker->stats.timer_wakeups, timed);
+
+        // io_uring: submit what our threads queued up, in one syscall
+        // where possible, and resume the ones whose operations completed.
+        if (my_worker->ring) {
+            if (uring_wants_flush(my_worker, check_io)) uring_flush(my_worker);
+            if (int done = uring_reap(my_worker)) bump(my_worker->stats.io_wakeups, done);
+        }
+
+        TCB* next_task = find_runnable();
+        if (!next_task) next_task = search_for_work();
+        if (!next_task) {
+            park_worker();
+            continue;
+        }
+        stop_searching();
+
+        next_task->state = ThreadState::RUNNING;
+        next_task->preempt_pending = false;
+        my_worker->running = next_task;
+        bump(my_worker->stats.switches);
+        bool timed = stats_sample(my_worker->stats.switch_sample);
+        uint64_t switched_in = 0, switched_out = 0;
+        if (timed || next_task->ready_ticks) {
+            switched_in = stats_ticks();
+            if (next_task->ready_ticks) stats_record(my_worker->stats.wait_hist, switched_in - next_task->ready_ticks);
+            next_task->ready_ticks = 0;
+        }
+        trace(TRACE_RUN, next_task->id);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        Context::swap(my_worker->sched_context, next_task->context);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        my_worker->running = nullptr;
+        if (timed) {
+            switched_out = stats_ticks();
+            stats_record(my_worker->stats.slice_hist, switched_out - switched_in);
+            bump(my_worker->stats.busy_ticks, (switched_out - switched_in) * STATS_SAMPLE_INTERVAL);
+        }
+
+        // The thread is off its stack now, so it is safe to publish it
+        // to queues other workers can steal from.
+        if (next_task->state == ThreadState::READY) {
+            trace(my_worker->preempted ? TRACE_PREEMPT : TRACE_YIELD, next_task->id);
+            next_task->ready_ticks = switched_out; // Sampled with the slice
+            push_ready(next_task);
+        } else if (next_task->state == ThreadState::BLOCKED && my_worker->block_commit) {
+            // Once the commit succeeds another worker may already be
+            // running the thread, so next_task must not be touched after.
+            trace(TRACE_BLOCK, next_task->id);
+            BlockCommit commit = my_worker->block_commit;
+            my_worker->block_commit = nullptr;
+            if (!commit(next_task, my_worker->block_arg)) {
+                trace(TRACE_WAKE, next_task->id);
+                next_task->state = ThreadState::READY;
+                next_task->ready_ticks = switched_out;
+                push_ready(next_task);
+            }
+        } else if (next_task->state == ThreadState::FINISHED) {
+            trace(TRACE_FINISH, next_task->id);
+            free_tcb(next_task);
+        }
+    }
+}
+
+void uthread::detail::block_current(BlockCommit commit, void* arg) {
+    PreemptGuard guard;
+    TCB* tcb = my_worker->running;
+    tcb->state = ThreadState::BLOCKED;
+    my_worker->block_commit = commit;
+    my_worker->block_arg = arg;
+    Context::swap(tcb->context, my_worker->sched_context);
 }
 
 static void thread_start_wrapper() {
-    if (my_worker->current_thread && my_worker->current_thread->func) {
-        my_worker->current_thread->func();
+    // Threads start with preemption held off, like any thread switching
+    // in; from here on it runs user code.
+    TCB* tcb = my_worker->running;
+    tcb->preempt_off = 0;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    if (tcb->func) {
+        tcb->func();
+    } else if (tcb->closure_run) {
+        tcb->closure_run(tcb->closure);
+    }
+
+    // We may have moved to another worker meanwhile, but tcb is still
+    // ours. A heap closure is freed along with the TCB.
+    tcb->preempt_off = 1;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    tcb->state = ThreadState::FINISHED;
+    Context::jump(my_worker->sched_context);
+}
+
+// 0: same core (SMT siblings, or one CPU when workers outnumber CPUs),
+// 1: same last-level cache, 2: same node, 3: another node. Unpinned
+// workers are all equally far apart.
+static int steal_distance(const CpuPlace& a, const CpuPlace& b) {
+    if (a.cpu < 0 || b.cpu < 0) return 0;
+    if (a.core == b.core) return 0;
+    if (a.l3 == b.l3) return 1;
+    if (a.node == b.node) return 2;
+    return 3;
+}
+
+static void build_steal_tiers(Worker* w) {
+    std::vector<uint32_t> by_distance[4];
+    for (auto& v : workers) {
+        if (v.get() != w) by_distance[steal_distance(w->place, v->place)].push_back(v->id);
+    }
+    for (auto& victims : by_distance) {
+        if (victims.empty()) continue;
+        StealTier tier;
+        uint32_t n = victims.size();
+        for (uint32_t s = 1; s <= n; ++s) {
+            if (std::gcd(s, n) == 1) tier.strides.push_back(s);
+        }
+        tier.victims = std::move(victims);
+        w->steal_tiers.push_back(std::move(tier));
     }
-    my_worker->current_thread->state = ThreadState::FINISHED;
-    setcontext(&my_worker->sched_context);
 }
 
 static void worker_entry_point(int worker_id) {
     my_worker = workers[worker_id].get();
+    if (my_worker->place.cpu >= 0) pin_thread(my_worker->place.cpu);
+    if (preempt_enabled()) preempt_start_worker(my_worker);
     schedule();
+    if (preempt_enabled()) preempt_stop_worker(my_worker);
 }
 
 // ---------------------------------------------------------
@@ -155,43 +838,108 @@ static void worker_entry_point(int worker_id) {
 
 namespace uthread {
     void init(int num_cores) {
-        if (num_cores <= 0) num_cores = 4;
-        init_poller();
+        Options options;
+        options.num_cores = num_cores;
+        init(options);
+    }
 
-        workers.push_back(std::make_unique<Worker>(0));
+    void init(const Options& options) {
+        topology_init();
+        const std::vector<CpuPlace>& cpus = topology_cpus();
+        int num_cores = options.num_cores > 0 ? options.num_cores : std::max<int>(1, cpus.size());
+        netpoll_init();
+        blocking_init(options.max_blocking_threads);
+        stats_init(options.stats_timing, options.stats_on_sigusr1);
+        spawn_placement = options.spawn_placement == Placement::Default ? Placement::Local : options.spawn_placement;
+
+        for (int i = 0; i < num_cores; ++i) {
+            workers.push_back(std::make_unique<Worker>(i));
+            Worker* w = workers[i].get();
+            w->deal = i + 1; // Workers start dealing at different places
+            netpoll_init_worker(w);
+            if (options.pin_workers && !cpus.empty()) {
+                w->place = cpus[i % cpus.size()];
+                // TCBs and the like come from malloc on the worker's own
+                // kernel thread, so first touch already keeps them local.
+                if (topology_nodes() > 1) w->stack_pool.set_node(w->place.node);
+            }
+        }
+        for (auto& w : workers) build_steal_tiers(w.get());
+        // Without io_uring support every call takes the epoll path.
+        if (options.io_backend == IoBackend::IoUring) uring_init(workers);
         my_worker = workers[0].get();
 
+        // Timers are per kernel thread, so each worker arms its own; this
+        // thread becomes worker 0 in run_scheduler_loop().
+        if (my_worker->place.cpu >= 0) pin_thread(my_worker->place.cpu);
+        if (options.time_slice.count() > 0) {
+            preempt_init(options.time_slice);
+            preempt_start_worker(my_worker);
+        }
+
         for (int i = 1; i < num_cores; ++i) {
-            workers.push_back(std::make_unique<Worker>(i));
             workers[i]->thread_obj = std::thread(worker_entry_point, i);
         }
     }
 
-    void create(void (*func)(), int priority) {
-        (void)priority;
-        auto tcb = std::make_shared<TCB>(next_tid++, func);
-        getcontext(&tcb->context);
-        tcb->context.uc_stack.ss_sp = tcb->stack.data();
-        tcb->context.uc_stack.ss_size = STACK_SIZE;
-        tcb->context.uc_link = nullptr;
-        makecontext(&tcb->context, thread_start_wrapper, 0);
+    void create(void (*func)(), int priority, size_t stack_size) {
+        PreemptGuard guard;
+        if (stack_size == 0) stack_size = STACK_SIZE;
+        Stack stack = new_stack(stack_size);
+        TCB* tcb = alloc_tcb(stack);
+        tcb->func = func;
+        tcb->priority = priority_level(priority);
+        tcb->context.make(stack.base, stack.size, thread_start_wrapper);
+        start_thread(tcb, Placement::Default);
+    }
+
+    void detail::spawn_closure(const SpawnOptions& options, ClosureRun run, ClosureMove move, void* src,
+                               size_t size, size_t align) {
+        PreemptGuard guard;
+        size_t stack_size = options.stack_size ? options.stack_size : STACK_SIZE;
+        Stack stack = new_stack(stack_size);
+        TCB* tcb = alloc_tcb(stack);
+        tcb->priority = priority_level(options.priority);
+        tcb->closure_run = run;
+
+        // Small closures take the top of the stack; the thread's first
+        // frame starts below them.
+        size_t stack_left = stack.size;
+        if (size <= CLOSURE_INLINE_MAX) {
+            uintptr_t top = reinterpret_cast<uintptr_t>(stack.base) + stack.size;
+            uintptr_t at = (top - size) & ~(uintptr_t(std::max<size_t>(align, 16)) - 1);
+            tcb->closure = reinterpret_cast<void*>(at);
+            stack_left = at - reinterpret_cast<uintptr_t>(stack.base);
+        } else {
+            tcb->closure = ::operator new(size, std::align_val_t(align));
+            tcb->closure_align = align;
+        }
+        move(tcb->closure, src);
+        tcb->context.make(stack.base, stack_left, thread_start_wrapper);
+        start_thread(tcb, options.placement);
+    }
+
+    void set_priority(int priority) {
+        // Takes effect the next time the thread is queued.
+        current_tcb()->priority = priority_level(priority);
+    }
 
-        std::lock_guard<std::mutex> lock(my_worker->queue_lock);
-        my_worker->ready_queue.push_back(tcb);
+    int get_priority() {
+        static const int level_priority[PRIORITY_LEVELS] = {PRIORITY_HIGH, PRIORITY_NORMAL, PRIORITY_LOW};
+        return level_priority[current_tcb()->priority];
     }
 
     void yield() {
-        auto tcb = my_worker->current_thread;
-        {
-            std::lock_guard<std::mutex> lock(my_worker->queue_lock);
-            tcb->state = ThreadState::READY;
-            my_worker->ready_queue.push_back(tcb);
-        }
-        swapcontext(&tcb->context, &my_worker->sched_context);
+        // The scheduler requeues us once our context is saved.
+        PreemptGuard guard;
+        TCB* tcb = my_worker->running;
+        tcb->state = ThreadState::READY;
+        Context::swap(tcb->context, my_worker->sched_context);
     }
     
     void run_scheduler_loop() {
         schedule(); // The main thread helps run tasks here.
+        if (preempt_enabled()) preempt_stop_worker(my_worker);
         
         // --- NEW: When we return here, system_running is false. ---
         // We must wait for the other workers to finish to prevent the crash.
@@ -203,43 +951,35 @@ namespace uthread {
     }
     
     void exit() {
-        setcontext(&my_worker->sched_context);
+        TCB* tcb = current_tcb();
+        tcb->preempt_off = 1;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        tcb->state = ThreadState::FINISHED;
+        Context::jump(my_worker->sched_context);
     }
 
-    // Mutex stubs
-    void Mutex::lock() {}
-    void Mutex::unlock() {}
-
-    // Async IO Implementation
-    int socket_read(int fd, char* buf, size_t len) {
-        int flags = fcntl(fd, F_GETFL, 0);
-        if (!(flags & O_NONBLOCK)) {
-            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    std::vector<StealStats> steal_stats() {
+        std::vector<StealStats> out;
+        for (auto& w : workers) {
+            StealStats st;
+            st.worker_id = w->id;
+            st.attempts = w->steal_stats.attempts.load(std::memory_order_relaxed);
+            st.successes = w->steal_stats.successes.load(std::memory_order_relaxed);
+            st.tasks_moved = w->steal_stats.tasks_moved.load(std::memory_order_relaxed);
+            st.cross_node = w->steal_stats.cross_node.load(std::memory_order_relaxed);
+            st.cpu = w->place.cpu;
+            st.node = w->place.node;
+            out.push_back(st);
         }
+        return out;
+    }
 
-        while (true) {
-            ssize_t n = read(fd, buf, len);
-
-            if (n >= 0) return n; 
-            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
-
-            // Block and wait for Epoll
-            {
-                std::lock_guard<std::mutex> lock(poll_lock);
-                fd_to_thread[fd] = my_worker->current_thread;
-                
-                struct epoll_event ev;
-                ev.events = EPOLLIN | EPOLLONESHOT;
-                ev.data.fd = fd;
-                epoll_ctl(global_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
-            }
-
-            my_worker->current_thread->state = ThreadState::BLOCKED;
-            swapcontext(&my_worker->current_thread->context, &my_worker->sched_context);
-        }
+    size_t detail::injection_queued() {
+        return inject_size.load(std::memory_order_relaxed);
     }
-    
+
     void shutdown() {
-      system_running=false;
-      }
+        system_running = false;
+        wake_all();
+    }
 }
@@ -0,0 +1,135 @@
+#ifndef UTHREAD_WORK_DEQUE_H
+#define UTHREAD_WORK_DEQUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// ---------------------------------------------------------
+// Bounded Chase-Lev work-stealing deque
+// ---------------------------------------------------------
+// Orderings follow Le et al., "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (PPoPP'13), with a fixed ring instead of a growable
+// one: push() reports failure when full and the caller spills elsewhere.
+//
+// Only the owning worker may call push() and take(). Any thread may call
+// steal() or steal_half(). The owner consumes from the top like a thief
+// does, so yield() keeps round-robin order. Because every consumer CASes
+// the top, a thief can claim a whole range in one CAS (steal_half); the
+// classic LIFO pop() at the bottom skips that CAS and would race with it,
+// so the ready queues never use it. The owner only pays for a CAS when
+// it races a thief for the same element. Fork-join deques, which only
+// see single steals, do use the LIFO pop().
+template <typename T, size_t Capacity>
+class WorkDeque {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    static constexpr int64_t MASK = Capacity - 1;
+
+public:
+    static constexpr size_t capacity = Capacity;
+
+    // Owner only. Returns false if the ring is full.
+    bool push(T item) {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_acquire);
+        if (b - t >= static_cast<int64_t>(Capacity)) return false;
+
+        buffer_[b & MASK].store(item, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Owner only. Oldest element (FIFO); retries if a thief wins the race.
+    T take() {
+        while (true) {
+            int64_t t = top_.load(std::memory_order_acquire);
+            int64_t b = bottom_.load(std::memory_order_relaxed);
+            if (t >= b) return nullptr;
+
+            T item = buffer_[t & MASK].load(std::memory_order_relaxed);
+            if (top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                             std::memory_order_relaxed)) {
+                return item;
+            }
+        }
+    }
+
+    // Owner only. Newest element (LIFO), the classic Chase-Lev pop. It
+    // only races a thief for the last element, which single-element
+    // steal() handles; never mix it with steal_half() on one deque.
+    T pop() {
+        int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top_.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        T item = buffer_[b & MASK].load(std::memory_order_relaxed);
+        if (t == b) {
+            if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                              std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            bottom_.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Any thread. Returns nullptr if empty or if another thread won the race.
+    T steal() {
+        int64_t t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom_.load(std::memory_order_acquire);
+        if (t >= b) return nullptr;
+
+        T item = buffer_[t & MASK].load(std::memory_order_relaxed);
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                          std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    // Any thread. Claims the older half of the elements (rounded up, at
+    // most `max`) with a single CAS and copies them into `out`. Returns the
+    // number taken; 0 means the deque was empty.
+    size_t steal_half(T* out, size_t max) {
+        while (true) {
+            int64_t t = top_.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t b = bottom_.load(std::memory_order_acquire);
+            int64_t n = b - t;
+            if (n <= 0) return 0;
+
+            n -= n / 2;
+            if (n > static_cast<int64_t>(max)) n = static_cast<int64_t>(max);
+            for (int64_t i = 0; i < n; ++i) {
+                out[i] = buffer_[(t + i) & MASK].load(std::memory_order_relaxed);
+            }
+            if (top_.compare_exchange_strong(t, t + n, std::memory_order_seq_cst,
+                                             std::memory_order_relaxed)) {
+                return static_cast<size_t>(n);
+            }
+        }
+    }
+
+    // Approximate when called from a non-owner.
+    size_t size() const {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_relaxed);
+        return b > t ? static_cast<size_t>(b - t) : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    alignas(64) std::atomic<int64_t> top_{0};
+    alignas(64) std::atomic<int64_t> bottom_{0};
+    alignas(64) std::atomic<T> buffer_[Capacity] = {};
+};
+
+#endif
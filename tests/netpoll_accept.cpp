@@ -0,0 +1,125 @@
+#include "../include/uthread.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// Several threads waiting on the same fd in the same direction: each
+// must still be woken. One worker, so the waits always overlap.
+//  * two acceptors, two connections: both accepts return
+//  * a timed acceptor queued behind an untimed one times out alone
+//  * closing the fd fails both waiters with EBADF
+// A waiter that is never woken hangs, which the alarm turns into a failure.
+using namespace std::chrono_literals;
+
+static int port = 0;
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+    std::printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+    if (!ok) ++failures;
+}
+
+static int listen_socket() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 16) != 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+        std::perror("listen");
+        std::exit(1);
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+// Completes from the listen backlog, so it never blocks for long.
+static int connect_client() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        std::perror("connect");
+        std::exit(1);
+    }
+    return fd;
+}
+
+static void two_acceptors() {
+    int server_fd = listen_socket();
+    int got[2] = {-1, -1};
+    auto a = uthread::spawn([&] { got[0] = uthread::socket_accept(server_fd); });
+    auto b = uthread::spawn([&] { got[1] = uthread::socket_accept(server_fd); });
+    uthread::sleep_for(10ms); // Both are waiting now
+    int c1 = connect_client();
+    int c2 = connect_client();
+    a.join();
+    b.join();
+    check(got[0] >= 0 && got[1] >= 0, "two acceptors on one fd both return");
+    for (int fd : {got[0], got[1]}) {
+        if (fd >= 0) uthread::socket_close(fd);
+    }
+    close(c1);
+    close(c2);
+    uthread::socket_close(server_fd);
+}
+
+static void queued_deadline() {
+    int server_fd = listen_socket();
+    int first = -1, second = -1, second_errno = 0;
+    auto a = uthread::spawn([&] { first = uthread::socket_accept(server_fd); });
+    uthread::sleep_for(10ms);
+    auto b = uthread::spawn([&] {
+        second = uthread::socket_accept(server_fd, nullptr, nullptr, std::chrono::steady_clock::now() + 20ms);
+        second_errno = errno;
+    });
+    b.join();
+    check(second == -1 && second_errno == ETIMEDOUT, "queued acceptor times out");
+    int c = connect_client();
+    a.join();
+    check(first >= 0, "first acceptor still woken after the second timed out");
+    if (first >= 0) uthread::socket_close(first);
+    close(c);
+    uthread::socket_close(server_fd);
+}
+
+static void close_wakes_all() {
+    int server_fd = listen_socket();
+    int got[2] = {0, 0}, errs[2] = {0, 0};
+    auto a = uthread::spawn([&] {
+        got[0] = uthread::socket_accept(server_fd);
+        errs[0] = errno;
+    });
+    auto b = uthread::spawn([&] {
+        got[1] = uthread::socket_accept(server_fd);
+        errs[1] = errno;
+    });
+    uthread::sleep_for(10ms);
+    uthread::socket_close(server_fd);
+    a.join();
+    b.join();
+    check(got[0] == -1 && errs[0] == EBADF && got[1] == -1 && errs[1] == EBADF, "close fails both acceptors");
+}
+
+int main() {
+    alarm(10);
+    uthread::init(1);
+    uthread::create([] {
+        two_acceptors();
+        queued_deadline();
+        close_wakes_all();
+        uthread::shutdown();
+    });
+    uthread::run_scheduler_loop();
+    return failures ? 1 : 0;
+}